@@ -47,23 +47,33 @@ struct lpage;
 #define INVALID_PADDR	((paddr_t)0)
 
 /* MMU control */
+void mmu_initas(struct addrspace *as);
 void mmu_setas(struct addrspace *as);
 void mmu_unmap(struct addrspace *as, vaddr_t va);
 void mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable);
+void mmu_map_zero(struct addrspace *as, vaddr_t va);
+bool mmu_map_fast(struct addrspace *as, vaddr_t va, paddr_t pa, int writable,
+		  struct lpage *lp, unsigned seq, bool prefault);
 
 /* physical page allocation */
 paddr_t coremap_allocuser(struct lpage *lp);
+paddr_t coremap_allocuser_zeroed(struct lpage *lp);
 void coremap_free(paddr_t page, bool iskern);
+void coremap_freeuser(paddr_t page);
 
 /* physical page pinning */
 void coremap_pin(paddr_t paddr);
 int coremap_pageispinned(paddr_t paddr);
 void coremap_unpin(paddr_t paddr);
+void coremap_unmap_page(paddr_t paddr);
 
 /* special ops on physical pages */
 void coremap_zero_page(paddr_t paddr);
 void coremap_copy_page(paddr_t oldpaddr, paddr_t newpaddr);
 
+/* clearing pages ahead of time, from the idle loop */
+bool coremap_idle_prezero(void);
+
 /*
  * Routines for mapping physical pages into the kernel so the machine-
  * independent code can manipulate them. (This is for page content
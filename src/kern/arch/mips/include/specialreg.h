@@ -87,6 +87,14 @@
 
 #define CIN_INDEXSHIFT  8       /* shift for CIN_INDEX field */
 
+/*
+ * Fields of the c0_entryhi register
+ */
+#define CEH_VPN    0xfffff000   /* virtual page number */
+#define CEH_PID    0x00000fc0   /* address space ID to match */
+
+#define CEH_PIDSHIFT    6       /* shift for CEH_PID field */
+
 /*
  * Fields of the c0_context register
  *
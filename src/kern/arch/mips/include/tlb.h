@@ -59,14 +59,17 @@ void tlb_random(uint32_t entryhi, uint32_t entrylo);
 void tlb_write(uint32_t entryhi, uint32_t entrylo, uint32_t index);
 void tlb_read(uint32_t *entryhi, uint32_t *entrylo, uint32_t index);
 int tlb_probe(uint32_t entryhi, uint32_t entrylo);
+void tlb_setpid(uint32_t pid);
 
 /*
  * TLB entry fields.
  *
- * Note that the MIPS has support for a 6-bit address space ID. In the
- * interests of simplicity, we don't use it. The fields related to it
- * (TLBLO_GLOBAL and TLBHI_PID) can be left always zero, as can the
- * bits that aren't assigned a meaning.
+ * Note that the MIPS has support for a 6-bit address space ID (the
+ * TLBHI_PID field). An entry only matches when its PID equals the one
+ * in c0_entryhi, which tlb_setpid loads; see the ASID code in
+ * coremap.c. TLBLO_GLOBAL, which would make an entry match every PID,
+ * can be left always zero, as can the bits that aren't assigned a
+ * meaning.
  *
  * The TLBLO_DIRTY bit is actually a write privilege bit - it is not
  * ever set by the processor. If you set it, writes are permitted. If
@@ -78,7 +81,11 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 /* Fields in the high-order word */
 #define TLBHI_VPAGE   0xfffff000
-/*      TLBHI_PID     0x00000fc0 */
+#define TLBHI_PID     0x00000fc0
+#define TLBHI_PIDSHIFT 6
+
+#define TLBHI_MKPID(pid)  (((uint32_t)(pid)) << TLBHI_PIDSHIFT)
+#define NUM_TLBPID    64	/* number of distinct PID values */
 
 /* Fields in the low-order word */
 #define TLBLO_PPAGE   0xfffff000
@@ -30,6 +30,8 @@
 #ifndef _MIPS_VM_H_
 #define _MIPS_VM_H_
 
+#include <spinlock.h>	/* for struct cpu_vm_machdep */
+struct wchan;
 
 /*
  * Machine-dependent VM system definitions.
@@ -108,18 +110,43 @@ void ram_bootstrap(void);
 paddr_t ram_stealmem(unsigned long npages);
 void ram_getsize(paddr_t *lo, paddr_t *hi);
 
+/*
+ * Machine-dependent per-address-space data: the address space's TLB
+ * address space ID. See the ASID code in coremap.c.
+ */
+struct mmu_asid {
+	uint32_t ma_asid;	/* TLBHI PID value */
+	uint32_t ma_gen;	/* ASID generation, or 0 if none assigned */
+	uint32_t ma_cpus;	/* CPUs that have loaded ma_asid */
+};
+
 /*
  * Machine-dependent per-CPU data
  */
 
+#define CVM_PAGECACHE_SIZE	8
+
 struct cpu_vm_machdep {
 	/* last address space loaded into MMU */
 	struct addrspace *cvm_lastas;
+	/* its ASID (0 if none), and the ASID generation of our TLB */
+	uint32_t cvm_asid;
+	uint32_t cvm_asidgen;
 
 	/* if < NUM_TLB, next TLB entry to use (when TLB not yet full) */
 	uint32_t cvm_nexttlb;
 	/* for OPT_SEQTLB, next TLB entry to use (after TLB full) */
 	uint32_t cvm_tlbseqslot;
+
+	/* threads waiting for this CPU to finish a TLB shootdown */
+	struct wchan *cvm_shootchan;
+
+	/* cache of page frames for user allocations (see coremap.c) */
+	struct spinlock cvm_pagecache_lock;
+	unsigned cvm_pagecache_num;		/* frames in the cache */
+	uint32_t cvm_pagecache[CVM_PAGECACHE_SIZE]; /* coremap indexes */
+	uint32_t cvm_pagecache_hits;		/* allocs served from it */
+	uint32_t cvm_pagecache_misses;		/* allocs that weren't */
 };
 
 void cpu_vm_machdep_init(struct cpu_vm_machdep *cvm);
@@ -38,6 +38,8 @@
 #include <platform/maxcpus.h>
 #include <cpu.h>
 #include <thread.h>
+#include <machine/coremap.h>
+#include "opt-dumbvm.h"
 
 ////////////////////////////////////////////////////////////
 
@@ -214,11 +216,18 @@ wait(void)
 }
 
 /*
- * Idle the processor until something happens.
+ * Idle the processor until something happens. If the VM system has
+ * a page it'd like cleared, do that instead; the caller will check
+ * for work and call back.
  */
 void 
 cpu_idle(void)
 {
+#if !OPT_DUMBVM
+	if (coremap_idle_prezero()) {
+		return;
+	}
+#endif
 	wait();
         cpu_irqonoff();
 }
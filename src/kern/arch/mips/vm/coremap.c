@@ -49,6 +49,7 @@
 
 #include "opt-randpage.h"
 #include "opt-randtlb.h"
+#include "opt-clockpage.h"
 
 
 /*
@@ -62,6 +63,22 @@
  * We have one coremap_entry per page of physical RAM. This is absolute
  * overhead, so it's important to keep it small - if it's overweight
  * adding more memory won't help.
+ *
+ * Free pages are kept by a buddy allocator: every free page belongs to
+ * exactly one free block of 2^k pages, aligned on a 2^k page boundary
+ * (counting from the first coremap page), and each block is on the
+ * free list for its order, threaded through the coremap entry of its
+ * first page. A page is free in this sense exactly when it is neither
+ * allocated nor pinned. Single pages and multi-page kernel blocks both
+ * come from the buddy lists, so neither needs a scan.
+ *
+ * In addition each CPU keeps a small cache of page frames for user
+ * allocations (cvm_pagecache), so that most user page allocations and
+ * frees don't need coremap_spinlock at all. See "Per-CPU page caches"
+ * below.
+ *
+ * Idle CPUs also clear free pages ahead of time into a pool that
+ * zero-fill faults take from first; see "Pre-zeroed pages" below.
  */
 
 
@@ -71,6 +88,14 @@
  */
 #define CM_MIN_SLACK		8
 
+/*
+ * When replacing a page, evict up to CM_EVICT_BATCH pages at once so
+ * their TLB shootdowns can be sent together, looking at most
+ * CM_EVICT_SCAN coremap entries for the extra ones.
+ */
+#define CM_EVICT_BATCH		4
+#define CM_EVICT_SCAN		32
+
 
 /*
  * Coremap entry structure.
@@ -85,11 +110,20 @@ struct coremap_entry {
 
 	unsigned cm_kernel:1,	/* true if kernel page */
 		cm_notlast:1,	/* true not last in sequence of kernel pages */
-		cm_allocated:1;	/* true if page in use (user or kernel) */
+		cm_allocated:1,	/* true if page in use (user or kernel) */
+		cm_referenced:1, /* true if mapped since last clock sweep */
+		cm_freehead:1,	/* true if first page of a free block */
+		cm_freeorder:5;	/* log2 of that block's size in pages */
 	volatile 
 	unsigned cm_pinned:1;	/* true if page is busy */
+
+	uint32_t cm_freenext;	/* next block on free list, or CM_NOPAGE */
+	uint32_t cm_freeprev;	/* previous block on free list, or CM_NOPAGE */
 };
 
+#define CM_NOPAGE		((uint32_t)-1)
+#define CM_NORDERS		16	/* largest free block is 2^15 pages */
+
 #define COREMAP_TO_PADDR(i)	(((paddr_t)PAGE_SIZE)*((i)+base_coremap_page))
 #define PADDR_TO_COREMAP(page)	(((page)/PAGE_SIZE) - base_coremap_page)
 
@@ -102,12 +136,12 @@ static struct spinlock coremap_spinlock = SPINLOCK_INITIALIZER;
 
 /*
  * Use one wchan for all page-pin waiting. There shouldn't be that
- * much of it or very many threads at once. Also use one wchan for all
- * TLB shootdown waiting. This is less justifiable - it maybe ought to
- * be per-CPU.
+ * much of it or very many threads at once. TLB shootdown waiting is
+ * per-CPU (cvm_shootchan), so a shootdown finishing on one CPU only
+ * wakes the threads waiting on that CPU.
  */
 static struct wchan *coremap_pinchan;
-static struct wchan *coremap_shootchan;
+static struct wchan *coremap_pageoutchan;
 
 static uint32_t num_coremap_entries;
 static uint32_t num_coremap_kernel;	/* pages allocated to the kernel */
@@ -116,9 +150,66 @@ static uint32_t num_coremap_free;	/* pages not allocated at all */
 static uint32_t base_coremap_page;
 static struct coremap_entry *coremap;
 
+/*
+ * The zero page: one page of zeros, stolen at boot alongside the
+ * coremap and never freed. Reads of anonymous pages nobody has written
+ * yet are mapped to it read-only (see mmu_map_zero), so they cost
+ * neither a page nor a bzero until the first write. It has no coremap
+ * entry and so can be in any number of TLB slots at once.
+ */
+static paddr_t zeropage_paddr;
+static uint32_t buddy_lists[CM_NORDERS];	/* free blocks by order */
+static uint32_t buddy_nblocks[CM_NORDERS];	/* count of the same */
+
+/*
+ * Every CPU's cpu_vm_machdep, indexed by CPU number, so we can get at
+ * other CPUs' page caches and shootdown wchans. Filled in as CPUs are
+ * created, which happens one at a time during boot (in CPU number
+ * order), so it needs no lock.
+ */
+#define CM_MAXCPUS		32	/* cm_cpunum is 5 bits */
+static struct cpu_vm_machdep *cpuvms[CM_MAXCPUS];
+static unsigned num_cpuvms;
+
+static void buddy_insert(uint32_t ix, unsigned order);
+static void coremap_print_summary(void);
+
 static volatile uint32_t ct_shootdowns_sent;
+static volatile uint32_t ct_shootdown_ipis;
 static volatile uint32_t ct_shootdowns_done;
 static volatile uint32_t ct_shootdown_interrupts;
+static volatile uint32_t ct_pageout_runs;
+static volatile uint32_t ct_asid_assigns;
+static volatile uint32_t ct_asid_rollovers;
+static volatile uint32_t ct_asid_flushes;
+static volatile uint32_t ct_fastrefills;
+static volatile uint32_t ct_prefaults;
+static volatile uint32_t ct_zeromaps;
+static volatile uint32_t ct_prezeroed;
+
+/*
+ * Pageout thread state. See the "Pageout thread" section below.
+ * All protected by coremap_spinlock.
+ */
+static bool pageout_running;		/* pageout thread exists */
+static bool pageout_idle;		/* pageout thread is asleep */
+static uint32_t pageout_lowater;	/* start cleaning below this */
+static uint32_t pageout_hiwater;	/* stop cleaning at this */
+static uint32_t pageout_hand;		/* next coremap index to clean */
+static uint32_t pageout_evictions;	/* evictions since last run */
+
+/*
+ * Pool of pre-zeroed pages. See the "Pre-zeroed pages" section below.
+ * Protected by zeropool_lock, except zeropool_max, which is set at
+ * boot.
+ */
+#define ZEROPOOL_SIZE		32
+static struct spinlock zeropool_lock = SPINLOCK_INITIALIZER;
+static uint32_t zeropool[ZEROPOOL_SIZE];	/* coremap indexes */
+static unsigned zeropool_num;			/* pages in the pool */
+static unsigned zeropool_max;			/* pool size in use */
+static uint32_t zeropool_hits;		/* zero-fills served from it */
+static uint32_t zeropool_misses;	/* zero-fills that weren't */
 
 ////////////////////////////////////////////////////////////
 //
@@ -128,15 +219,32 @@ void
 cpu_vm_machdep_init(struct cpu_vm_machdep *cvm)
 {
 	cvm->cvm_lastas = NULL;
+	cvm->cvm_asid = 0;
+	cvm->cvm_asidgen = 0;	/* not current: flush on first use */
 	cvm->cvm_nexttlb = 0;
 	cvm->cvm_tlbseqslot = 0;
+
+	cvm->cvm_shootchan = wchan_create("tlbshoot");
+	if (cvm->cvm_shootchan == NULL) {
+		panic("Failed allocating TLB shootdown wchan\n");
+	}
+
+	spinlock_init(&cvm->cvm_pagecache_lock);
+	cvm->cvm_pagecache_num = 0;
+	cvm->cvm_pagecache_hits = 0;
+	cvm->cvm_pagecache_misses = 0;
+
+	KASSERT(num_cpuvms < CM_MAXCPUS);
+	cpuvms[num_cpuvms++] = cvm;
 }
 
 void
 cpu_vm_machdep_cleanup(struct cpu_vm_machdep *cvm)
 {
-	(void)cvm;
-	/* nothing */
+	/* CPUs never go away, so this isn't expected to be called */
+	KASSERT(cvm->cvm_pagecache_num == 0);
+	spinlock_cleanup(&cvm->cvm_pagecache_lock);
+	wchan_destroy(cvm->cvm_shootchan);
 }
 
 ////////////////////////////////////////////////////////////
@@ -146,16 +254,62 @@ cpu_vm_machdep_cleanup(struct cpu_vm_machdep *cvm)
 void
 vm_printmdstats(void)
 {
-	uint32_t ss, sd, si;
+	uint32_t ss, sp, sd, si, pr, ph, pm, aa, ar, af, fr, pf, zm;
+	uint32_t zh, zs, zz, zn;
+	unsigned i;
 
 	spinlock_acquire(&coremap_spinlock);
 	ss = ct_shootdowns_sent;
+	sp = ct_shootdown_ipis;
 	sd = ct_shootdowns_done;
 	si = ct_shootdown_interrupts;
+	pr = ct_pageout_runs;
+	aa = ct_asid_assigns;
+	ar = ct_asid_rollovers;
+	af = ct_asid_flushes;
+	fr = ct_fastrefills;
+	pf = ct_prefaults;
+	zm = ct_zeromaps;
+	zz = ct_prezeroed;
+	ph = pm = 0;
+	for (i=0; i<num_cpuvms; i++) {
+		spinlock_acquire(&cpuvms[i]->cvm_pagecache_lock);
+		ph += cpuvms[i]->cvm_pagecache_hits;
+		pm += cpuvms[i]->cvm_pagecache_misses;
+		spinlock_release(&cpuvms[i]->cvm_pagecache_lock);
+	}
+	spinlock_acquire(&zeropool_lock);
+	zh = zeropool_hits;
+	zs = zeropool_misses;
+	zn = zeropool_num;
+	spinlock_release(&zeropool_lock);
 	spinlock_release(&coremap_spinlock);
 
-	kprintf("vm: shootdowns: %lu sent, %lu done (%lu interrupts)\n",
-		(unsigned long) ss, (unsigned long) sd, (unsigned long) si);
+	kprintf("vm: shootdowns: %lu sent in %lu IPIs, %lu done "
+		"(%lu interrupts)\n", (unsigned long) ss, (unsigned long) sp,
+		(unsigned long) sd, (unsigned long) si);
+	kprintf("vm: ASIDs: %lu assigned, %lu rollovers, %lu TLB flushes\n",
+		(unsigned long) aa, (unsigned long) ar, (unsigned long) af);
+	kprintf("vm: %lu TLB refills on the fast path, "
+		"%lu pages mapped by fault-around\n",
+		(unsigned long) fr, (unsigned long) pf);
+	kprintf("vm: %lu read faults mapped to the zero page\n",
+		(unsigned long) zm);
+	kprintf("vm: pageout: %lu runs (low %lu, high %lu pages)\n",
+		(unsigned long) pr, (unsigned long) pageout_lowater,
+		(unsigned long) pageout_hiwater);
+	kprintf("vm: per-CPU page caches: %lu hits, %lu misses\n",
+		(unsigned long) ph, (unsigned long) pm);
+	kprintf("vm: pre-zeroed pages: %lu hits, %lu misses (%lu%% hit rate), "
+		"%lu zeroed while idle, %lu/%lu in pool\n",
+		(unsigned long) zh, (unsigned long) zs,
+		(unsigned long) (zh + zs == 0 ? 0 : zh * 100ULL / (zh + zs)),
+		(unsigned long) zz, (unsigned long) zn,
+		(unsigned long) zeropool_max);
+
+	spinlock_acquire(&coremap_spinlock);
+	coremap_print_summary();
+	spinlock_release(&coremap_spinlock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -201,7 +355,10 @@ tlb_invalidate(int tlbix)
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
 
 	tlb_read(&ehi, &elo, tlbix);
-	if (elo & TLBLO_VALID) {
+	if ((elo & TLBLO_VALID) && (elo & TLBLO_PPAGE) == zeropage_paddr) {
+		/* the zero page isn't tracked */
+	}
+	else if (elo & TLBLO_VALID) {
 		pa = elo & TLBLO_PPAGE;
 		cmix = PADDR_TO_COREMAP(pa);
 		KASSERT(cmix < num_coremap_entries);
@@ -213,7 +370,9 @@ tlb_invalidate(int tlbix)
 			(unsigned long) COREMAP_TO_PADDR(cmix));
 	}
 
-	tlb_write(TLBHI_INVALID(tlbix), TLBLO_INVALID(), tlbix);
+	/* (include our PID so c0_entryhi is left with it) */
+	tlb_write(TLBHI_INVALID(tlbix) | TLBHI_MKPID(curcpu->c_vm.cvm_asid),
+		  TLBLO_INVALID(), tlbix);
 	DEBUG(DB_TLB, "... pa ------- <-- tlb %d\n", tlbix);
 }
 
@@ -246,6 +405,7 @@ vm_tlbshootdown(const struct tlbshootdown *ts, int num)
 	unsigned where;
 
 	spinlock_acquire(&coremap_spinlock);
+	KASSERT(cpuvms[curcpu->c_number] == &curcpu->c_vm);
 	ct_shootdown_interrupts++;
 	for (i=0; i<num; i++) {
 		tlbix = ts[i].ts_tlbix;
@@ -256,7 +416,7 @@ vm_tlbshootdown(const struct tlbshootdown *ts, int num)
 			ct_shootdowns_done++;
 		}
 	}
-	wchan_wakeall(coremap_shootchan);
+	wchan_wakeall(curcpu->c_vm.cvm_shootchan);
 	spinlock_release(&coremap_spinlock);
 }
 
@@ -270,32 +430,130 @@ vm_tlbshootdown_all(void)
 	ct_shootdown_interrupts++;
 	tlb_clear();
 	ct_shootdowns_done += NUM_TLB;
-	wchan_wakeall(coremap_shootchan);
+	wchan_wakeall(curcpu->c_vm.cvm_shootchan);
 	spinlock_release(&coremap_spinlock);
 }
 
 /*
- * Wait for shootdown to complete.
+ * Wait for a shootdown on CPU CPUNUM to complete.
  */
 static
 void
-tlb_shootwait(void)
+tlb_shootwait(unsigned cpunum)
 {
-	wchan_lock(coremap_shootchan);
+	struct wchan *wc;
+
+	KASSERT(cpunum < num_cpuvms);
+	wc = cpuvms[cpunum]->cvm_shootchan;
+
+	wchan_lock(wc);
 	spinlock_release(&coremap_spinlock);
-	wchan_sleep(coremap_shootchan);
+	wchan_sleep(wc);
 	spinlock_acquire(&coremap_spinlock);
 }
 
 /*
- * tlb_unmap: Searches the TLB for a vaddr translation and invalidates
- * it if it exists.
+ * tlb_shootdown_batch: remove the TLB mappings of the N coremap
+ * entries in CMIXES, wherever they are, and wait until they're gone.
+ * The pages should be pinned so the mappings can't be replaced while
+ * we wait.
+ *
+ * Mappings in our own TLB are invalidated directly. The rest are
+ * collected by CPU, and each CPU gets one IPI for all of its entries;
+ * if it has more than TLBSHOOTDOWN_MAX, the IPI code turns the request
+ * into a full TLB flush. Then we wait on each target CPU's own wchan.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. May block
+ * (releasing coremap_spinlock) if a shootdown is needed.
+ */
+static
+void
+tlb_shootdown_batch(const uint32_t *cmixes, unsigned n)
+{
+	struct tlbshootdown ts[TLBSHOOTDOWN_MAX];
+	uint32_t cpusdone, ix;
+	unsigned i, j, cpu;
+	int nts;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	cpusdone = 0;
+	for (i=0; i<n; i++) {
+		ix = cmixes[i];
+		KASSERT(coremap[ix].cm_pinned);
+		if (coremap[ix].cm_tlbix < 0) {
+			continue;
+		}
+		cpu = coremap[ix].cm_cpunum;
+		if (cpu == curcpu->c_number) {
+			tlb_invalidate(coremap[ix].cm_tlbix);
+			continue;
+		}
+		if (cpusdone & (1U << cpu)) {
+			continue;
+		}
+		cpusdone |= 1U << cpu;
+
+		/* Gather everything for this CPU. */
+		KASSERT(curthread != NULL && !curthread->t_in_interrupt);
+		nts = 0;
+		for (j=i; j<n; j++) {
+			ix = cmixes[j];
+			if (coremap[ix].cm_tlbix < 0 ||
+			    coremap[ix].cm_cpunum != cpu) {
+				continue;
+			}
+			ct_shootdowns_sent++;
+			if (nts == TLBSHOOTDOWN_ALL) {
+				continue;
+			}
+			if (nts == TLBSHOOTDOWN_MAX) {
+				nts = TLBSHOOTDOWN_ALL;
+				continue;
+			}
+			ts[nts].ts_tlbix = coremap[ix].cm_tlbix;
+			ts[nts].ts_coremapindex = ix;
+			nts++;
+		}
+		ct_shootdown_ipis++;
+		ipi_tlbshootdown_batch(cpu, ts, nts);
+	}
+
+	for (i=0; i<n; i++) {
+		ix = cmixes[i];
+		while (coremap[ix].cm_tlbix != -1) {
+			tlb_shootwait(coremap[ix].cm_cpunum);
+		}
+		KASSERT(coremap[ix].cm_cpunum == 0);
+	}
+}
+
+/*
+ * tlb_takeback: remove the TLB mapping of a coremap entry, wherever
+ * it is, waiting for the shootdown if it's on another CPU. The page
+ * should be pinned so the mapping can't be replaced while we wait.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. May block
+ * (releasing coremap_spinlock) if a shootdown is needed.
+ */
+static
+void
+tlb_takeback(unsigned cmix)
+{
+	uint32_t ix = cmix;
+
+	tlb_shootdown_batch(&ix, 1);
+}
+
+/*
+ * tlb_unmap: Searches the TLB for a vaddr translation tagged with
+ * address space ID PID and invalidates it if it exists.
  *
  * Synchronization: assumes we hold coremap_spinlock. Does not block. 
  */
 static
 void
-tlb_unmap(vaddr_t va)
+tlb_unmap(vaddr_t va, uint32_t pid)
 {
 	int i;
 	uint32_t elo = 0, ehi = 0;
@@ -304,14 +562,17 @@ tlb_unmap(vaddr_t va)
 
 	KASSERT(va < MIPS_KSEG0);
 
-	i = tlb_probe(va & PAGE_FRAME,0);
+	i = tlb_probe((va & PAGE_FRAME) | TLBHI_MKPID(pid), 0);
 	if (i < 0) {
+		/* the probe loaded PID into c0_entryhi; put ours back */
+		tlb_setpid(curcpu->c_vm.cvm_asid);
 		return;
 	}
 	
 	tlb_read(&ehi, &elo, i);
 	
 	KASSERT(elo & TLBLO_VALID);
+	KASSERT((ehi & TLBHI_PID) == TLBHI_MKPID(pid));
 	
 	DEBUG(DB_TLB, "invalidating tlb slot %d (va: 0x%x)\n", i, va); 
 	
@@ -338,6 +599,96 @@ mipstlb_getslot(void)
 	return i;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Address space IDs
+//
+
+/*
+ * Each TLB entry is tagged with a 6-bit address space ID (the TLBHI
+ * PID field) and only matches while c0_entryhi holds the same PID.
+ * Giving each address space its own ASID means switching address
+ * spaces only needs to load the new ASID, not flush the TLB, and a
+ * process that runs again soon finds its translations still there.
+ *
+ * ASIDs come from one counter shared by all CPUs. When it runs out,
+ * the generation number goes up and numbering starts over. An address
+ * space whose ASID is from an older generation gets a new one the next
+ * time it's activated, and each CPU flushes its TLB the first time it
+ * activates an address space after the generation changes. So a CPU
+ * only ever holds entries tagged with ASIDs from its own cvm_asidgen,
+ * and an ASID is never in use by two address spaces in one TLB. ASID
+ * 0 is never handed out; it's loaded when no address space is.
+ *
+ * The coremap still records every valid TLB entry whatever its ASID,
+ * so a page is still in at most one TLB slot, and eviction and
+ * shootdown find it the same way as before. Entries left behind for
+ * address spaces that aren't running stay in the TLB until they're
+ * replaced, flushed, or taken back.
+ *
+ * Synchronization: all of this is protected by coremap_spinlock.
+ */
+static uint32_t asid_next = 1;		/* next ASID to hand out */
+static uint32_t asid_gen = 1;		/* current generation */
+
+/*
+ * asid_assign: give MA a fresh ASID, starting a new generation if
+ * they've run out.
+ */
+static
+void
+asid_assign(struct mmu_asid *ma)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	if (asid_next == NUM_TLBPID) {
+		asid_gen++;
+		if (asid_gen == 0) {
+			/* 0 means "none" */
+			asid_gen = 1;
+		}
+		asid_next = 1;
+		ct_asid_rollovers++;
+	}
+	ma->ma_asid = asid_next++;
+	ma->ma_gen = asid_gen;
+	ma->ma_cpus = 0;
+	ct_asid_assigns++;
+}
+
+/*
+ * asid_load: make AS (which may be NULL) the address space whose
+ * entries the TLB on this CPU matches, assigning it an ASID if it
+ * needs one and flushing the TLB if ASIDs have been recycled since we
+ * last did.
+ */
+static
+void
+asid_load(struct addrspace *as)
+{
+	struct cpu_vm_machdep *cvm = &curcpu->c_vm;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	if (as != NULL && as->as_asid.ma_gen != asid_gen) {
+		asid_assign(&as->as_asid);
+	}
+	if (cvm->cvm_asidgen != asid_gen) {
+		tlb_clear();
+		cvm->cvm_asidgen = asid_gen;
+		ct_asid_flushes++;
+	}
+	if (as != NULL) {
+		as->as_asid.ma_cpus |= 1U << curcpu->c_number;
+		cvm->cvm_asid = as->as_asid.ma_asid;
+	}
+	else {
+		cvm->cvm_asid = 0;
+	}
+	cvm->cvm_lastas = as;
+	tlb_setpid(cvm->cvm_asid);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Page replacement code
@@ -373,7 +724,116 @@ page_replace(void)
 	//return 0;
 }
 
-#else /* not OPT_RANDPAGE */
+/*
+ * No extra victims: a random victim is no more likely than any other
+ * page to be worth evicting early.
+ */
+static
+unsigned
+page_replace_extra(uint32_t *where, unsigned max)
+{
+	(void)where;
+	(void)max;
+	return 0;
+}
+
+#elif OPT_CLOCKPAGE
+
+/*
+ * Clock (second-chance) page replacement.
+ *
+ * The MIPS has no hardware reference bit, so we keep one in software:
+ * mmu_map sets cm_referenced whenever a page is entered into the TLB.
+ * When the clock hand passes a referenced page it clears the bit and,
+ * if the page is in our own TLB, drops the TLB entry too, so that the
+ * next use of the page refaults and sets the bit again. (Entries in
+ * other CPUs' TLBs are left alone; shooting them down just to sample
+ * the bit isn't worth an IPI.) Unreferenced pages are evicted.
+ *
+ * If the pageout thread is running, dirty pages are also passed over
+ * on the first sweep, to give it a chance to clean them so we can
+ * evict them without waiting for a write.
+ *
+ * After one full sweep every bit has been cleared, so two sweeps are
+ * always enough to find a victim if there is one.
+ */
+
+static uint32_t clockhand = 0;
+
+static
+uint32_t
+page_replace(void)
+{
+	uint32_t where, n;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	for (n = 0; n < 2 * num_coremap_entries + 1; n++) {
+		where = clockhand;
+		clockhand = (clockhand + 1) % num_coremap_entries;
+
+		if (coremap[where].cm_pinned || coremap[where].cm_kernel) {
+			continue;
+		}
+		if (coremap[where].cm_referenced) {
+			/* second chance */
+			coremap[where].cm_referenced = 0;
+			if (coremap[where].cm_tlbix >= 0 &&
+			    coremap[where].cm_cpunum == curcpu->c_number) {
+				tlb_invalidate(coremap[where].cm_tlbix);
+			}
+			continue;
+		}
+		if (pageout_running && n < num_coremap_entries &&
+		    coremap[where].cm_lpage != NULL &&
+		    LP_ISDIRTY(coremap[where].cm_lpage)) {
+			continue;
+		}
+		return where;
+	}
+
+	panic("Can't find a unpinned non-kernel page.\n");
+	return -1;
+}
+
+/*
+ * page_replace_extra: after page_replace picked a victim, keep going
+ * around the clock a little way and pin up to MAX more user pages that
+ * are clean and unreferenced, so they can be evicted along with it
+ * (see do_page_replace). Looks at no more than CM_EVICT_SCAN entries
+ * and never clears reference bits or skips ahead of dirty pages; this
+ * only collects pages the next few calls to page_replace would have
+ * taken anyway.
+ */
+static
+unsigned
+page_replace_extra(uint32_t *where, unsigned max)
+{
+	uint32_t ix, n;
+	unsigned found;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	found = 0;
+	for (n = 0; n < CM_EVICT_SCAN && found < max; n++) {
+		ix = clockhand;
+		if (coremap[ix].cm_kernel || coremap[ix].cm_pinned) {
+			clockhand = (clockhand + 1) % num_coremap_entries;
+			continue;
+		}
+		if (coremap[ix].cm_referenced || !coremap[ix].cm_allocated ||
+		    LP_ISDIRTY(coremap[ix].cm_lpage)) {
+			/* leave it for page_replace */
+			break;
+		}
+		clockhand = (clockhand + 1) % num_coremap_entries;
+		coremap[ix].cm_pinned = 1;
+		where[found++] = ix;
+	}
+	return found;
+}
+
+#else /* neither OPT_RANDPAGE nor OPT_CLOCKPAGE */
 
 
 /*
@@ -415,6 +875,18 @@ page_replace(void)
 	return -1;
 }
 
+/*
+ * No extra victims for sequential replacement either.
+ */
+static
+unsigned
+page_replace_extra(uint32_t *where, unsigned max)
+{
+	(void)where;
+	(void)max;
+	return 0;
+}
+
 #endif /* OPT_RANDPAGE */
 
 
@@ -481,6 +953,13 @@ coremap_bootstrap(void)
 	coremap = (struct coremap_entry *) PADDR_TO_KVADDR(first);
 	first += coremapsize;
 
+	/*
+	 * And one for the zero page.
+	 */
+	zeropage_paddr = first;
+	bzero((void *)PADDR_TO_KVADDR(zeropage_paddr), PAGE_SIZE);
+	first += PAGE_SIZE;
+
 	if (first >= last) {
 		/* This cannot happen unless coremap_entry gets really huge */
 		panic("vm: coremap took up all of physical memory?\n");
@@ -488,7 +967,8 @@ coremap_bootstrap(void)
 
 	/*
 	 * Now, set things up to reflect the range of memory we're
-	 * managing. Note that we skip the pages the coremap is using.
+	 * managing. Note that we skip the pages the coremap and the
+	 * zero page are using.
 	 */
 	base_coremap_page = first / PAGE_SIZE;
 	num_coremap_entries = (last / PAGE_SIZE) - base_coremap_page;
@@ -496,26 +976,63 @@ coremap_bootstrap(void)
 	num_coremap_user = 0;
 	num_coremap_free = num_coremap_entries;
 
-	KASSERT(num_coremap_entries + (coremapsize/PAGE_SIZE) == npages);
+	KASSERT(num_coremap_entries + (coremapsize/PAGE_SIZE) + 1 == npages);
 
 	/*
 	 * Initialize the coremap entries.
 	 */
+	for (i=0; i < CM_NORDERS; i++) {
+		buddy_lists[i] = CM_NOPAGE;
+		buddy_nblocks[i] = 0;
+	}
 	for (i=0; i < num_coremap_entries; i++) {
 		coremap[i].cm_kernel = 0;
 		coremap[i].cm_notlast = 0;
 		coremap[i].cm_allocated = 0;
+		coremap[i].cm_referenced = 0;
 		coremap[i].cm_pinned = 0;
 		coremap[i].cm_tlbix = -1;
 		coremap[i].cm_cpunum = 0;
 		coremap[i].cm_lpage = NULL;
+		coremap[i].cm_freehead = 0;
+		coremap[i].cm_freeorder = 0;
+		coremap[i].cm_freenext = CM_NOPAGE;
+		coremap[i].cm_freeprev = CM_NOPAGE;
+	}
+	/* Carve memory into the largest aligned free blocks we can. */
+	i = 0;
+	while (i < num_coremap_entries) {
+		unsigned k = 0;
+
+		while (k+1 < CM_NORDERS && (i & ((2U << k) - 1)) == 0 &&
+		       i + (2U << k) <= num_coremap_entries) {
+			k++;
+		}
+		buddy_insert(i, k);
+		i += 1U << k;
 	}
 
 	coremap_pinchan = wchan_create("vmpin");
-	coremap_shootchan = wchan_create("tlbshoot");
-	if (coremap_pinchan == NULL || coremap_shootchan == NULL) {
+	coremap_pageoutchan = wchan_create("pageout");
+	if (coremap_pinchan == NULL || coremap_pageoutchan == NULL) {
 		panic("Failed allocating coremap wchans\n");
 	}
+
+	pageout_running = false;
+	pageout_idle = false;
+	pageout_lowater = num_coremap_entries / 16;
+	if (pageout_lowater < CM_MIN_SLACK) {
+		pageout_lowater = CM_MIN_SLACK;
+	}
+	pageout_hiwater = 2 * pageout_lowater;
+	pageout_hand = 0;
+	pageout_evictions = 0;
+
+	zeropool_num = 0;
+	zeropool_max = num_coremap_entries / 32;
+	if (zeropool_max > ZEROPOOL_SIZE) {
+		zeropool_max = ZEROPOOL_SIZE;
+	}
 }	
 
 ////////////////////////////////////////////////////////////
@@ -523,113 +1040,311 @@ coremap_bootstrap(void)
 // Memory allocation
 //
 
+/*
+ * Buddy free lists.
+ *
+ * buddy_insert/buddy_unlink: put a free block on, or take it off, the
+ * list for its order.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
 static
-int
-piggish_kernel(int proposed_kernel_pages)
+void
+buddy_insert(uint32_t ix, unsigned order)
 {
-	uint32_t nkp;
+	KASSERT(order < CM_NORDERS);
+	KASSERT((ix & ((1U << order) - 1)) == 0);
+	KASSERT(ix + (1U << order) <= num_coremap_entries);
+
+	coremap[ix].cm_freehead = 1;
+	coremap[ix].cm_freeorder = order;
+	coremap[ix].cm_freeprev = CM_NOPAGE;
+	coremap[ix].cm_freenext = buddy_lists[order];
+	if (buddy_lists[order] != CM_NOPAGE) {
+		coremap[buddy_lists[order]].cm_freeprev = ix;
+	}
+	buddy_lists[order] = ix;
+	buddy_nblocks[order]++;
+}
 
-	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+static
+void
+buddy_unlink(uint32_t ix)
+{
+	uint32_t next, prev;
+	unsigned order;
 
-	nkp = num_coremap_kernel + proposed_kernel_pages ;
-	if (nkp >= num_coremap_entries - CM_MIN_SLACK) {
-		return 1;
+	KASSERT(coremap[ix].cm_freehead);
+	order = coremap[ix].cm_freeorder;
+
+	next = coremap[ix].cm_freenext;
+	prev = coremap[ix].cm_freeprev;
+	if (prev == CM_NOPAGE) {
+		KASSERT(buddy_lists[order] == ix);
+		buddy_lists[order] = next;
 	}
-	return 0;
+	else {
+		coremap[prev].cm_freenext = next;
+	}
+	if (next != CM_NOPAGE) {
+		coremap[next].cm_freeprev = prev;
+	}
+	coremap[ix].cm_freenext = CM_NOPAGE;
+	coremap[ix].cm_freeprev = CM_NOPAGE;
+	coremap[ix].cm_freehead = 0;
+	coremap[ix].cm_freeorder = 0;
+	KASSERT(buddy_nblocks[order] > 0);
+	buddy_nblocks[order]--;
 }
 
+/*
+ * freelist_add/freelist_remove: a page becomes free, or a free page
+ * gets allocated or pinned. Call freelist_add when a page becomes both
+ * unallocated and unpinned.
+ *
+ * freelist_add merges the page with its buddy, and the result with
+ * its buddy, and so on, for as long as the buddy is a free block of
+ * the same size.
+ *
+ * freelist_remove finds the free block the page is in and splits it
+ * in halves until the page is a block by itself, putting the halves
+ * that don't contain it back on the lists.
+ *
+ * Both are O(CM_NORDERS).
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
 static
 void
-do_evict(int where)
+freelist_add(uint32_t ix)
 {
-	struct lpage *lp;
+	uint32_t buddy;
+	unsigned order;
 
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
-	KASSERT(curthread != NULL && !curthread->t_in_interrupt);
-	KASSERT(lock_do_i_hold(global_paging_lock));
+	KASSERT(!coremap[ix].cm_allocated && !coremap[ix].cm_pinned);
+	KASSERT(!coremap[ix].cm_freehead);
+
+	for (order = 0; order+1 < CM_NORDERS; order++) {
+		buddy = ix ^ (1U << order);
+		if (buddy + (1U << order) > num_coremap_entries ||
+		    !coremap[buddy].cm_freehead ||
+		    coremap[buddy].cm_freeorder != order) {
+			break;
+		}
+		buddy_unlink(buddy);
+		if (buddy < ix) {
+			ix = buddy;
+		}
+	}
+	buddy_insert(ix, order);
+}
 
-	KASSERT(coremap[where].cm_pinned==0);
-	KASSERT(coremap[where].cm_allocated);
-	KASSERT(coremap[where].cm_kernel==0);
+static
+void
+freelist_remove(uint32_t ix)
+{
+	uint32_t head, half;
+	unsigned order;
 
-	lp = coremap[where].cm_lpage;
-	KASSERT(lp != NULL);
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(!coremap[ix].cm_allocated && !coremap[ix].cm_pinned);
 
-	/*
-	 * Pin it now, so it doesn't get e.g. paged out by someone
-	 * else while we're waiting for TLB shootdown.
-	 */
-	coremap[where].cm_pinned = 1;
-
-	if (coremap[where].cm_tlbix >= 0) {
-		if (coremap[where].cm_cpunum != curcpu->c_number) {
-			/* yay, TLB shootdown */
-			struct tlbshootdown ts;
-			ts.ts_tlbix = coremap[where].cm_tlbix;
-			ts.ts_coremapindex = where;
-			ct_shootdowns_sent++;
-			ipi_tlbshootdown(coremap[where].cm_cpunum, &ts);
-			while (coremap[where].cm_tlbix != -1) {
-				tlb_shootwait();
-			}
-			KASSERT(coremap[where].cm_tlbix == -1);
-			KASSERT(coremap[where].cm_cpunum == 0);
-			KASSERT(coremap[where].cm_lpage == lp);
+	for (order = 0; order < CM_NORDERS; order++) {
+		head = ix & ~((1U << order) - 1);
+		if (coremap[head].cm_freehead &&
+		    coremap[head].cm_freeorder == order) {
+			break;
+		}
+	}
+	KASSERT(order < CM_NORDERS);
+
+	buddy_unlink(head);
+	while (order > 0) {
+		order--;
+		half = 1U << order;
+		if (ix >= head + half) {
+			buddy_insert(head, order);
+			head += half;
 		}
 		else {
-			tlb_invalidate(coremap[where].cm_tlbix);
-			coremap[where].cm_tlbix = -1;
-			coremap[where].cm_cpunum = 0;
+			buddy_insert(head + half, order);
 		}
-		DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
-		      (unsigned long) COREMAP_TO_PADDR(where));
 	}
+	KASSERT(head == ix);
+}
 
-	/* properly we ought to lock the lpage to test this */
-	KASSERT(COREMAP_TO_PADDR(where) == (lp->lp_paddr & PAGE_FRAME));
-
-	/* release the coremap spinlock in case we need to swap out */
-	spinlock_release(&coremap_spinlock);
-
-	lpage_evict(lp);
-
-	spinlock_acquire(&coremap_spinlock);
-
-	/* because the page is pinned these shouldn't have changed */
-	KASSERT(coremap[where].cm_allocated == 1);
-	KASSERT(coremap[where].cm_lpage == lp);
-	KASSERT(coremap[where].cm_pinned == 1);
-
-	coremap[where].cm_allocated = 0;
-	coremap[where].cm_lpage = NULL;
-	coremap[where].cm_pinned = 0;
+/*
+ * freelist_findblock: return the first page of a free block of at
+ * least 2^ORDER pages, or CM_NOPAGE. Prefers the smallest such block,
+ * so large blocks stay whole for multi-page allocations. With ORDER 0
+ * this finds a single free page.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+uint32_t
+freelist_findblock(unsigned order)
+{
+	unsigned k;
 
-	num_coremap_user--;
-	num_coremap_free++;
-	KASSERT(num_coremap_kernel+num_coremap_user+num_coremap_free
-	       == num_coremap_entries);
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
 
-	wchan_wakeall(coremap_pinchan);
+	for (k = order; k < CM_NORDERS; k++) {
+		if (buddy_lists[k] != CM_NOPAGE) {
+			return buddy_lists[k];
+		}
+	}
+	return CM_NOPAGE;
 }
 
 static
 int
-do_page_replace(void)
+piggish_kernel(int proposed_kernel_pages)
 {
-	int where;
+	uint32_t nkp;
 
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
-	KASSERT(lock_do_i_hold(global_paging_lock));
 
-	where = page_replace();
+	nkp = num_coremap_kernel + proposed_kernel_pages ;
+	if (nkp >= num_coremap_entries - CM_MIN_SLACK) {
+		return 1;
+	}
+	return 0;
+}
 
-	KASSERT(coremap[where].cm_pinned==0);
+/*
+ * do_evict_batch: evict the N user pages in WHERE, which the caller
+ * has already pinned. All their TLB mappings are removed together, so
+ * pages mapped on another CPU cost one IPI per CPU rather than one per
+ * page; then each page is written out if needed and freed.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Blocks, releasing
+ * it, for TLB shootdown and to swap pages out.
+ */
+static
+void
+do_evict_batch(const uint32_t *where, unsigned n)
+{
+	struct lpage *lps[TLBSHOOTDOWN_MAX];
+	unsigned i;
+	uint32_t ix;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(curthread != NULL && !curthread->t_in_interrupt);
+	KASSERT(n <= TLBSHOOTDOWN_MAX);
+
+	for (i=0; i<n; i++) {
+		ix = where[i];
+		KASSERT(coremap[ix].cm_pinned==1);
+		KASSERT(coremap[ix].cm_allocated);
+		KASSERT(coremap[ix].cm_kernel==0);
+		lps[i] = coremap[ix].cm_lpage;
+		KASSERT(lps[i] != NULL);
+	}
+
+	tlb_shootdown_batch(where, n);
+
+	for (i=0; i<n; i++) {
+		ix = where[i];
+		KASSERT(coremap[ix].cm_tlbix == -1);
+		KASSERT(coremap[ix].cm_lpage == lps[i]);
+		/* properly we ought to lock the lpage to test this */
+		KASSERT(COREMAP_TO_PADDR(ix) ==
+			(lps[i]->lp_paddr & PAGE_FRAME));
+	}
+
+	/* release the coremap spinlock in case we need to swap out */
+	spinlock_release(&coremap_spinlock);
+
+	for (i=0; i<n; i++) {
+		lpage_evict(lps[i]);
+	}
+
+	spinlock_acquire(&coremap_spinlock);
+
+	for (i=0; i<n; i++) {
+		ix = where[i];
+
+		/* because the page is pinned these shouldn't have changed */
+		KASSERT(coremap[ix].cm_allocated == 1);
+		KASSERT(coremap[ix].cm_lpage == lps[i]);
+		KASSERT(coremap[ix].cm_pinned == 1);
+
+		coremap[ix].cm_allocated = 0;
+		coremap[ix].cm_referenced = 0;
+		coremap[ix].cm_lpage = NULL;
+		coremap[ix].cm_pinned = 0;
+		freelist_add(ix);
+
+		num_coremap_user--;
+		num_coremap_free++;
+	}
+	KASSERT(num_coremap_kernel+num_coremap_user+num_coremap_free
+	       == num_coremap_entries);
+
+	wchan_wakeall(coremap_pinchan);
+}
+
+/*
+ * pageout_poke: note that an eviction happened, and wake up the
+ * pageout thread if it's likely the supply of clean pages has run
+ * low: that is, if the victim was dirty, or if enough pages have been
+ * evicted since the last run to take us from the high watermark down
+ * to the low one.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+pageout_poke(bool victimdirty)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	pageout_evictions++;
+	if (!pageout_running || !pageout_idle) {
+		return;
+	}
+	if (victimdirty ||
+	    pageout_evictions >= pageout_hiwater - pageout_lowater) {
+		pageout_idle = false;
+		wchan_wakeall(coremap_pageoutchan);
+	}
+}
+
+static
+int
+do_page_replace(void)
+{
+	uint32_t victims[CM_EVICT_BATCH];
+	uint32_t where;
+	unsigned n;
+	bool dirty;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	where = page_replace();
+
+	KASSERT(coremap[where].cm_pinned==0);
 	KASSERT(coremap[where].cm_kernel==0);
 
 	if (coremap[where].cm_allocated) {
 		KASSERT(coremap[where].cm_lpage != NULL);
 		KASSERT(curthread != NULL && !curthread->t_in_interrupt);
-		do_evict(where);
+		/* only a hint; we don't have the lpage locked */
+		dirty = LP_ISDIRTY(coremap[where].cm_lpage) != 0;
+
+		/*
+		 * Pin the victim, plus any extra victims the replacement
+		 * policy offers, and evict them all together so their
+		 * TLB shootdowns go out in one batch. The extras end up
+		 * on the free list.
+		 */
+		victims[0] = where;
+		coremap[where].cm_pinned = 1;
+		n = 1 + page_replace_extra(victims + 1, CM_EVICT_BATCH - 1);
+		do_evict_batch(victims, n);
+		pageout_poke(dirty);
 	}
 
 	return where;
@@ -650,6 +1365,7 @@ mark_pages_allocated(int start, int npages, int dopin, int iskern)
 		KASSERT(coremap[i].cm_tlbix<0);
 		KASSERT(coremap[i].cm_cpunum == 0);
 
+		freelist_remove(i);
 		if (dopin) {
 			coremap[i].cm_pinned = 1;
 		}
@@ -673,28 +1389,356 @@ mark_pages_allocated(int start, int npages, int dopin, int iskern)
 	       == num_coremap_entries);
 }
 
+////////////////////////////////////////////////////////////
+//
+// Per-CPU page caches
+//
+
+/*
+ * Each CPU has a small cache of page frames (cvm_pagecache) for user
+ * allocations. coremap_allocuser takes a frame from the current CPU's
+ * cache when there is one, and coremap_freeuser puts the frame back
+ * when there's room, and neither needs coremap_spinlock to do it; only
+ * the cache's own spinlock, which is almost never contended.
+ *
+ * A frame in a cache looks to the rest of the coremap like a pinned
+ * user page with no lpage: it's counted in num_coremap_user, it isn't
+ * on the free list, and everything that scans the coremap skips it
+ * because it's pinned. Since nobody else touches a pinned page, the
+ * CPU that owns the cache can hand it out just by setting cm_lpage.
+ *
+ * When the cache is empty, coremap_alloc_one_page refills it from the
+ * free list while it has coremap_spinlock anyway. When the free list
+ * runs dry, all the caches are emptied back into it before anything
+ * is evicted, so frames sitting in caches never force evictions.
+ *
+ * Lock order: coremap_spinlock before cvm_pagecache_lock. Neither
+ * the fast paths nor refilling ever hold a cache lock while getting
+ * coremap_spinlock.
+ */
+
+#define CM_PAGECACHE_REFILL	(CVM_PAGECACHE_SIZE / 2)
+
+/*
+ * pagecache_get: take a frame from this CPU's cache for LP. Returns
+ * INVALID_PADDR if the cache is empty.
+ *
+ * Synchronization: takes the cache's spinlock. Does not block.
+ */
+static
+paddr_t
+pagecache_get(struct lpage *lp)
+{
+	struct cpu_vm_machdep *cvm;
+	uint32_t ix;
+
+	cvm = &curcpu->c_vm;
+	spinlock_acquire(&cvm->cvm_pagecache_lock);
+	if (cvm->cvm_pagecache_num == 0) {
+		cvm->cvm_pagecache_misses++;
+		spinlock_release(&cvm->cvm_pagecache_lock);
+		return INVALID_PADDR;
+	}
+	ix = cvm->cvm_pagecache[--cvm->cvm_pagecache_num];
+	cvm->cvm_pagecache_hits++;
+	spinlock_release(&cvm->cvm_pagecache_lock);
+
+	KASSERT(coremap[ix].cm_allocated && coremap[ix].cm_pinned);
+	KASSERT(!coremap[ix].cm_kernel && coremap[ix].cm_lpage == NULL);
+	KASSERT(coremap[ix].cm_tlbix < 0);
+	coremap[ix].cm_lpage = lp;
+
+	return COREMAP_TO_PADDR(ix);
+}
+
+/*
+ * pagecache_put: put the pinned user frame IX, which must not be in
+ * any TLB, into this CPU's cache. Returns 0 if the cache is full.
+ *
+ * Synchronization: takes the cache's spinlock. Does not block.
+ */
+static
+int
+pagecache_put(uint32_t ix)
+{
+	struct cpu_vm_machdep *cvm;
+
+	KASSERT(coremap[ix].cm_allocated && coremap[ix].cm_pinned);
+	KASSERT(!coremap[ix].cm_kernel);
+
+	cvm = &curcpu->c_vm;
+	spinlock_acquire(&cvm->cvm_pagecache_lock);
+	if (cvm->cvm_pagecache_num == CVM_PAGECACHE_SIZE) {
+		spinlock_release(&cvm->cvm_pagecache_lock);
+		return 0;
+	}
+	coremap[ix].cm_lpage = NULL;
+	cvm->cvm_pagecache[cvm->cvm_pagecache_num++] = ix;
+	spinlock_release(&cvm->cvm_pagecache_lock);
+	return 1;
+}
+
+/*
+ * pagecache_release: return a cached frame to the free list.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+pagecache_release(uint32_t ix)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(coremap[ix].cm_allocated && coremap[ix].cm_pinned);
+	KASSERT(!coremap[ix].cm_kernel && coremap[ix].cm_lpage == NULL);
+
+	coremap[ix].cm_allocated = 0;
+	coremap[ix].cm_pinned = 0;
+	coremap[ix].cm_referenced = 0;
+	freelist_add(ix);
+	num_coremap_user--;
+	num_coremap_free++;
+}
+
+/*
+ * pagecache_drainall: empty every CPU's cache back into the free list.
+ *
+ * Synchronization: assumes we hold coremap_spinlock; takes each
+ * cache's spinlock in turn. Does not block.
+ */
+static
+void
+pagecache_drainall(void)
+{
+	struct cpu_vm_machdep *cvm;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	for (i=0; i<num_cpuvms; i++) {
+		cvm = cpuvms[i];
+		spinlock_acquire(&cvm->cvm_pagecache_lock);
+		while (cvm->cvm_pagecache_num > 0) {
+			cvm->cvm_pagecache_num--;
+			pagecache_release(cvm->cvm_pagecache[
+						cvm->cvm_pagecache_num]);
+		}
+		spinlock_release(&cvm->cvm_pagecache_lock);
+	}
+	KASSERT(num_coremap_kernel+num_coremap_user+num_coremap_free
+	       == num_coremap_entries);
+	/* in case anyone was (uselessly) waiting on one */
+	wchan_wakeall(coremap_pinchan);
+}
+
+/*
+ * pagecache_fill: after a cache miss, put up to N frames from the free
+ * list into this CPU's cache. Leaves at least CM_MIN_SLACK pages on
+ * the free list.
+ *
+ * Synchronization: takes coremap_spinlock, and then (not at the same
+ * time) the cache's spinlock. Does not block.
+ */
+static
+void
+pagecache_fill(unsigned n)
+{
+	uint32_t got[CM_PAGECACHE_REFILL];
+	unsigned i, ngot;
+
+	KASSERT(n <= CM_PAGECACHE_REFILL);
+
+	spinlock_acquire(&coremap_spinlock);
+	for (ngot=0; ngot<n; ngot++) {
+		if (num_coremap_free <= CM_MIN_SLACK) {
+			break;
+		}
+		got[ngot] = freelist_findblock(0);
+		KASSERT(got[ngot] != CM_NOPAGE);
+		mark_pages_allocated(got[ngot], 1 /* npages */,
+				     1 /* dopin */, 0 /* iskern */);
+	}
+	spinlock_release(&coremap_spinlock);
+
+	/*
+	 * Something else may have filled the cache meanwhile (we can
+	 * be preempted, or have been migrated); give back what won't fit.
+	 */
+	for (i=0; i<ngot; i++) {
+		if (!pagecache_put(got[i])) {
+			break;
+		}
+	}
+	if (i < ngot) {
+		spinlock_acquire(&coremap_spinlock);
+		for (; i<ngot; i++) {
+			pagecache_release(got[i]);
+		}
+		spinlock_release(&coremap_spinlock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Pre-zeroed pages
+//
+
+/*
+ * A zero-fill fault used to allocate a page and bzero it on the spot,
+ * in the faulting thread. Instead, when a CPU has nothing to run,
+ * cpu_idle calls coremap_idle_prezero, which takes a free page, clears
+ * it, and puts it in zeropool; coremap_allocuser_zeroed takes pages
+ * from there first and only clears one itself when the pool is empty.
+ *
+ * Pages in the pool are held the same way as those in the per-CPU
+ * page caches: allocated, pinned, counted as user pages, no lpage. So
+ * everything that scans the coremap leaves them alone, and they go
+ * back on the free list (zeropool_drain) at the same points the page
+ * caches are drained, so they never force evictions. The idle loop
+ * only takes pages while comfortably more than pageout_hiwater are
+ * free, so it doesn't push anyone else into paging either.
+ *
+ * The pool holds at most a thirty-second of memory, up to
+ * ZEROPOOL_SIZE pages.
+ *
+ * Lock order: coremap_spinlock before zeropool_lock. The lock is only
+ * held to add or remove an index, never while clearing a page.
+ */
+
+/*
+ * zeropool_get: take a pre-zeroed page from the pool for LP. Returns
+ * INVALID_PADDR if there aren't any.
+ *
+ * Synchronization: takes zeropool_lock. Does not block.
+ */
+static
+paddr_t
+zeropool_get(struct lpage *lp)
+{
+	uint32_t ix;
+
+	spinlock_acquire(&zeropool_lock);
+	if (zeropool_num == 0) {
+		zeropool_misses++;
+		spinlock_release(&zeropool_lock);
+		return INVALID_PADDR;
+	}
+	ix = zeropool[--zeropool_num];
+	zeropool_hits++;
+	spinlock_release(&zeropool_lock);
+
+	KASSERT(coremap[ix].cm_allocated && coremap[ix].cm_pinned);
+	KASSERT(!coremap[ix].cm_kernel && coremap[ix].cm_lpage == NULL);
+	KASSERT(coremap[ix].cm_tlbix < 0);
+	coremap[ix].cm_lpage = lp;
+
+	return COREMAP_TO_PADDR(ix);
+}
+
+/*
+ * zeropool_drain: put every page in the pool back on the free list.
+ *
+ * Synchronization: assumes we hold coremap_spinlock; takes
+ * zeropool_lock. Does not block.
+ */
+static
+void
+zeropool_drain(void)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	spinlock_acquire(&zeropool_lock);
+	while (zeropool_num > 0) {
+		zeropool_num--;
+		pagecache_release(zeropool[zeropool_num]);
+	}
+	spinlock_release(&zeropool_lock);
+	KASSERT(num_coremap_kernel+num_coremap_user+num_coremap_free
+	       == num_coremap_entries);
+}
+
+/*
+ * coremap_idle_prezero: called by an idle CPU. Clear one free page
+ * into the pool, if it isn't full and memory isn't short. Returns true
+ * if it did, in which case the caller should check for work again
+ * before calling back; false if there was nothing to do.
+ *
+ * Synchronization: takes coremap_spinlock, then (not at the same
+ * time) zeropool_lock. Does not block; runs with interrupts off.
+ */
+bool
+coremap_idle_prezero(void)
+{
+	uint32_t ix;
+
+	/* unlocked peek; if it's wrong we'll find out below */
+	if (zeropool_num >= zeropool_max) {
+		return false;
+	}
+
+	spinlock_acquire(&coremap_spinlock);
+	if (num_coremap_free <= pageout_hiwater + CM_MIN_SLACK) {
+		spinlock_release(&coremap_spinlock);
+		return false;
+	}
+	ix = freelist_findblock(0);
+	KASSERT(ix != CM_NOPAGE);
+	mark_pages_allocated(ix, 1 /* npages */,
+			     1 /* dopin */, 0 /* iskern */);
+	spinlock_release(&coremap_spinlock);
+
+	/* it's pinned and has no lpage, so it's ours to clear */
+	bzero((void *)PADDR_TO_KVADDR(COREMAP_TO_PADDR(ix)), PAGE_SIZE);
+
+	spinlock_acquire(&zeropool_lock);
+	if (zeropool_num < zeropool_max) {
+		zeropool[zeropool_num++] = ix;
+		ix = CM_NOPAGE;
+	}
+	spinlock_release(&zeropool_lock);
+
+	spinlock_acquire(&coremap_spinlock);
+	if (ix != CM_NOPAGE) {
+		/* another CPU filled it meanwhile */
+		pagecache_release(ix);
+	}
+	else {
+		ct_prezeroed++;
+	}
+	spinlock_release(&coremap_spinlock);
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Memory allocation (continued)
+//
+
 /*
  * coremap_alloc_one_page
  *
  * Allocate one page of memory, mark it pinned if requested, and
  * return its paddr. The page is marked a kernel page iff the lp
  * argument is NULL.
+ *
+ * User pages come from this CPU's page cache if possible.
  */
 static
 paddr_t
 coremap_alloc_one_page(struct lpage *lp, int dopin)
 {
-	int candidate, i, iskern;
+	int candidate, iskern;
+	uint32_t ix;
+	paddr_t pa;
 
 	iskern = (lp == NULL);
 
-	/*
-	 * Hold this while allocating to reduce starvation of multipage
-	 * allocations. (But we can't if we're in an interrupt, or if
-	 * we're still very early in boot.)
-	 */
-	if (curthread != NULL && !curthread->t_in_interrupt) {
-		lock_acquire(global_paging_lock);
+	if (!iskern) {
+		KASSERT(dopin);
+		pa = pagecache_get(lp);
+		if (pa != INVALID_PADDR) {
+			return pa;
+		}
 	}
 
 	spinlock_acquire(&coremap_spinlock);
@@ -705,34 +1749,29 @@ coremap_alloc_one_page(struct lpage *lp, int dopin)
 	if (iskern && piggish_kernel(1)) {
 		coremap_print_short();
 		spinlock_release(&coremap_spinlock);
-		if (curthread != NULL && !curthread->t_in_interrupt) {
-			lock_release(global_paging_lock);
-		}
 		kprintf("alloc_kpages: kernel heap full getting 1 page\n");
 		return INVALID_PADDR;
 	}
 
 	/*
-	 * For single-page allocations, start at the top end of memory. We
-	 * will do multi-page allocations at the bottom end in the hope of
-	 * reducing long-term fragmentation. But it probably won't help
-	 * much if the system gets busy.
+	 * Single pages are split off the smallest free block there is,
+	 * to leave the big ones for multi-page allocations.
 	 */
 
-	candidate = -1;
-
-	if (num_coremap_free > 0) {
-		/* There's a free page. Find it. */
+	ix = freelist_findblock(0);
+	if (ix == CM_NOPAGE) {
+		/* Get back anything sitting idle in page caches. */
+		pagecache_drainall();
+		zeropool_drain();
+		ix = freelist_findblock(0);
+	}
 
-		for (i = num_coremap_entries-1; i>=0; i--) {
-			if (coremap[i].cm_pinned || coremap[i].cm_allocated) {
-				continue;
-			}
-			KASSERT(coremap[i].cm_kernel==0);
-			KASSERT(coremap[i].cm_lpage==NULL);
-			candidate = i;
-			break;
-		}
+	candidate = -1;
+	if (ix != CM_NOPAGE) {
+		KASSERT(num_coremap_free > 0);
+		candidate = ix;
+		KASSERT(coremap[candidate].cm_kernel==0);
+		KASSERT(coremap[candidate].cm_lpage==NULL);
 	}
 
 	if (candidate < 0 && curthread != NULL && !curthread->t_in_interrupt) {
@@ -742,7 +1781,6 @@ coremap_alloc_one_page(struct lpage *lp, int dopin)
 
 	if (candidate < 0) {
 		spinlock_release(&coremap_spinlock);
-		/* we don't hold global_paging_lock; don't unlock it */
 		return INVALID_PADDR;
 	}
 
@@ -755,145 +1793,142 @@ coremap_alloc_one_page(struct lpage *lp, int dopin)
 	KASSERT(coremap[candidate].cm_cpunum == 0);
 
 	spinlock_release(&coremap_spinlock);
-	if (curthread != NULL && !curthread->t_in_interrupt) {
-		lock_release(global_paging_lock);
+
+	if (!iskern) {
+		/* we missed in the page cache; top it up for next time */
+		pagecache_fill(CM_PAGECACHE_REFILL);
 	}
 
 	return COREMAP_TO_PADDR(candidate);
 }
 
+/*
+ * coremap_alloc_multipages
+ *
+ * Allocate NPAGES physically contiguous kernel pages.
+ *
+ * Round up to a power of two, 2^k, and take the first NPAGES pages of
+ * a free block at least that big; marking the pages allocated splits
+ * the block so that the rest of it stays free. When there is such a
+ * block this takes O(CM_NORDERS + NPAGES log NPAGES) time no matter
+ * how much memory there is.
+ *
+ * If there isn't, make one: pick the aligned 2^k-page window with the
+ * fewest user pages in it (and no kernel or pinned pages), evict the
+ * user pages, which then coalesce into a free block, and try again.
+ * This fallback is the only part that scans the coremap. Other
+ * threads can allocate or pin pages in the window while we have the
+ * spinlock released to page out, so if something changes while we're
+ * paging we just go around again.
+ */
 static
 paddr_t
 coremap_alloc_multipages(unsigned npages)
 {
-	int base, bestbase;
-	int badness, bestbadness;
-	int evicted;
-	unsigned i;
+	uint32_t victims[TLBSHOOTDOWN_MAX];
+	uint32_t base, bestbase, i, size;
+	unsigned order, badness, bestbadness, nvictims;
+	bool drained = false;
 
 	KASSERT(npages>1);
 
-	/*
-	 * Get this early and hold it during the allocation so nobody else
-	 * can start paging while we're trying to page out the victims in
-	 * the allocation range.
-	 */
-
-	if (curthread != NULL && !curthread->t_in_interrupt) {
-		lock_acquire(global_paging_lock);
+	order = 0;
+	while ((1U << order) < npages) {
+		order++;
 	}
+	size = 1U << order;
 
 	spinlock_acquire(&coremap_spinlock);
 
 	if (piggish_kernel(npages)) {
 		coremap_print_short();
 		spinlock_release(&coremap_spinlock);
-		if (curthread != NULL && !curthread->t_in_interrupt) {
-			lock_release(global_paging_lock);
-		}
 		kprintf("alloc_kpages: kernel heap full getting %u pages\n",
 			npages);
 		return INVALID_PADDR;
 	}
 
-	/*
-	 * Look for the best block of this length.
-	 * "badness" counts how many evictions we need to do.
-	 * Find the block where it's smallest.
-	 */
+	if (order >= CM_NORDERS) {
+		spinlock_release(&coremap_spinlock);
+		return INVALID_PADDR;
+	}
 
-	do {
-		bestbase = -1;
-		bestbadness = npages*2;
-		base = -1;
-		badness = 0;
-		for (i=0; i<num_coremap_entries; i++) {
-			if (coremap[i].cm_pinned || coremap[i].cm_kernel) {
-				base = -1;
-				badness = 0;
-				continue;
-			}
-			
-			if (coremap[i].cm_allocated) {
-				KASSERT(coremap[i].cm_lpage != NULL);
-				/*
-				 * We should do badness += 2 if page
-				 * needs cleaning, but we don't know
-				 * that here for now. Also, we shouldn't
-				 * prefer clean pages when there isn't a
-				 * pageout thread, as we'll end up always
-				 * replacing code and never data, which
-				 * doesn't work well. FUTURE.
-				 */
-				badness++;
-			}
-			
-			if (base < 0) {
-				base = i;
-			}
-			else if (i - base >= npages-1) {
-				if (badness < bestbadness) {
-					bestbase = base;
-					bestbadness = badness;
-				}
+	while ((base = freelist_findblock(order)) == CM_NOPAGE) {
 
-				/* Keep trying (offset upwards by one) */
-				if (coremap[base].cm_allocated) {
-					badness--;
+		if (!drained) {
+			/* Frames in page caches are pinned and in the way. */
+			pagecache_drainall();
+			zeropool_drain();
+			drained = true;
+			continue;
+		}
+
+		if (curthread == NULL || curthread->t_in_interrupt) {
+			/* Can't evict here */
+			spinlock_release(&coremap_spinlock);
+			return INVALID_PADDR;
+		}
+
+		bestbase = CM_NOPAGE;
+		bestbadness = size + 1;
+		for (base = 0; base + size <= num_coremap_entries;
+		     base += size) {
+			badness = 0;
+			for (i=base; i<base+size; i++) {
+				if (coremap[i].cm_pinned ||
+				    coremap[i].cm_kernel) {
+					badness = size + 1;
+					break;
+				}
+				if (coremap[i].cm_allocated) {
+					KASSERT(coremap[i].cm_lpage != NULL);
+					badness++;
 				}
-				base++;
+			}
+			if (badness < bestbadness) {
+				bestbase = base;
+				bestbadness = badness;
 			}
 		}
 
-		if (bestbase < 0) {
+		if (bestbase == CM_NOPAGE) {
 			/* no good */
 			spinlock_release(&coremap_spinlock);
-			if (curthread != NULL && !curthread->t_in_interrupt) {
-				lock_release(global_paging_lock);
-			}
 			return INVALID_PADDR;
 		}
+		/* an all-free window would have been a free block */
+		KASSERT(bestbadness > 0);
 
 		/*
-		 * If any pages need evicting, evict them and try the
-		 * whole schmear again. Because we are holding
-		 * global_paging_lock, nobody else *ought* to allocate
-		 * or pin these pages until we're done. But the
-		 * contract with global_paging_lock is that it's
-		 * advisory -- so tolerate and retry if/in case
-		 * something changes while we're paging.
+		 * Evict the window's pages in batches, so their TLB
+		 * shootdowns go out together.
 		 */
-
-		evicted = 0;
-		for (i=bestbase; i<bestbase+npages; i++) {
+		nvictims = 0;
+		for (i=bestbase; i<bestbase+size; i++) {
 			if (coremap[i].cm_pinned || coremap[i].cm_kernel) {
 				/* Whoops... retry */
-				KASSERT(evicted==1);
 				break;
 			}
 			if (coremap[i].cm_allocated) {
-				if (curthread == NULL ||
-				    curthread->t_in_interrupt) {
-					/* Can't evict here */
-					spinlock_release(&coremap_spinlock);
-					/* don't need to unlock */
-					return INVALID_PADDR;
+				coremap[i].cm_pinned = 1;
+				victims[nvictims++] = i;
+				if (nvictims == TLBSHOOTDOWN_MAX) {
+					do_evict_batch(victims, nvictims);
+					nvictims = 0;
 				}
-				do_evict(i);
-				evicted = 1;
 			}
 		}
-	} while (evicted);
+		if (nvictims > 0) {
+			do_evict_batch(victims, nvictims);
+		}
+	}
 
-	mark_pages_allocated(bestbase, npages, 
+	mark_pages_allocated(base, npages, 
 			     0 /* dopin -- not needed for kernel pages */,
 			     1 /* kernel */);
 				     
 	spinlock_release(&coremap_spinlock);
-	if (curthread != NULL && !curthread->t_in_interrupt) {
-		lock_release(global_paging_lock);
-	}
-	return COREMAP_TO_PADDR(bestbase);
+	return COREMAP_TO_PADDR(base);
 }
 
 /*
@@ -912,6 +1947,68 @@ coremap_allocuser(struct lpage *lp)
 	return coremap_alloc_one_page(lp, 1 /* dopin */);
 }
 
+/*
+ * coremap_allocuser_zeroed
+ *
+ * Like coremap_allocuser, but the page comes back cleared to zeros:
+ * from the pre-zeroed pool if there's anything in it, and otherwise
+ * cleared here.
+ *
+ * Synchronization: takes zeropool_lock, and failing that as for
+ * coremap_allocuser. May block to swap pages out.
+ */
+paddr_t
+coremap_allocuser_zeroed(struct lpage *lp)
+{
+	paddr_t pa;
+
+	KASSERT(!curthread->t_in_interrupt);
+
+	pa = zeropool_get(lp);
+	if (pa != INVALID_PADDR) {
+		return pa;
+	}
+
+	pa = coremap_alloc_one_page(lp, 1 /* dopin */);
+	if (pa != INVALID_PADDR) {
+		coremap_zero_page(pa);
+	}
+	return pa;
+}
+
+/*
+ * coremap_freeuser
+ *
+ * Free a pinned user page. The pin goes with it: this is the same as
+ * coremap_free followed by coremap_unpin, except that if the page
+ * isn't in a TLB it goes into this CPU's page cache without touching
+ * coremap_spinlock.
+ *
+ * Synchronization: takes the page cache's spinlock, or failing that
+ * coremap_spinlock. Does not block.
+ */
+void
+coremap_freeuser(paddr_t page)
+{
+	uint32_t ix;
+
+	ix = PADDR_TO_COREMAP(page);
+	KASSERT(ix < num_coremap_entries);
+	KASSERT(coremap[ix].cm_allocated && coremap[ix].cm_pinned);
+	KASSERT(!coremap[ix].cm_kernel && coremap[ix].cm_lpage != NULL);
+
+	/*
+	 * It's pinned, so nobody can put it in a TLB; if it's in one
+	 * now, coremap_free will take it back. So this test is stable.
+	 */
+	if (coremap[ix].cm_tlbix < 0 && pagecache_put(ix)) {
+		return;
+	}
+
+	coremap_free(page, false /* iskern */);
+	coremap_unpin(page);
+}
+
 /*
  * coremap_free 
  *
@@ -919,7 +2016,8 @@ coremap_allocuser(struct lpage *lp)
  * the same block. Cross-checks the iskern flag against the flags
  * maintained in the coremap entry.
  *
- * Synchronization: takes coremap_spinlock. Does not block.
+ * Synchronization: takes coremap_spinlock. Blocks only if a user page
+ * is still mapped in another CPU's TLB and has to be shot down.
  */
 void
 coremap_free(paddr_t page, bool iskern)
@@ -945,91 +2043,381 @@ coremap_free(paddr_t page, bool iskern)
 		 */
 		KASSERT(iskern || coremap[i].cm_pinned);
 
-		/* flush any live mapping */
-		if (coremap[i].cm_tlbix >= 0) {
-			/* should only release one's own pages */
-			KASSERT(coremap[i].cm_cpunum == curcpu->c_number);
+		/*
+		 * Flush any live mapping. It may be in another CPU's
+		 * TLB, left behind there under an ASID its address
+		 * space no longer uses (see mmu_unmap).
+		 */
+		if (coremap[i].cm_tlbix >= 0) {
+			KASSERT(!iskern);
+			tlb_takeback(i);
+			KASSERT(coremap[i].cm_allocated);
+			KASSERT(coremap[i].cm_pinned);
+		}
+
+		DEBUG(DB_VM,"coremap_free: freeing pa 0x%x\n",
+		      COREMAP_TO_PADDR(i));
+
+		/* now we can actually deallocate the page */
+
+		coremap[i].cm_allocated = 0;
+		coremap[i].cm_referenced = 0;
+		if (coremap[i].cm_kernel) {
+			KASSERT(coremap[i].cm_lpage == NULL);
+			num_coremap_kernel--;
+			KASSERT(iskern);
+			coremap[i].cm_kernel = 0;
+		}
+		else {
+			KASSERT(coremap[i].cm_lpage != NULL);
+			num_coremap_user--;
+			KASSERT(!iskern);
+		}
+		num_coremap_free++;
+
+		coremap[i].cm_lpage = NULL;
+		if (!coremap[i].cm_pinned) {
+			/* otherwise it goes on the list when unpinned */
+			freelist_add(i);
+		}
+
+		if (!coremap[i].cm_notlast) {
+			break;
+		}
+
+		coremap[i].cm_notlast = 0;
+	}
+
+	spinlock_release(&coremap_spinlock);
+}
+
+/*
+ * alloc_kpages
+ *
+ * Allocate some kernel-space virtual pages.
+ * This is the interface kmalloc uses to get pages for its use.
+ *
+ * Synchronization: takes coremap_spinlock.
+ * May block to swap pages out.
+ */
+vaddr_t 
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+	if (npages > 1) {
+		pa = coremap_alloc_multipages(npages);
+	}
+	else {
+		pa = coremap_alloc_one_page(NULL, 0 /* dopin */);
+	}
+	if (pa==INVALID_PADDR) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+/*
+ * free_kpages
+ *
+ * Free pages allocated with alloc_kpages.
+ * Synchronization: takes coremap_spinlock. Does not block.
+ */
+void 
+free_kpages(vaddr_t addr)
+{
+	coremap_free(KVADDR_TO_PADDR(addr), true /* iskern */);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Pageout thread
+//
+
+/*
+ * The pageout thread writes dirty user pages to swap ahead of time,
+ * so that when memory is full page_replace can usually find a clean
+ * victim and the faulting thread only has to discard it instead of
+ * waiting for a swap write.
+ *
+ * It wakes up when pageout_poke thinks the supply of free and clean
+ * pages may have dropped below pageout_lowater, and cleans pages until
+ * there are pageout_hiwater of them. Pages that are in a TLB are in
+ * active use and are left alone. Because the dirty bit lives in the
+ * lpage, which we can't lock while holding coremap_spinlock, all the
+ * counts here are estimates.
+ */
+
+/*
+ * pageout_countclean: count free pages plus clean user pages.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ * Holding coremap_spinlock keeps cm_lpage from being freed under us.
+ */
+static
+uint32_t
+pageout_countclean(void)
+{
+	uint32_t i, n;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	n = num_coremap_free;
+	for (i=0; i<num_coremap_entries; i++) {
+		if (!coremap[i].cm_allocated || coremap[i].cm_kernel ||
+		    coremap[i].cm_pinned) {
+			/* pinned pages may be in page caches or in flux */
+			continue;
+		}
+		KASSERT(coremap[i].cm_lpage != NULL);
+		if (!LP_ISDIRTY(coremap[i].cm_lpage)) {
+			n++;
+		}
+	}
+	return n;
+}
+
+/*
+ * pageout_cleancluster: find up to SWAP_CLUSTER dirty, unpinned user
+ * pages that aren't in any TLB and write them to swap together (see
+ * lpage_clean_cluster). Returns how many pages were found; 0 means a
+ * whole sweep of the coremap found nothing to clean.
+ *
+ * Pages of shared file mappings go back to their files, which needs
+ * vfs_biglock; they're left for pageout_cleanfiles, and *SAWFILES
+ * is set if any were passed over.
+ *
+ * Synchronization: takes coremap_spinlock. Pins the pages while
+ * cleaning them; anyone else who wants one waits for the pin.
+ */
+static
+unsigned
+pageout_cleancluster(bool *sawfiles)
+{
+	struct lpage *lps[SWAP_CLUSTER];
+	paddr_t pas[SWAP_CLUSTER];
+	struct lpage *lp;
+	uint32_t where, n;
+	unsigned i, count;
+
+	count = 0;
+	spinlock_acquire(&coremap_spinlock);
+
+	for (n=0; n<num_coremap_entries && count<SWAP_CLUSTER; n++) {
+		where = pageout_hand;
+		pageout_hand = (pageout_hand + 1) % num_coremap_entries;
+
+		if (!coremap[where].cm_allocated ||
+		    coremap[where].cm_kernel ||
+		    coremap[where].cm_pinned ||
+		    coremap[where].cm_tlbix >= 0) {
+			continue;
+		}
+		lp = coremap[where].cm_lpage;
+		KASSERT(lp != NULL);
+		if (!LP_ISDIRTY(lp)) {
+			continue;
+		}
+		if (LP_ISFILESHARED(lp)) {
+			*sawfiles = true;
+			continue;
+		}
+
+		/*
+		 * Pin it. Since it isn't in a TLB, nobody can write it
+		 * until they fault, and they can't get past the fault
+		 * until we unpin.
+		 */
+		coremap[where].cm_pinned = 1;
+		lps[count] = lp;
+		pas[count] = COREMAP_TO_PADDR(where);
+		count++;
+	}
+
+	spinlock_release(&coremap_spinlock);
 
-			tlb_invalidate(coremap[i].cm_tlbix);
-			coremap[i].cm_tlbix = -1;
-			coremap[i].cm_cpunum = 0;
+	if (count == 0) {
+		return 0;
+	}
 
-			DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
-				(unsigned long) COREMAP_TO_PADDR(i));
-		}
+	lpage_clean_cluster(lps, pas, count);
 
-		DEBUG(DB_VM,"coremap_free: freeing pa 0x%x\n",
-		      COREMAP_TO_PADDR(i));
+	for (i=0; i<count; i++) {
+		coremap_unpin(pas[i]);
+	}
+	return count;
+}
 
-		/* now we can actually deallocate the page */
+/*
+ * pageout_cleanfiles: like pageout_cleancluster, for dirty pages of
+ * shared file mappings, which are written back to their files one at
+ * a time (see lpage_clean). Returns how many pages were found.
+ *
+ * Synchronization: vfs_biglock has to be taken before any page is
+ * pinned (see lpage_pagein), so take it first, and then proceed as
+ * in pageout_cleancluster.
+ */
+static
+unsigned
+pageout_cleanfiles(void)
+{
+	struct lpage *lps[SWAP_CLUSTER];
+	paddr_t pas[SWAP_CLUSTER];
+	struct lpage *lp;
+	uint32_t where, n;
+	unsigned i, count;
 
-		coremap[i].cm_allocated = 0;
-		if (coremap[i].cm_kernel) {
-			KASSERT(coremap[i].cm_lpage == NULL);
-			num_coremap_kernel--;
-			KASSERT(iskern);
-			coremap[i].cm_kernel = 0;
-		}
-		else {
-			KASSERT(coremap[i].cm_lpage != NULL);
-			num_coremap_user--;
-			KASSERT(!iskern);
-		}
-		num_coremap_free++;
+	count = 0;
+	vfs_biglock_acquire();
+	spinlock_acquire(&coremap_spinlock);
 
-		coremap[i].cm_lpage = NULL;
+	for (n=0; n<num_coremap_entries && count<SWAP_CLUSTER; n++) {
+		where = pageout_hand;
+		pageout_hand = (pageout_hand + 1) % num_coremap_entries;
 
-		if (!coremap[i].cm_notlast) {
-			break;
+		if (!coremap[where].cm_allocated ||
+		    coremap[where].cm_kernel ||
+		    coremap[where].cm_pinned ||
+		    coremap[where].cm_tlbix >= 0) {
+			continue;
+		}
+		lp = coremap[where].cm_lpage;
+		KASSERT(lp != NULL);
+		if (!LP_ISDIRTY(lp) || !LP_ISFILESHARED(lp)) {
+			continue;
 		}
 
-		coremap[i].cm_notlast = 0;
+		coremap[where].cm_pinned = 1;
+		lps[count] = lp;
+		pas[count] = COREMAP_TO_PADDR(where);
+		count++;
 	}
 
 	spinlock_release(&coremap_spinlock);
+
+	for (i=0; i<count; i++) {
+		lpage_clean(lps[i]);
+		coremap_unpin(pas[i]);
+	}
+
+	vfs_biglock_release();
+	return count;
 }
 
 /*
- * alloc_kpages
- *
- * Allocate some kernel-space virtual pages.
- * This is the interface kmalloc uses to get pages for its use.
- *
- * Synchronization: takes coremap_spinlock.
- * May block to swap pages out.
+ * pageout_thread: the pageout thread's main loop.
  */
-vaddr_t 
-alloc_kpages(int npages)
+static
+void
+pageout_thread(void *data1, unsigned long data2)
 {
-	paddr_t pa;
-	if (npages > 1) {
-		pa = coremap_alloc_multipages(npages);
-	}
-	else {
-		pa = coremap_alloc_one_page(NULL, 0 /* dopin */);
-	}
-	if (pa==INVALID_PADDR) {
-		return 0;
+	uint32_t nclean;
+	unsigned n;
+	bool stalled = false;
+	bool sawfiles;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		spinlock_acquire(&coremap_spinlock);
+		nclean = pageout_countclean();
+		if (stalled || nclean >= pageout_lowater) {
+			/*
+			 * Nothing to do, or nothing we can do right now
+			 * (everything dirty is pinned or in use). Wait
+			 * for pageout_poke.
+			 */
+			pageout_idle = true;
+			pageout_evictions = 0;
+			wchan_lock(coremap_pageoutchan);
+			spinlock_release(&coremap_spinlock);
+			wchan_sleep(coremap_pageoutchan);
+			stalled = false;
+			continue;
+		}
+		pageout_idle = false;
+		ct_pageout_runs++;
+		spinlock_release(&coremap_spinlock);
+
+		while (nclean < pageout_hiwater) {
+			sawfiles = false;
+			n = pageout_cleancluster(&sawfiles);
+			if (sawfiles) {
+				n += pageout_cleanfiles();
+			}
+			if (n == 0) {
+				stalled = true;
+				break;
+			}
+			nclean += n;
+		}
 	}
-	return PADDR_TO_KVADDR(pa);
 }
 
 /*
- * free_kpages
+ * pageout_bootstrap: start the pageout thread.
  *
- * Free pages allocated with alloc_kpages.
- * Synchronization: takes coremap_spinlock. Does not block.
+ * Synchronization: none; runs at boot, after pid_bootstrap.
  */
-void 
-free_kpages(vaddr_t addr)
+void
+pageout_bootstrap(void)
 {
-	coremap_free(KVADDR_TO_PADDR(addr), true /* iskern */);
+	int result;
+
+	result = thread_fork("pageout", pageout_thread, NULL, 0, NULL);
+	if (result) {
+		panic("vm: Cannot start pageout thread: %s\n",
+		      strerror(result));
+	}
+
+	spinlock_acquire(&coremap_spinlock);
+	pageout_running = true;
+	spinlock_release(&coremap_spinlock);
 }
 
 ////////////////////////////////////////////////////////////
 
 /*
- * coremap_print_short: diagnostic dump of coremap to console.
+ * coremap_print_summary: print the page counts and the free blocks of
+ * each order, without the per-page map.
+ *
+ * synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+coremap_print_summary(void)
+{
+	uint32_t i;
+	uint32_t nfree, largest;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+		
+	kprintf("Coremap: %u entries, %uk/%uu/%uf\n",
+		num_coremap_entries,
+		num_coremap_kernel, num_coremap_user, num_coremap_free);
+
+	/*
+	 * Fragmentation: free blocks of each size, and how much of the
+	 * free memory is outside the largest free block (0% means it's
+	 * all in one piece).
+	 */
+	nfree = largest = 0;
+	kprintf("Free blocks by order:");
+	for (i=0; i<CM_NORDERS; i++) {
+		if (buddy_nblocks[i] > 0) {
+			kprintf(" %u:%u", i, buddy_nblocks[i]);
+			nfree += buddy_nblocks[i] << i;
+			largest = 1U << i;
+		}
+	}
+	kprintf("\n");
+	kprintf("Largest free block %u pages; fragmentation %u%%\n",
+		largest, nfree ? 100 - (largest * 100 / nfree) : 0);
+}
+
+/*
+ * coremap_print_short: diagnostic dump of coremap to console: the
+ * summary, then one character per page.
  *
  * synchronization: assumes we hold coremap_spinlock. Does not block.
  * (printing will happen in polling mode)
@@ -1041,10 +2429,8 @@ coremap_print_short(void)
 	uint32_t i, atbol=1;
 
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
-		
-	kprintf("Coremap: %u entries, %uk/%uu/%uf\n",
-		num_coremap_entries,
-		num_coremap_kernel, num_coremap_user, num_coremap_free);
+
+	coremap_print_summary();
 
 	for (i=0; i<num_coremap_entries; i++) {
 		if (atbol) {
@@ -1057,6 +2443,11 @@ coremap_print_short(void)
 		else if (coremap[i].cm_kernel) {
 			kprintf("K");
 		}
+		else if (coremap[i].cm_allocated && coremap[i].cm_pinned &&
+			 coremap[i].cm_lpage == NULL) {
+			/* in a per-CPU page cache */
+			kprintf("c");
+		}
 		else if (coremap[i].cm_allocated && coremap[i].cm_pinned) {
 			kprintf("&");
 		}
@@ -1077,6 +2468,18 @@ coremap_print_short(void)
 }
 #undef NCOLS
 
+/*
+ * vm_printmap: print the whole coremap. For the menu; vm_printmdstats
+ * only prints the summary.
+ */
+void
+vm_printmap(void)
+{
+	spinlock_acquire(&coremap_spinlock);
+	coremap_print_short();
+	spinlock_release(&coremap_spinlock);
+}
+
 /*
  * coremap_pinwait: wait for a pinned page to unpin.
  */
@@ -1107,6 +2510,10 @@ coremap_pin(paddr_t paddr)
 	while (coremap[ix].cm_pinned) {
 		coremap_pinwait();
 	}
+	if (!coremap[ix].cm_allocated) {
+		/* freed under us (our caller will notice); keep it free */
+		freelist_remove(ix);
+	}
 	coremap[ix].cm_pinned = 1;
 	spinlock_release(&coremap_spinlock);
 }
@@ -1150,10 +2557,36 @@ coremap_unpin(paddr_t paddr)
 	spinlock_acquire(&coremap_spinlock);
 	KASSERT(coremap[ix].cm_pinned);
 	coremap[ix].cm_pinned = 0;
+	if (!coremap[ix].cm_allocated) {
+		freelist_add(ix);
+	}
 	wchan_wakeall(coremap_pinchan);
 	spinlock_release(&coremap_spinlock);
 }
 
+/*
+ * coremap_unmap_page: take a pinned page out of whatever TLB it's in,
+ * so that nobody can write it without faulting and waiting for the
+ * pin. For writing back shared file pages (see lpage_sync).
+ *
+ * Synchronization: takes coremap_spinlock. May block for a shootdown.
+ */
+void
+coremap_unmap_page(paddr_t paddr)
+{
+	unsigned ix;
+
+	ix = PADDR_TO_COREMAP(paddr);
+	KASSERT(ix<num_coremap_entries);
+
+	spinlock_acquire(&coremap_spinlock);
+	KASSERT(coremap[ix].cm_pinned);
+	if (coremap[ix].cm_tlbix >= 0) {
+		tlb_takeback(ix);
+	}
+	spinlock_release(&coremap_spinlock);
+}
+
 /*
  * coremap_zero_page: zero out a memory page. Page should be pinned.
  *
@@ -1199,7 +2632,22 @@ coremap_copy_page(paddr_t oldpaddr, paddr_t newpaddr)
  */
 
 /*
- * mmu_setas: Set current address space in MMU.
+ * mmu_initas: Set up the MMU state of a new address space. It gets an
+ * ASID when it's first activated.
+ *
+ * Synchronization: none.
+ */
+void
+mmu_initas(struct addrspace *as)
+{
+	as->as_asid.ma_asid = 0;
+	as->as_asid.ma_gen = 0;
+	as->as_asid.ma_cpus = 0;
+}
+
+/*
+ * mmu_setas: Set current address space in MMU. This just loads its
+ * ASID; the TLB isn't flushed unless ASIDs have been recycled.
  *
  * Synchronization: takes coremap_spinlock. Does not block.
  */
@@ -1207,55 +2655,65 @@ void
 mmu_setas(struct addrspace *as)
 {
 	spinlock_acquire(&coremap_spinlock);
-	if (as != curcpu->c_vm.cvm_lastas) {
-		curcpu->c_vm.cvm_lastas = as;
-		tlb_clear();
-	}
+	asid_load(as);
 	spinlock_release(&coremap_spinlock);
 }
 
 /*
  * mmu_unmap: Remove a translation from the MMU.
  *
+ * AS need not be the current address space; its entries stay in the
+ * TLB after it's switched out. If it has only been loaded on this CPU
+ * under its present ASID, we can find the entry with a probe. If it
+ * may have entries on other CPUs too, rather than interrupting them we
+ * give it a new ASID, so none of its old entries can match any more;
+ * the coremap still knows where they are, and takes them back when it
+ * needs to.
+ *
  * Synchronization: takes coremap_spinlock. Does not block.
  */
 void
 mmu_unmap(struct addrspace *as, vaddr_t va)
 {
+	struct mmu_asid *ma = &as->as_asid;
+	uint32_t me = 1U << curcpu->c_number;
+
 	spinlock_acquire(&coremap_spinlock);
-	if (as == curcpu->c_vm.cvm_lastas) {
-		tlb_unmap(va);
+	if (ma->ma_gen == 0 || ma->ma_cpus == 0) {
+		/* nothing of it can be in a TLB */
+	}
+	else if (ma->ma_cpus == me) {
+		if (ma->ma_gen == curcpu->c_vm.cvm_asidgen) {
+			tlb_unmap(va, ma->ma_asid);
+		}
+		/* else we've flushed since it was loaded here */
+	}
+	else {
+		ma->ma_gen = 0;
+		ma->ma_cpus = 0;
+		if (as == curcpu->c_vm.cvm_lastas) {
+			asid_load(as);
+		}
 	}
 	spinlock_release(&coremap_spinlock);
 }
 
 /*
- * mmu_map: Enter a translation into the MMU. (This is the end result
- * of fault handling.)
+ * mmu_load: load the translation VA -> PA, for coremap entry CMIX,
+ * into TLB slot TLBIX, or into a new slot if TLBIX is -1 (meaning the
+ * page isn't in this CPU's TLB under this VA already, and not in any
+ * other slot either).
  *
- * Synchronization: Takes coremap_spinlock. Does not block.
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
  */
+static
 void
-mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
+mmu_load(vaddr_t va, paddr_t pa, unsigned cmix, int tlbix, int writable)
 {
-	int tlbix;
 	uint32_t ehi, elo;
-	unsigned cmix;
-	
-	KASSERT(pa/PAGE_SIZE >= base_coremap_page);
-	KASSERT(pa/PAGE_SIZE - base_coremap_page < num_coremap_entries);
-	
-	spinlock_acquire(&coremap_spinlock);
-
-	KASSERT(as == curcpu->c_vm.cvm_lastas);
 
-	cmix = PADDR_TO_COREMAP(pa);
-	KASSERT(cmix < num_coremap_entries);
-
-	/* Page must be pinned. */
-	KASSERT(coremap[cmix].cm_pinned);
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
 
-	tlbix = tlb_probe(va, 0);
 	if (tlbix < 0) {
 		KASSERT(coremap[cmix].cm_tlbix == -1);
 		KASSERT(coremap[cmix].cm_cpunum == 0);
@@ -1272,13 +2730,55 @@ mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
 		KASSERT(coremap[cmix].cm_cpunum == curcpu->c_number);
 	}
 
-	ehi = va & TLBHI_VPAGE;
+	ehi = (va & TLBHI_VPAGE) | TLBHI_MKPID(curcpu->c_vm.cvm_asid);
 	elo = (pa & TLBLO_PPAGE) | TLBLO_VALID;
 	if (writable) {
 		elo |= TLBLO_DIRTY;
 	}
 
 	tlb_write(ehi, elo, tlbix);
+	coremap[cmix].cm_referenced = 1;
+}
+
+/*
+ * mmu_map: Enter a translation into the MMU. (This is the end result
+ * of fault handling.)
+ *
+ * Synchronization: Takes coremap_spinlock. Blocks only if the page is
+ * shared and has to be shot down out of another CPU's TLB first.
+ */
+void
+mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
+{
+	int tlbix;
+	unsigned cmix;
+	
+	KASSERT(pa/PAGE_SIZE >= base_coremap_page);
+	KASSERT(pa/PAGE_SIZE - base_coremap_page < num_coremap_entries);
+	
+	spinlock_acquire(&coremap_spinlock);
+
+	KASSERT(as == curcpu->c_vm.cvm_lastas);
+
+	cmix = PADDR_TO_COREMAP(pa);
+	KASSERT(cmix < num_coremap_entries);
+
+	/* Page must be pinned. */
+	KASSERT(coremap[cmix].cm_pinned);
+
+	KASSERT(as->as_asid.ma_asid == curcpu->c_vm.cvm_asid);
+
+	tlbix = tlb_probe(va | TLBHI_MKPID(curcpu->c_vm.cvm_asid), 0);
+	if (tlbix < 0 && coremap[cmix].cm_tlbix >= 0) {
+		/*
+		 * A shared (copy-on-write) page may still be
+		 * mapped by another address space. Each page
+		 * is only in one TLB slot at a time, so take
+		 * it away from them; they'll refault.
+		 */
+		tlb_takeback(cmix);
+	}
+	mmu_load(va, pa, cmix, tlbix, writable);
 
 	/* Unpin the page. */
 	coremap[cmix].cm_pinned = 0;
@@ -1286,3 +2786,102 @@ mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
 
 	spinlock_release(&coremap_spinlock);
 }
+
+/*
+ * mmu_map_zero: map VA read-only to the zero page. (This is the end
+ * result of a read fault on an anonymous page that has never been
+ * written; see as_fault.) The zero page has no coremap entry, so
+ * there's nothing to pin or record. If VA is in the TLB already it can
+ * only be because it's mapped to the zero page, so the slot is just
+ * rewritten.
+ *
+ * Whoever later gives VA a real page must mmu_unmap it first.
+ *
+ * Synchronization: Takes coremap_spinlock. Does not block.
+ */
+void
+mmu_map_zero(struct addrspace *as, vaddr_t va)
+{
+	int tlbix;
+	uint32_t ehi, elo;
+
+	spinlock_acquire(&coremap_spinlock);
+
+	KASSERT(as == curcpu->c_vm.cvm_lastas);
+	KASSERT(as->as_asid.ma_asid == curcpu->c_vm.cvm_asid);
+
+	ehi = (va & TLBHI_VPAGE) | TLBHI_MKPID(curcpu->c_vm.cvm_asid);
+	tlbix = tlb_probe(ehi, 0);
+	if (tlbix >= 0) {
+		tlb_read(&ehi, &elo, tlbix);
+		KASSERT((elo & TLBLO_PPAGE) == zeropage_paddr);
+	}
+	else {
+		tlbix = mipstlb_getslot();
+		KASSERT(tlbix>=0 && tlbix<NUM_TLB);
+	}
+
+	elo = (zeropage_paddr & TLBLO_PPAGE) | TLBLO_VALID;
+	tlb_write(ehi, elo, tlbix);
+	ct_zeromaps++;
+
+	spinlock_release(&coremap_spinlock);
+}
+
+/*
+ * mmu_map_fast: like mmu_map, but for a page that hasn't been pinned
+ * (see lpage_fastfault). PA and WRITABLE were worked out from LP's
+ * lp_paddr when its lp_seq was SEQ. Check that the page still belongs
+ * to LP, isn't pinned, and that lp_seq hasn't changed; if so, nobody
+ * can be doing anything to the page, and whoever does later will pin
+ * it and take back the mapping we make. Returns false without doing
+ * anything if the check fails, or if the page is in some other TLB
+ * slot, since getting it back might mean waiting for a shootdown.
+ *
+ * With PREFAULT, we're mapping a page nobody has faulted on yet, so if
+ * VA is in the TLB already it's left alone.
+ *
+ * Synchronization: Takes coremap_spinlock. Does not block.
+ */
+bool
+mmu_map_fast(struct addrspace *as, vaddr_t va, paddr_t pa, int writable,
+	     struct lpage *lp, unsigned seq, bool prefault)
+{
+	int tlbix;
+	unsigned cmix;
+
+	KASSERT(pa/PAGE_SIZE >= base_coremap_page);
+	KASSERT(pa/PAGE_SIZE - base_coremap_page < num_coremap_entries);
+
+	spinlock_acquire(&coremap_spinlock);
+
+	KASSERT(as == curcpu->c_vm.cvm_lastas);
+	KASSERT(as->as_asid.ma_asid == curcpu->c_vm.cvm_asid);
+
+	cmix = PADDR_TO_COREMAP(pa);
+	if (coremap[cmix].cm_pinned || coremap[cmix].cm_lpage != lp ||
+	    lp->lp_seq != seq) {
+		spinlock_release(&coremap_spinlock);
+		return false;
+	}
+
+	tlbix = tlb_probe(va | TLBHI_MKPID(curcpu->c_vm.cvm_asid), 0);
+	if (tlbix >= 0 && prefault) {
+		spinlock_release(&coremap_spinlock);
+		return true;
+	}
+	if (tlbix < 0 && coremap[cmix].cm_tlbix >= 0) {
+		spinlock_release(&coremap_spinlock);
+		return false;
+	}
+	mmu_load(va, pa, cmix, tlbix, writable);
+	if (prefault) {
+		ct_prefaults++;
+	}
+	else {
+		ct_fastrefills++;
+	}
+
+	spinlock_release(&coremap_spinlock);
+	return true;
+}
@@ -41,6 +41,8 @@
 
 #include "opt-randpage.h"
 #include "opt-randtlb.h"
+#include "opt-clockpage.h"
+#include "opt-cow.h"
 
 
 /*
@@ -62,6 +64,8 @@ vm_bootstrap(void)
 
 #if OPT_RANDPAGE
 	kprintf("vm: Page replacement: random\n");
+#elif OPT_CLOCKPAGE
+	kprintf("vm: Page replacement: clock\n");
 #else
 	kprintf("vm: Page replacement: sequential\n");
 #endif
@@ -72,9 +76,13 @@ vm_bootstrap(void)
 	kprintf("vm: TLB replacement: sequential\n");
 #endif
 
-	coremap_bootstrap();
+#if OPT_COW
+	kprintf("vm: Fork: copy-on-write\n");
+#else
+	kprintf("vm: Fork: copy\n");
+#endif
 
-	global_paging_lock = lock_create("global_paging_lock");
+	coremap_bootstrap();
 }
 
 /*
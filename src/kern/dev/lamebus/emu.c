@@ -261,16 +261,33 @@ emu_close(struct emu_softc *sc, uint32_t handle)
 
 /*
  * Common code for read and readdir.
+ *
+ * A user buffer isn't copied to with e_lock held: touching it can
+ * fault, and if the page is part of a program loaded from this device
+ * the fault reads it in through here, which would take e_lock again.
+ * So user reads go through a bounce buffer, and the uiomove is done
+ * after the lock is dropped. (emu_write does the same the other way.)
  */
 static
 int
 emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	   uint32_t op, struct uio *uio)
 {
+	char *bounce;
+	uint32_t got;
+	off_t newoffset;
 	int result;
 
 	KASSERT(uio->uio_rw == UIO_READ);
 
+	bounce = NULL;
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		bounce = kmalloc(len);
+		if (bounce == NULL) {
+			return ENOMEM;
+		}
+	}
+
 	lock_acquire(sc->e_lock);
 
 	emu_wreg(sc, REG_HANDLE, handle);
@@ -279,15 +296,26 @@ emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	emu_wreg(sc, REG_OPER, op);
 	result = emu_waitdone(sc);
 	if (result) {
-		goto out;
+		lock_release(sc->e_lock);
+		kfree(bounce);
+		return result;
 	}
-	
-	result = uiomove(sc->e_iobuf, emu_rreg(sc, REG_IOLEN), uio);
 
-	uio->uio_offset = emu_rreg(sc, REG_OFFSET);
+	got = emu_rreg(sc, REG_IOLEN);
+	newoffset = emu_rreg(sc, REG_OFFSET);
+	if (bounce == NULL) {
+		result = uiomove(sc->e_iobuf, got, uio);
+		lock_release(sc->e_lock);
+	}
+	else {
+		KASSERT(got <= len);
+		memcpy(bounce, sc->e_iobuf, got);
+		lock_release(sc->e_lock);
+		result = uiomove(bounce, got, uio);
+		kfree(bounce);
+	}
 
- out:
-	lock_release(sc->e_lock);
+	uio->uio_offset = newoffset;
 	return result;
 }
 
@@ -321,19 +349,39 @@ int
 emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	  struct uio *uio)
 {
+	char *bounce;
 	int result;
 
 	KASSERT(uio->uio_rw == UIO_WRITE);
 
+	/* Fetch a user buffer before taking e_lock; see emu_doread. */
+	bounce = NULL;
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		bounce = kmalloc(len);
+		if (bounce == NULL) {
+			return ENOMEM;
+		}
+		result = uiomove(bounce, len, uio);
+		if (result) {
+			kfree(bounce);
+			return result;
+		}
+	}
+
 	lock_acquire(sc->e_lock);
 
 	emu_wreg(sc, REG_HANDLE, handle);
 	emu_wreg(sc, REG_IOLEN, len);
 	emu_wreg(sc, REG_OFFSET, uio->uio_offset);
 
-	result = uiomove(sc->e_iobuf, len, uio);
-	if (result) {
-		goto out;
+	if (bounce == NULL) {
+		result = uiomove(sc->e_iobuf, len, uio);
+		if (result) {
+			goto out;
+		}
+	}
+	else {
+		memcpy(sc->e_iobuf, bounce, len);
 	}
 
 	emu_wreg(sc, REG_OPER, EMU_OP_WRITE);
@@ -341,6 +389,7 @@ emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
 
  out:
 	lock_release(sc->e_lock);
+	kfree(bounce);
 	return result;
 }
 
@@ -840,9 +889,10 @@ emufs_namefile(struct vnode *v, struct uio *uio)
  */
 static
 int
-emufs_mmap(struct vnode *v)
+emufs_mmap(struct vnode *v, int prot)
 {
 	(void)v;
+	(void)prot;
 	return EUNIMP;
 }
 
@@ -1059,6 +1109,15 @@ emufs_lookparent_notdir(struct vnode *v, char *pathname, struct vnode **result,
 }
 
 
+static
+int
+emufs_mmap_isdir(struct vnode *v, int prot)
+{
+	(void)v;
+	(void)prot;
+	return EISDIR;
+}
+
 static
 int
 emufs_truncate_isdir(struct vnode *v, off_t len)
@@ -1124,7 +1183,7 @@ static const struct vnode_ops emufs_dirops = {
 	emufs_dir_gettype,
 	emufs_dir_tryseek,
 	emufs_void_op_isdir,  /* fsync */
-	emufs_void_op_isdir,  /* mmap */
+	emufs_mmap_isdir,
 	emufs_truncate_isdir,
 	emufs_namefile,
 
@@ -225,12 +225,17 @@ lhd_io(struct device *d, struct uio *uio)
 		statval |= LHD_ISWRITE;
 	}
 
+	/*
+	 * Wait until nobody else is using the device, and keep it for
+	 * the whole request, so a multi-sector transfer (e.g. a cluster
+	 * of swap pages) goes out as one run of consecutive sectors
+	 * instead of being interleaved with other requests.
+	 */
+	P(lh->lh_clear);
+
 	/* Loop over all the sectors we were asked to do. */
 	for (i=0; i<len; i++) {
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
 		/*
 		 * Are we writing? If so, transfer the data to the
 		 * on-card buffer.
@@ -263,15 +268,16 @@ lhd_io(struct device *d, struct uio *uio)
 			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
 		}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
 		/* If we failed, return the error. */
 		if (result) {
+			V(lh->lh_clear);
 			return result;
 		}
 	}
 
+	/* Tell another thread it's cleared to go ahead. */
+	V(lh->lh_clear);
+
 	return 0;
 }
 
@@ -49,8 +49,9 @@ DECLARRAY_BYTYPE(vm_object_array, struct vm_object);
  * space of a process.
  *
  * In the solution set VM, the address space contains an array of
- * vm_objects. Normally there will be one each for text, data/bss,
- * stack, and heap. More can be added if needed.
+ * vm_objects, sorted by base address so a fault can find its region
+ * by binary search. Normally there will be one each for text,
+ * data/bss, stack, and heap; mmap adds more.
  */
 
 struct addrspace {
@@ -65,6 +66,10 @@ struct addrspace {
 #else
         /* Add additional address space objects here as necessary. */
         struct vm_object_array *as_objects;
+        struct vm_object *as_heap;	/* heap region (in as_objects) */
+        vaddr_t as_heapend;		/* current break */
+        struct vm_object *as_lastobj;	/* last region faulted on */
+        struct mmu_asid as_asid;	/* TLB address space ID */
 #endif
 };
 
@@ -95,7 +100,11 @@ struct addrspace {
  *                executable into the address space.
  *
  *    as_complete_load - this is called when loading from an executable
- *                is complete.
+ *                is complete. Sets up the (empty) heap region after
+ *                the last segment.
+ *
+ *    as_define_filedata - arrange for part of a region to be paged in
+ *                from a file on demand, instead of being loaded now.
  *
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
@@ -120,14 +129,29 @@ int               as_define_region(struct addrspace *as,
                                    int executable);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
+#if !OPT_DUMBVM
+int               as_define_filedata(struct addrspace *as,
+                                     vaddr_t vaddr, size_t filesize,
+                                     struct vnode *v, off_t offset);
+#endif
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
 
 /*
  * as_fault - handle fault in (the current) address space.
  * as_sbrk - adjust the heap, like the sbrk() system call.
+ * as_mmap - add a region for the mmap() system call.
+ * as_munmap - remove (the end of) a region made by as_mmap.
+ * as_msync - write back changes to shared file mappings.
  */
 int as_fault(struct addrspace *as, int faulttype, vaddr_t va);
+#if !OPT_DUMBVM
+int as_sbrk(struct addrspace *as, int amount, vaddr_t *oldbreak);
+int as_mmap(struct addrspace *as, size_t len, int prot, int flags,
+            struct vnode *vn, off_t offset, vaddr_t *ret);
+int as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+int as_msync(struct addrspace *as, vaddr_t vaddr, size_t len);
+#endif
 
 /*
  * Functions in loadelf.c
@@ -60,6 +60,8 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_idleclocks;		/* ... of those that found us idle */
+	unsigned c_steals;		/* Threads taken from other cpus */
 	struct cpu_vm_machdep c_vm;	/* Machine-dependent VM bits */
 
 	/*
@@ -153,6 +155,7 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_batch sends several shootdowns with a single IPI.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -167,6 +170,8 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(unsigned targetcpu, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_batch(unsigned targetcpu,
+			    const struct tlbshootdown *mappings, int num);
 
 void interprocessor_interrupt(void);
 
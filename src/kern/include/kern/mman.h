@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Constants for mmap(), munmap(), and msync(). The user-level
+ * prototypes are in <sys/mman.h>.
+ */
+
+/* Page protections (the PROT argument to mmap) */
+#define PROT_NONE     0x0    /* No access */
+#define PROT_READ     0x1    /* Pages can be read */
+#define PROT_WRITE    0x2    /* Pages can be written */
+#define PROT_EXEC     0x4    /* Pages can be executed */
+
+/* Mapping type (the FLAGS argument to mmap); exactly one of these */
+#define MAP_SHARED    0x1    /* Changes are shared with others/the file */
+#define MAP_PRIVATE   0x2    /* Changes are private (copy-on-write) */
+/* ...possibly or'd with this */
+#define MAP_ANONYMOUS 0x10   /* Zero-filled memory, not from a file */
+#define MAP_ANON      MAP_ANONYMOUS
+
+/* Error return from mmap */
+#define MAP_FAILED    ((void *)-1)
+
+/* Flags for msync */
+#define MS_ASYNC      0x1    /* Schedule the writes */
+#define MS_SYNC       0x2    /* Do the writes and wait for them */
+#define MS_INVALIDATE 0x4    /* Discard cached copies */
+
+
+#endif /* _KERN_MMAN_H_ */
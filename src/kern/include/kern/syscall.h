@@ -65,6 +65,7 @@
 //#define SYS_munlock    14
 //#define SYS_munlockall 15
 //#define SYS_minherit   16
+#define SYS_msync        121
 //                              (security/credentials)
 #define SYS_umask        17
 #define SYS_issetugid    18
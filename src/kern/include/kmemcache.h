@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KMEMCACHE_H_
+#define _KMEMCACHE_H_
+
+/*
+ * Object caches.
+ *
+ * A kmem_cache hands out objects of one type and size. Objects freed
+ * back to it aren't torn down: they're kept, up to KMEM_CACHE_MAX of
+ * them, in their constructed state, and the next allocation gets one
+ * back ready to use. So the expensive one-time setup of an object
+ * (making its wait channel, say, or its stack) is done by the
+ * constructor when the cache first makes it, and undone by the
+ * destructor only when the cache gives it back to kmalloc, not every
+ * time the object is created and destroyed.
+ *
+ * The contract: whatever the constructor sets up, the object must be
+ * back in that state when it's passed to kmem_cache_free. Fields the
+ * constructor doesn't touch are garbage on allocation, as with
+ * kmalloc, and must be initialized by the caller.
+ *
+ * The constructor returns 0 or an error code (in which case the
+ * allocation fails and returns NULL); either it or the destructor may
+ * be NULL. Neither is called with any cache lock held, and both may
+ * kmalloc.
+ *
+ * Caches can be defined statically with KMEM_CACHE_INITIALIZER, which
+ * makes them usable before anything else is set up (thread_bootstrap
+ * needs one before there's a thread), or made with kmem_cache_create.
+ *
+ * Functions:
+ *    kmem_cache_create  - make a cache for objects of SIZE bytes.
+ *    kmem_cache_destroy - destroy all the cached objects and the cache.
+ *    kmem_cache_alloc   - get an object, constructed.
+ *    kmem_cache_free    - give back an object, in its constructed state.
+ *    kmem_cache_printstats - print hit rates for all caches.
+ */
+
+#include <spinlock.h>
+
+#define KMEM_CACHE_MAX	32	/* most free objects one cache keeps */
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+
+	struct spinlock kc_lock;	/* protects everything below */
+	unsigned kc_num;		/* free objects in kc_objs */
+	void *kc_objs[KMEM_CACHE_MAX];
+	uint32_t kc_hits;		/* allocs of a cached object */
+	uint32_t kc_misses;		/* allocs that constructed one */
+	uint32_t kc_overflows;		/* frees that destroyed one */
+
+	struct kmem_cache *kc_next;	/* list of all caches, for stats */
+	bool kc_listed;			/* on that list yet */
+};
+
+#define KMEM_CACHE_INITIALIZER(name, size, ctor, dtor) { \
+	.kc_name = (name),				 \
+	.kc_size = (size),				 \
+	.kc_ctor = (ctor),				 \
+	.kc_dtor = (dtor),				 \
+	.kc_lock = SPINLOCK_INITIALIZER,		 \
+	.kc_num = 0,					 \
+	.kc_listed = false,				 \
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+void kmem_cache_printstats(void);
+
+
+#endif /* _KMEMCACHE_H_ */
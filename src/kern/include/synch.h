@@ -70,10 +70,15 @@ void V(struct semaphore *);
  * when the lock is destroyed, no thread should be holding it.
  *
  * The name field is for easier debugging. A copy of the name is
- * (should be) made internally.
+ * (should be) made internally. Short names are kept in lk_namebuf,
+ * so creating a lock from the lock cache doesn't need to kmalloc;
+ * lk_namebuf is also what the wait channel is named with.
  */
+#define LOCK_NAMEBUF 24
+
 struct lock {
         char *lk_name;
+	char lk_namebuf[LOCK_NAMEBUF];
 	struct wchan *lk_wchan;
 	struct spinlock lk_lock;
 	struct thread *volatile lk_holder;
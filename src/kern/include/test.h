@@ -55,6 +55,7 @@ int queuetest(int, char **);
 int threadtest(int, char **);
 int threadtest2(int, char **);
 int threadtest3(int, char **);
+int threadtest4(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
@@ -71,10 +72,19 @@ int inlinetest(int, char **);
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
+int mallocthroughput(int, char **);
 int coremaptest(int, char **);
 int coremapstress(int, char **);
+int coremapthroughput(int, char **);
 int nettest(int, char **);
 
+/* Helpers shared by the throughput tests (test/testutil.c). */
+uint32_t test_runthreads(const char *name, unsigned nthreads,
+			 void (*func)(void *data, unsigned long num),
+			 void *data);
+void test_printrate(const char *tag, unsigned nthreads, uint32_t nops,
+		    const char *what, uint32_t msecs);
+
 /* Routine for running a user-level program. */
 int runprogram(char *progname, unsigned long nargs, char **args);
 
@@ -71,6 +71,12 @@ typedef enum {
 	S_ZOMBIE,	/* zombie; exited but not yet deleted */
 } threadstate_t;
 
+/* Number of scheduler priority levels; see schedule() in thread.c. */
+#define SCHED_NPRIO 4
+
+/* Size of the inline name buffer; longer names are kmalloc'd. */
+#define THREAD_NAMEBUF 32
+
 /* Thread structure. */
 struct thread {
 	/*
@@ -78,6 +84,7 @@ struct thread {
 	 * debugger is messed up.
 	 */
 	char *t_name;			/* Name of this thread */
+	char t_namebuf[THREAD_NAMEBUF];	/* Holds t_name if it's short */
 	const char *t_wchan_name;	/* Name of wait channel, if sleeping */
 	threadstate_t t_state;		/* State this thread is in */
 
@@ -90,6 +97,18 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 
+	/*
+	 * Scheduler fields. See schedule() in thread.c. Protected by
+	 * the run queue lock of t_cpu while the thread is on a run
+	 * queue; otherwise only touched by the thread itself (from
+	 * hardclock, with interrupts off) or before it first runs.
+	 */
+	unsigned t_priority;		/* 0 (highest) .. SCHED_NPRIO-1 */
+	unsigned t_recentcpu;		/* ticks used at this priority */
+	unsigned t_slice;		/* ticks used since last switched in */
+	unsigned t_boostgen;		/* last priority boost applied */
+	unsigned t_lastran;		/* t_cpu's c_hardclocks when last run */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -175,10 +194,18 @@ void thread_yield(void);
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Charge the current thread for a clock tick, and yield if its time
+ * slice is up and something else should run. Called from the timer
+ * interrupt.
+ */
+void thread_timeslice(void);
+
+/*
+ * Get scheduler statistics: the number of CPUs, and totals over all
+ * CPUs of clock ticks spent idle and threads stolen by idle CPUs.
  */
-void thread_consider_migration(void);
+void thread_schedstats(unsigned *numcpus, unsigned *idleclocks,
+		       unsigned *steals);
 
 
 #endif /* _THREAD_H_ */
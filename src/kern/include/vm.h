@@ -55,12 +55,25 @@ void vm_bootstrap(void);
 /* Initialization for swapfile */
 void swap_bootstrap(void);
 
+/* Start the pageout thread; needs thread_fork to work. */
+void pageout_bootstrap(void);
+
 /* Shutdown function for swapfile; closes swap vnode. */
 void swap_shutdown(void);
 
+/* Print a map of swap usage */
+void swap_printmap(void);
+
+/* Print a map of physical memory */
+void vm_printmap(void);
+
 /* Print VM counters */
 void vm_printstats(void);
 
+/* Get/set the fault-around window, in pages */
+unsigned vm_get_faultaround(void);
+int vm_set_faultaround(unsigned npages);
+
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
@@ -44,6 +44,7 @@
 #include <array.h>
 #include <spinlock.h>
 struct addrspace;
+struct vnode;
 
 #include "opt-dumbvm.h"
 #if !OPT_DUMBVM
@@ -67,7 +68,8 @@ struct addrspace;
  * structure. The lpage keeps track of where the page is in physical
  * memory (lp_paddr) and where it is kept on disk in the swapfile
  * (lp_swapaddr). If the page is not in RAM, lp_paddr is INVALID_PADDR.
- * If no swap has been allocated, lp_swapaddr is INVALID_SWAPADDR.
+ * If no swap has been allocated, lp_swapaddr is INVALID_SWAPADDR;
+ * swap is only allocated when a dirty page is first written out.
  *
  * It is assumed that the physical page size is at least 1k or so
  * (most MMUs use at least 4k), so the low bits of lp_paddr are used
@@ -79,14 +81,59 @@ struct addrspace;
  * A vm_object contains an array of lpages, each of which corresponds
  * to a virtual page in the address space of a process.
  *
- * It is assumed in the solution set VM that lpages are never shared
- * between processes.
+ * With OPT_COW, fork shares lpages between the parent and child
+ * instead of copying them. lp_refcount counts the vm_objects holding
+ * the lpage; a shared lpage is only ever mapped read-only, and the
+ * first write fault gives the writer a private copy. lp_refcount is
+ * protected by lp_spinlock.
+ *
+ * A page of an executable is file-backed: lp_vnode is the file, and
+ * the page's initial contents are lp_filelen bytes of it from offset
+ * lp_fileoff, placed lp_fileskip bytes into the page, with zeros
+ * around them. Such a page is read from the file on first touch, and
+ * as long as it stays clean and has no swap page it can simply be
+ * dropped on eviction and read again later. Once it has been written
+ * out to swap, the swap copy is used instead. These fields never
+ * change after creation. The vm_objects holding the lpage hold the
+ * reference to the vnode.
+ *
+ * A page of a MAP_SHARED mapping has lp_mapshared set (which also
+ * never changes). Its holders share it for writing: it is never
+ * copied on write, and fork shares it whether or not OPT_COW is on.
+ * If it is a page of a file (lp_vnode set) it lives in the file's
+ * filecache and dirty data goes back to the file: the pageout thread
+ * and msync write it there, while eviction, which can't wait for the
+ * file system, sends it to swap as usual. A page paged in from swap
+ * is therefore newer than the file and comes in dirty, and a page
+ * written back to the file gives up its swap page. Every holder,
+ * including the filecache, holds a swap reservation for it as with
+ * copy-on-write sharing. The filecache pages that read-only regions
+ * use (see vm_object) are lp_mapshared too, but as nobody can write
+ * them through such a region they're only ever clean.
+ *
+ * lp_seq is bumped every time lp_paddr (address or flags) changes, so
+ * that the TLB refill fast path (lpage_fastfault) can read lp_paddr
+ * without the lock and find out afterwards whether it was stale. Like
+ * lp_paddr itself it's only written with the lpage locked; use
+ * LP_SETPADDR, LP_SET and LP_CLEAR to change lp_paddr.
+ *
+ * lp_swaphint is where the page's vm_object would like it put when it
+ * first goes to swap (see swap_objhint), or INVALID_SWAPADDR for no
+ * preference. It's only advice. Set it with lpage_setswaphint.
  */
 
 struct lpage {
 	volatile paddr_t lp_paddr;
+	volatile unsigned lp_seq;	/* changes when lp_paddr does */
 	off_t lp_swapaddr;
+	unsigned lp_refcount;
 	struct spinlock lp_spinlock;
+	struct vnode *lp_vnode;		/* backing file, or NULL */
+	off_t lp_fileoff;		/* offset of the data in the file */
+	uint16_t lp_fileskip;		/* offset of the data in the page */
+	uint16_t lp_filelen;		/* length of the data */
+	bool lp_mapshared;		/* page of a MAP_SHARED mapping */
+	off_t lp_swaphint;		/* where in swap it would like to go */
 };
 
 /* lpage flags */
@@ -95,54 +142,205 @@ struct lpage {
 
 #define LP_ISDIRTY(lp)		((lp)->lp_paddr & LPF_DIRTY)
 
-#define LP_SET(am, bit)		((lp)->lp_paddr |= (bit))
-#define LP_CLEAR(am, bit)	((lp)->lp_paddr &= ~(paddr_t)(bit))
+#define LP_SETPADDR(lp, pa)	((lp)->lp_paddr = (pa), (lp)->lp_seq++)
+#define LP_SET(lp, bit)		((lp)->lp_paddr |= (bit), (lp)->lp_seq++)
+#define LP_CLEAR(lp, bit)	((lp)->lp_paddr &= ~(paddr_t)(bit), \
+				 (lp)->lp_seq++)
 
 /*
  * Functions in lpage.c
  *
  *    lpage_create - create a blank, non-materialized lpage structure.
+ *    lpage_create_file - create a non-materialized lpage backed by a file
  *    lpage_destroy - destroy an lpage
  *    lpage_lock/unlock - for exclusive access to an lpage
  *    lpage_lock_and_pin - also pin physical page (see lpage.c for details)
  *
  *    lpage_copy - clone an lpage, including the contents
+ *    lpage_share - add a reference to an lpage (copy-on-write fork)
+ *    lpage_unshare - trade a reference to a shared lpage for a copy
+ *    lpage_isshared - check if an lpage is shared copy-on-write
  *    lpage_zerofill - materialize an lpage and zero-fill it
+ *    lpage_fastfault - reload the TLB for a resident lpage, if it's easy
+ *    lpage_prefault - map a resident lpage ahead of a fault, if it's easy
  *    lpage_fault - handle a fault on an lpage
  *    lpage_evict - evict an lpage
+ *    lpage_clean - write an lpage to swap without evicting it
+ *    lpage_clean_cluster - clean several lpages with one transfer
+ *    lpage_readahead - page in an lpage and its swap neighbours
+ *    lpage_sync - write a MAP_SHARED file page back to its file
+ *    lpage_setswaphint - say where in swap an lpage should go
  */
 struct lpage     *lpage_create(void);
+struct lpage     *lpage_create_file(struct vnode *vn, off_t offset,
+                                    unsigned skip, unsigned len);
 void              lpage_destroy(struct lpage *lp);
 void              lpage_lock(struct lpage *lp);
 void              lpage_unlock(struct lpage *lp);
 void              lpage_lock_and_pin(struct lpage *lp);
 
 int	              lpage_copy(struct lpage *from, struct lpage **toret);
+void              lpage_share(struct lpage *lp);
+int               lpage_unshare(struct lpage *lp, struct lpage **toret);
+int               lpage_isshared(struct lpage *lp);
 int               lpage_zerofill(struct lpage **lpret);
+bool              lpage_fastfault(struct lpage *lp, struct addrspace *,
+                                  int faulttype, vaddr_t va, bool canwrite);
+void              lpage_prefault(struct lpage *lp, struct addrspace *,
+                                 vaddr_t va, bool canwrite);
 int               lpage_fault(struct lpage *lp, struct addrspace *,
-			                  int faulttype, vaddr_t va);
+			                  int faulttype, vaddr_t va, bool canwrite,
+			                  bool counted);
 void              lpage_evict(struct lpage *victim);
+void              lpage_clean(struct lpage *lp);
+void              lpage_clean_cluster(struct lpage **lps, const paddr_t *pas,
+                                      unsigned n);
+bool              lpage_readahead(struct lpage *lp, struct lpage **next,
+                                  unsigned nnext);
+int               lpage_sync(struct lpage *lp);
+void              lpage_setswaphint(struct lpage *lp, off_t hint);
+
+/*
+ * True if LP is a page of a shared file mapping, which the pageout
+ * thread has to write back to the file rather than to swap.
+ */
+#define LP_ISFILESHARED(lp)	((lp)->lp_mapshared && (lp)->lp_vnode != NULL)
 
 ////////////////////////////////////////////////////////////
 //
 // vm_object - block of virtual memory
 //
 
-DECLARRAY_BYTYPE(lpage_array, struct lpage);
+/*
+ * lpage_table - the lpages of a vm_object (or a filecache), by page
+ * number.
+ *
+ * This is a two-level table: the pages are kept in leaves of
+ * LPT_LEAFPAGES pointers, and a leaf is only allocated once something
+ * is stored in it. Most regions are mostly empty (the stack is 2 MB,
+ * and a process uses a few pages of it) so this keeps a large region
+ * from costing a pointer per page whether it's used or not. A missing
+ * leaf reads as all NULL (zerofill).
+ *
+ * lpage_table operations in lptable.c:
+ *
+ * lpage_table_create:  make an empty table.
+ * lpage_table_destroy: free a table. Doesn't touch the lpages.
+ * lpage_table_num:     get the number of pages.
+ * lpage_table_get:     get page INDEX, or NULL.
+ * lpage_table_set:     store page INDEX. Storing anything but NULL
+ *                      needs the leaf to be there: either the slot
+ *                      held a page already, or lpage_table_prepare
+ *                      was called for it first.
+ * lpage_table_prepare: allocate the leaf for page INDEX if needed,
+ *                      so the next lpage_table_set can't fail. Call
+ *                      it before creating a page for an empty slot,
+ *                      so the page doesn't have to be undone.
+ * lpage_table_setsize: change the number of pages. New pages are
+ *                      NULL; dropped ones are forgotten, not freed.
+ */
+#define LPT_LEAFPAGES	64
+
+struct lpage_leaf {
+	struct lpage *lpl_pages[LPT_LEAFPAGES];
+};
+
+struct lpage_table {
+	struct lpage_leaf **lpt_leaves;	/* NULL if nothing stored there */
+	unsigned lpt_num;		/* number of pages */
+	unsigned lpt_maxleaves;		/* allocated size of lpt_leaves */
+};
+
+#ifndef LPTINLINE
+#define LPTINLINE INLINE
+#endif
+
+struct lpage_table *lpage_table_create(void);
+void		lpage_table_destroy(struct lpage_table *t);
+LPTINLINE unsigned lpage_table_num(const struct lpage_table *t);
+LPTINLINE struct lpage *lpage_table_get(const struct lpage_table *t,
+					unsigned index);
+void		lpage_table_set(struct lpage_table *t, unsigned index,
+				struct lpage *lp);
+int		lpage_table_prepare(struct lpage_table *t, unsigned index);
+int		lpage_table_setsize(struct lpage_table *t, unsigned num);
+
+LPTINLINE unsigned
+lpage_table_num(const struct lpage_table *t)
+{
+	return t->lpt_num;
+}
+
+LPTINLINE struct lpage *
+lpage_table_get(const struct lpage_table *t, unsigned index)
+{
+	struct lpage_leaf *leaf;
+
+	KASSERT(index < t->lpt_num);
+	leaf = t->lpt_leaves[index / LPT_LEAFPAGES];
+	if (leaf == NULL) {
+		return NULL;
+	}
+	return leaf->lpl_pages[index % LPT_LEAFPAGES];
+}
 
 /*
  * vm_object - data structure associated with a mapped (that is, valid)
  * block of process virtual memory.
  *
- * Each vm object contains an array of lpages and a base address. It
+ * Each vm object contains a table of lpages and a base address. It
  * also allows a redzone on the lower end in which other vm_objects are
  * not allowed to fall. This is used to implement a guard band under the
  * stack.
+ *
+ * A vm_object for an executable segment is also backed by the file:
+ * vmo_filesize bytes at offset vmo_fileoff of vmo_vnode belong at
+ * address vmo_filestart. Pages that overlap that range are created
+ * file-backed on first touch instead of zero-filled. The vm_object
+ * holds a reference to (and keeps open) the vnode.
+ *
+ * vmo_prot holds the PROT_* access the region allows. Writes to a
+ * region without PROT_WRITE fault with EFAULT, and its pages are only
+ * ever mapped read-only. The MIPS MMU can't tell reads from execution,
+ * so PROT_READ and PROT_EXEC only matter as far as a region with
+ * neither (PROT_NONE) can't be touched at all.
+ *
+ * The file data of a read-only region isn't copied per process: if it
+ * lines up with page boundaries in the file, whole pages of it come
+ * from the file's filecache, the same as for a MAP_SHARED mapping, so
+ * everyone running the same program shares its text. Partial pages at
+ * the edges are still made private.
+ *
+ * A vm_object made by mmap has the MAP_* flags in vmo_mapflags (0
+ * for everything else). MAP_PRIVATE file mappings are file-backed
+ * like executables. A MAP_SHARED file mapping gets its pages from
+ * the file's filecache instead, starting at vmo_fileoff; MAP_SHARED
+ * anonymous memory has no file and shares its own pages at fork.
+ *
+ * Reading an untouched private page that has no file data maps the
+ * zero page (see mmu_map_zero) and leaves the slot NULL; the page is
+ * only made on the first write. vmo_zeromapped says this has happened
+ * at least once, so the slot's address may still have a zero page
+ * mapping to get rid of when the slot is filled or goes away.
+ *
+ * vmo_swapbase is where in swap the object's page 0 would go, chosen
+ * by swap_objhint the first time one of its pages is made, so that
+ * its pages end up in swap in the same order they're in the object
+ * (see vm_object_swaphint). INVALID_SWAPADDR until then.
  */
 struct vm_object {
-	struct lpage_array *vmo_lpages;
+	struct lpage_table *vmo_lpages;
 	vaddr_t vmo_base;
 	size_t vmo_lower_redzone;
+	struct vnode *vmo_vnode;	/* backing file, or NULL */
+	off_t vmo_fileoff;		/* where the data is in the file */
+	vaddr_t vmo_filestart;		/* where it goes in memory */
+	size_t vmo_filesize;		/* how much there is */
+	int vmo_prot;			/* PROT_* access allowed */
+	int vmo_mapflags;		/* MAP_* flags, if made by mmap */
+	struct filecache *vmo_filecache; /* shared file pages, or NULL */
+	bool vmo_zeromapped;		/* zero page mapped for some slot */
+	off_t vmo_swapbase;		/* swap placement hint for page 0 */
 };
 
 /*
@@ -150,21 +348,89 @@ struct vm_object {
  * 
  * vm_object_create:  allocates a blank vm_object with the requested
  *                    number of struct lpage's set for zero-fill.
- * vm_object_copy:    clone a vm_object, as at fork time.
+ * vm_object_copy:    clone a vm_object, as at fork time. With OPT_COW
+ *                    the lpages are shared rather than copied, and
+ *                    the old address space's mappings of them are
+ *                    dropped so they refault read-only.
  * vm_object_setsize: adjust the size of a vm_object (either up or down).
+ * vm_object_readahead: on a fault, page in a swapped-out page together
+ *                    with its neighbours in swap, in one transfer.
+ * vm_object_faultaround: after a read fault, map the resident pages
+ *                    around the faulting one too.
+ * vm_object_setfile: make part of a vm_object backed by a file.
+ * vm_object_filepage: on first touch of a page, create its lpage from
+ *                    the backing file if it has file data, or get it
+ *                    from the file's filecache if the vm_object uses
+ *                    one.
+ * vm_object_swaphint: tell a page just made for a vm_object where it
+ *                    should go in swap.
+ * vm_object_mapfile: make a vm_object a MAP_SHARED mapping of a file.
+ * vm_object_sync:    write back the dirty pages of a shared mapping.
  * vm_object_destroy: frees all the mapping entries and swap space.
  *
  */
 struct vm_object 	*vm_object_create(size_t npages);
 int			        vm_object_copy(struct vm_object *vmo,
+					               struct addrspace *as,
 					               struct addrspace *newas,
 					               struct vm_object **newvmo_ret);
 int                 vm_object_setsize(struct addrspace *as,
 					                  struct vm_object *vmo,
 					                  unsigned newnpages);
+bool                vm_object_readahead(struct vm_object *vmo,
+                                        unsigned index);
+void                vm_object_faultaround(struct vm_object *vmo,
+                                          struct addrspace *as,
+                                          unsigned index);
+int                 vm_object_setfile(struct vm_object *vmo,
+                                      struct vnode *vn, off_t offset,
+                                      vaddr_t vaddr, size_t filesize);
+int                 vm_object_filepage(struct vm_object *vmo,
+                                       unsigned index,
+                                       struct lpage **ret);
+void                vm_object_swaphint(struct vm_object *vmo,
+                                       unsigned index, struct lpage *lp);
+int                 vm_object_mapfile(struct vm_object *vmo,
+                                      struct vnode *vn, off_t offset);
+int                 vm_object_sync(struct vm_object *vmo,
+                                   unsigned index, unsigned npages);
 void 			 vm_object_destroy(struct addrspace *as, 
 					               struct vm_object *vmo);
 
+////////////////////////////////////////////////////////////
+//
+// filecache - pages of files shared between mappings
+//
+
+/*
+ * Every vnode that is mapped MAP_SHARED by anyone, or that has
+ * read-only regions (like program text) backed by it, has a filecache
+ * (vn_filecache), which holds one lpage per page of the file that has
+ * been touched through a mapping, indexed by page number in the file.
+ * The vm_objects of the mappings share those lpages, so all mappers
+ * see the same memory. When the last mapping goes away the dirty
+ * pages are written back and the filecache is thrown away.
+ *
+ * filecache operations in filecache.c:
+ *
+ * filecache_bootstrap: set up; called from swap_bootstrap.
+ * filecache_attach:  get the filecache of a vnode, creating it if
+ *                    needed, and add a user (a vm_object) to it.
+ * filecache_detach:  drop a user, writing back and destroying the
+ *                    filecache if it was the last.
+ * filecache_getpage: get (creating if needed) the lpage for a page of
+ *                    the file, with a reference for the caller.
+ * filecache_printstats: print hit/miss counters.
+ */
+struct filecache;
+
+void		filecache_bootstrap(void);
+int		filecache_attach(struct vnode *vn, struct filecache **ret);
+void		filecache_detach(struct filecache *fc);
+int		filecache_getpage(struct filecache *fc, unsigned pageno,
+				  struct lpage **ret);
+void		filecache_printstats(void);
+
 ////////////////////////////////////////////////////////////
 //
 // swap
@@ -178,11 +444,21 @@ void 			 vm_object_destroy(struct addrspace *as,
  *
  * swap_shutdown:    closes the swapfile vnode. Declared in vm.h.
  * 
- * swap_alloc:       finds a free swap page and marks it as used.
- *                   A page should have been previously reserved.
+ * swap_objhint:     picks where in swap a vm_object's pages should go.
+ *
+ * swap_alloc:       finds a free swap page, at or after a hint, and
+ *                   marks it as used. A page should have been
+ *                   previously reserved.
+ *
+ * swap_alloc_run:   finds a run of free, consecutive swap pages at or
+ *                   after a hint and marks them used, or returns
+ *                   INVALID_SWAPADDR. The pages should have been
+ *                   previously reserved.
  *
  * swap_free:        unmarks a swap page.
  *
+ * swap_release:     unmarks a swap page but keeps it reserved.
+ *
  * swap_reserve:     reserve some swap pages for future allocation.
  *
  * swap_unreserve:   release some previously-reserved swap pages.
@@ -192,29 +468,46 @@ void 			 vm_object_destroy(struct addrspace *as,
  *
  * swap_pageout:     Writes a page to the requested swap address 
  *                   from the requested physical page.
+ *
+ * swap_pagein_cluster,
+ * swap_pageout_cluster: Same, for up to SWAP_CLUSTER pages at
+ *                   consecutive swap addresses, in one disk transfer.
+ *
+ * swap_printstats:  Prints transfer counts and cluster sizes.
+ *
+ * swap_printmap:    Prints swap occupancy and fragmentation. Declared
+ *                   in vm.h.
  */
 
-off_t	 	swap_alloc(void);
+off_t		swap_objhint(unsigned npages);
+off_t	 	swap_alloc(off_t hint);
+off_t		swap_alloc_run(unsigned npages, off_t hint);
 void 		swap_free(off_t diskpage);
+void		swap_release(off_t diskpage);
 
 int		swap_reserve(unsigned long npages);
 void		swap_unreserve(unsigned long npages);
 
 void 		swap_pagein(paddr_t paddr, off_t swapaddr);
 void 		swap_pageout(paddr_t paddr, off_t swapaddr);
+void		swap_pagein_cluster(const paddr_t *paddrs, unsigned npages,
+				    off_t swapaddr);
+void		swap_pageout_cluster(const paddr_t *paddrs, unsigned npages,
+				     off_t swapaddr);
+
+void		swap_printstats(void);
 
 /*
- * Special disk address:
- *   INVALID_SWAPADDR is an invalid swap address.
+ * Largest number of pages moved to or from swap in one transfer, by
+ * pageout clustering or pagein read-ahead.
  */
-#define INVALID_SWAPADDR	(0)
+#define SWAP_CLUSTER		8
 
 /*
- * Global lock for paging. Only one page can be in transit at a time
- * (at least under current circumstances) so we get this at a fairly
- * high level to try to improve paging decisions.
+ * Special disk address:
+ *   INVALID_SWAPADDR is an invalid swap address.
  */
-extern struct lock *global_paging_lock;
+#define INVALID_SWAPADDR	(0)
 
 ////////////////////////////////////////////////////////////
 //
@@ -33,6 +33,7 @@
 
 struct uio;
 struct stat;
+struct filecache;
 
 #include <spinlock.h>
 
@@ -52,6 +53,9 @@ struct stat;
  * vn_opencount is managed using VOP_INCOPEN and VOP_DECOPEN by
  * vfs_open() and vfs_close(). Code above the VFS layer should not
  * need to worry about it.
+ *
+ * vn_filecache belongs to the VM system: it holds the pages of the
+ * file while it's mapped MAP_SHARED by anyone. See vm/filecache.c.
  */
 struct vnode {
 	int vn_refcount;                /* Reference count */
@@ -60,6 +64,7 @@ struct vnode {
 	off_t offset;					// Current offset of the file
 
 	struct lock *v_lock;				// vnode lock.
+	struct filecache *vn_filecache; /* Pages shared by mmap, or NULL */
 	struct fs *vn_fs;               /* Filesystem vnode belongs to */
 	void *vn_data;                  /* Filesystem-specific data */
 	const struct vnode_ops *vn_ops; /* Functions on this vnode */
@@ -138,9 +143,11 @@ struct vnode {
  *    vop_fsync       - Force any dirty buffers associated with this file
  *                      to stable storage.
  *
- *    vop_mmap        - Map file into memory. If you implement this
- *                      feature, you're responsible for choosing the
- *                      arguments for this operation.
+ *    vop_mmap        - Check whether the file can be mapped into
+ *                      memory with the protection PROT (PROT_* from
+ *                      kern/mman.h). The VM system does the mapping
+ *                      itself, and moves the pages with vop_read and
+ *                      vop_write.
  *
  *    vop_truncate    - Forcibly set size of file to the length passed
  *                      in, discarding any excess blocks.
@@ -212,7 +219,7 @@ struct vnode_ops {
 	int (*vop_gettype)(struct vnode *object, mode_t *result);
 	int (*vop_tryseek)(struct vnode *object, off_t pos);
 	int (*vop_fsync)(struct vnode *object);
-	int (*vop_mmap)(struct vnode *file /* add stuff */);
+	int (*vop_mmap)(struct vnode *file, int prot);
 	int (*vop_truncate)(struct vnode *file, off_t len);
 	int (*vop_namefile)(struct vnode *file, struct uio *uio);
 
@@ -257,7 +264,7 @@ struct vnode_ops {
 #define VOP_GETTYPE(vn, result)         (__VOP(vn, gettype)(vn, result))
 #define VOP_TRYSEEK(vn, pos)            (__VOP(vn, tryseek)(vn, pos))
 #define VOP_FSYNC(vn)                   (__VOP(vn, fsync)(vn))
-#define VOP_MMAP(vn /*add stuff */)     (__VOP(vn, mmap)(vn /*add stuff */))
+#define VOP_MMAP(vn, prot)              (__VOP(vn, mmap)(vn, prot))
 #define VOP_TRUNCATE(vn, pos)           (__VOP(vn, truncate)(vn, pos))
 #define VOP_NAMEFILE(vn, uio)           (__VOP(vn, namefile)(vn, uio))
 
@@ -135,6 +135,10 @@ boot(void)
 	 * come before additional cpus are brought online.
 	 */
 	pid_bootstrap(); 
+
+#if !OPT_DUMBVM
+	pageout_bootstrap(); /* start the pageout thread */
+#endif
 	//dumb_consoleIO_bootstrap(); /* And initialize for user console IO */
 
 	thread_start_cpus();
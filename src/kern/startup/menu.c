@@ -38,6 +38,7 @@
 #include <clock.h>
 #include <thread.h>
 #include <vfs.h>
+#include <vm.h>
 #include <syscall.h>
 #include <test.h>
 
@@ -529,6 +530,75 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+#if !OPT_DUMBVM
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for viewing or setting the fault-around window.
+ */
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 2) {
+		result = vm_set_faultaround(atoi(args[1]));
+		if (result) {
+			kprintf("Usage: fa [npages] (a power of 2, "
+				"1 for none)\n");
+			return 0;
+		}
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: fa [npages]\n");
+		return 0;
+	}
+	kprintf("Fault-around window: %u pages\n", vm_get_faultaround());
+	return 0;
+}
+
+/*
+ * Command for showing how swap is used.
+ */
+static
+int
+cmd_swapmap(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	swap_printmap();
+
+	return 0;
+}
+
+/*
+ * Command for showing how physical memory is used.
+ */
+static
+int
+cmd_coremap(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printmap();
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -590,9 +660,11 @@ static const char *testmenu[] = {
 	"[bt]  Bitmap test                   ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[km3] kmalloc throughput test       ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
+	"[tt4] Thread test 4 (load balance)  ",
 #if OPT_NET
 	"[net] Network test                  ",
 #endif
@@ -601,6 +673,7 @@ static const char *testmenu[] = {
 	"[sy3] CV test               (1)     ",
 	"[cm] Coremap test           (3)     ",
 	"[cm2] Coremap stress test   (3)     ",
+	"[cm3] Coremap throughput    (3)     ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress        (4)     ",
 	"[fs3] FS write stress       (4)     ",
@@ -630,6 +703,12 @@ static const char *mainmenu[] = {
 	"[?o] Operations menu                ",
 	"[?t] Tests menu                     ",
 	"[kh] Kernel heap stats              ",
+#if !OPT_DUMBVM
+	"[vm] VM stats                       ",
+	"[fa] Fault-around window            ",
+	"[sw] Swap usage map                 ",
+	"[pm] Physical memory map            ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -678,18 +757,26 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+#if !OPT_DUMBVM
+	{ "vm",         cmd_vmstats },
+	{ "fa",         cmd_faultaround },
+	{ "sw",         cmd_swapmap },
+	{ "pm",         cmd_coremap },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "km3",	mallocthroughput },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
 	{ "tt3",	threadtest3 },
+	{ "tt4",	threadtest4 },
 	{ "sy1",	semtest },
 
 	/* synchronization assignment tests */
@@ -706,6 +793,7 @@ static struct {
 	/* ASST2 tests */
 	{ "cm",		coremaptest },
 	{ "cm2",	coremapstress },
+	{ "cm3",	coremapthroughput },
 #endif
 /* END A3 SETUP */
 
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * VM-related system calls.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/limits.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <vnode.h>
+#include <file.h>
+#include <addrspace.h>
+#include <syscall.h>
+
+/*
+ * sys_sbrk
+ *
+ * Move the end of the heap (the "break") by AMOUNT bytes, which may be
+ * negative, and return the old break. The heap is a region of the
+ * address space that starts right after the program's data; see
+ * as_sbrk.
+ */
+int
+sys_sbrk(int amount, int *retval)
+{
+	struct addrspace *as;
+	vaddr_t oldbreak;
+	int result;
+
+	as = curthread->t_addrspace;
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	result = as_sbrk(as, amount, &oldbreak);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int)oldbreak;
+	return 0;
+}
+
+/*
+ * sys_mmap
+ *
+ * Map LEN bytes of the file open on FD, from OFFSET, or with
+ * MAP_ANONYMOUS zero-filled memory, somewhere in the address space,
+ * and return where. ADDR is only a hint, and we don't take it. The
+ * file system has to agree to the mapping (VOP_MMAP); only SFS files
+ * can be mapped.
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, int *retval)
+{
+	struct addrspace *as;
+	struct vnode *vn;
+	vaddr_t va;
+	int result;
+
+	(void)addr;
+
+	as = curthread->t_addrspace;
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	if ((prot & ~(PROT_READ|PROT_WRITE|PROT_EXEC)) != 0) {
+		return EINVAL;
+	}
+	if ((flags & ~(MAP_SHARED|MAP_PRIVATE|MAP_ANONYMOUS)) != 0) {
+		return EINVAL;
+	}
+	switch (flags & (MAP_SHARED|MAP_PRIVATE)) {
+	    case MAP_SHARED:
+	    case MAP_PRIVATE:
+		break;
+	    default:
+		/* need exactly one of them */
+		return EINVAL;
+	}
+
+	if (flags & MAP_ANONYMOUS) {
+		result = as_mmap(as, len, prot, flags, NULL, 0, &va);
+		if (result) {
+			return result;
+		}
+		*retval = (int)va;
+		return 0;
+	}
+
+	if (fd < 0 || fd >= __OPEN_MAX) {
+		return EBADF;
+	}
+	lock_acquire(curthread->t_filetable->t_lock);
+	vn = curthread->t_filetable->t_entries[fd];
+	if (vn == NULL) {
+		lock_release(curthread->t_filetable->t_lock);
+		return EBADF;
+	}
+	VOP_INCREF(vn);
+	lock_release(curthread->t_filetable->t_lock);
+
+	result = VOP_MMAP(vn, prot);
+	if (result == 0) {
+		result = as_mmap(as, len, prot, flags, vn, offset, &va);
+	}
+	VOP_DECREF(vn);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int)va;
+	return 0;
+}
+
+/*
+ * sys_munmap
+ *
+ * Remove a mapping made by mmap, or the end of one; see as_munmap.
+ */
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+	struct addrspace *as;
+
+	as = curthread->t_addrspace;
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	return as_munmap(as, (vaddr_t)addr, len);
+}
+
+/*
+ * sys_msync
+ *
+ * Write the changes to shared file mappings in the range back to the
+ * files. The writes are always synchronous, and nothing is cached
+ * apart from the mappings themselves, so MS_ASYNC and MS_INVALIDATE
+ * don't need anything extra.
+ */
+int
+sys_msync(userptr_t addr, size_t len, int flags)
+{
+	struct addrspace *as;
+
+	as = curthread->t_addrspace;
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	if ((flags & ~(MS_ASYNC|MS_SYNC|MS_INVALIDATE)) != 0) {
+		return EINVAL;
+	}
+	if ((flags & MS_ASYNC) && (flags & MS_SYNC)) {
+		return EINVAL;
+	}
+
+	return as_msync(as, (vaddr_t)addr, len);
+}
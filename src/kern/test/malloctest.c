@@ -32,9 +32,14 @@
  */
 #include <types.h>
 #include <lib.h>
+#include <cpu.h>
 #include <thread.h>
+#include <current.h>
 #include <synch.h>
+#include <mainbus.h>
+#include <vm.h>
 #include <test.h>
+#include "opt-dumbvm.h"
 
 /*
  * Test kmalloc; allocate ITEMSIZE bytes NTRIES times, freeing
@@ -138,3 +143,244 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * mallocthroughput (km3): measure kmalloc/kfree throughput, and check
+ * the per-CPU magazines don't lose or leak memory.
+ *
+ * First, each thread allocates KM3_BATCH blocks of assorted small
+ * sizes and frees them again, KM3_ROUNDS times: the kind of traffic
+ * locks, cvs, lpages and threads generate. We run with 1, 2, 4, and 8
+ * threads at once and report kmalloc/kfree pairs per second for each.
+ * That scales the number of threads, not CPUs: the threads only run
+ * on as many CPUs as the machine has, so to see how throughput scales
+ * with CPUs, run km3 under sys161 configs with different cpus= counts
+ * (as scale.sh does for parallelvm).
+ *
+ * Then KM3_XPAIRS producer/consumer pairs hand blocks over: the
+ * producer kmallocs a block, fills it with a pattern, and passes it
+ * to its consumer, which checks the pattern and kfrees it. When the
+ * two are on different CPUs, the block goes back to a magazine other
+ * than the one it came out of. Between them the pairs allocate more
+ * than all of physical memory, so if blocks freed that way were lost
+ * we'd run out. We also report how many frees crossed CPUs, and warn
+ * if none did on a machine with more than one.
+ *
+ * Last (not with dumbvm, which never gives pages back) we kmalloc,
+ * fill, check, and kfree a KM3_BIGPAGES-page block enough times to
+ * add up to twice physical memory, which only works if the pages
+ * really are freed and reused.
+ */
+
+#define KM3_ROUNDS  1000
+#define KM3_BATCH      8
+
+#define KM3_XPAIRS     2
+#define KM3_XSLOTS    16
+#define KM3_XSIZE    200
+
+#define KM3_BIGPAGES   3
+
+static const size_t km3sizes[KM3_BATCH] = {
+	16, 24, 40, 64, 100, 128, 200, 500,
+};
+
+struct km3block {
+	unsigned kb_cpu;		/* CPU it was allocated on */
+	unsigned kb_seq;		/* sequence number */
+	unsigned char kb_data[KM3_XSIZE - 2*sizeof(unsigned)];
+};
+
+struct km3pair {
+	struct km3block *kp_slots[KM3_XSLOTS];
+	struct semaphore *kp_empty;	/* counts free slots */
+	struct semaphore *kp_full;	/* counts filled slots */
+	unsigned kp_crossed;		/* frees on another CPU */
+};
+
+static struct km3pair km3pairs[KM3_XPAIRS];
+static unsigned km3_xblocks;		/* blocks per pair */
+
+static
+void
+km3thread(void *junk, unsigned long num)
+{
+	void *ptrs[KM3_BATCH];
+	int i, j;
+
+	(void)junk;
+
+	for (i=0; i<KM3_ROUNDS; i++) {
+		for (j=0; j<KM3_BATCH; j++) {
+			ptrs[j] = kmalloc(km3sizes[j]);
+			if (ptrs[j] == NULL) {
+				panic("km3: thread %lu: out of memory\n",
+				      num);
+			}
+		}
+		for (j=0; j<KM3_BATCH; j++) {
+			kfree(ptrs[j]);
+		}
+	}
+}
+
+/*
+ * Even-numbered threads produce for pair num/2, odd ones consume.
+ * The CPU numbers are read after kmalloc and before kfree, so a
+ * thread that migrates in between can miscount one; that's fine for
+ * a count.
+ */
+static
+void
+km3xthread(void *junk, unsigned long num)
+{
+	struct km3pair *kp = &km3pairs[num / 2];
+	struct km3block *kb;
+	unsigned i, j;
+
+	(void)junk;
+
+	for (i=0; i<km3_xblocks; i++) {
+		if (num % 2 == 0) {
+			kb = kmalloc(sizeof(*kb));
+			if (kb == NULL) {
+				panic("km3: thread %lu: out of memory "
+				      "after %u blocks (leak?)\n", num, i);
+			}
+			kb->kb_cpu = curcpu->c_number;
+			kb->kb_seq = i;
+			for (j=0; j<sizeof(kb->kb_data); j++) {
+				kb->kb_data[j] = i & 0xff;
+			}
+			P(kp->kp_empty);
+			kp->kp_slots[i % KM3_XSLOTS] = kb;
+			V(kp->kp_full);
+		}
+		else {
+			P(kp->kp_full);
+			kb = kp->kp_slots[i % KM3_XSLOTS];
+			V(kp->kp_empty);
+			if (kb->kb_seq != i) {
+				panic("km3: thread %lu: got block %u, "
+				      "expected %u\n", num, kb->kb_seq, i);
+			}
+			for (j=0; j<sizeof(kb->kb_data); j++) {
+				if (kb->kb_data[j] != (i & 0xff)) {
+					panic("km3: thread %lu: block %u "
+					      "corrupt at byte %u\n",
+					      num, i, j);
+				}
+			}
+			if (kb->kb_cpu != curcpu->c_number) {
+				kp->kp_crossed++;
+			}
+			kfree(kb);
+		}
+	}
+}
+
+static
+void
+km3_crosscpu(void)
+{
+	unsigned i, numcpus, idleclocks, steals, crossed;
+	uint32_t msecs;
+
+	km3_xblocks = mainbus_ramsize() / sizeof(struct km3block)
+		/ KM3_XPAIRS + 1;
+
+	for (i=0; i<KM3_XPAIRS; i++) {
+		km3pairs[i].kp_empty = sem_create("km3 empty", KM3_XSLOTS);
+		km3pairs[i].kp_full = sem_create("km3 full", 0);
+		if (km3pairs[i].kp_empty == NULL ||
+		    km3pairs[i].kp_full == NULL) {
+			panic("mallocthroughput: sem_create failed\n");
+		}
+		km3pairs[i].kp_crossed = 0;
+	}
+
+	msecs = test_runthreads("mallocthroughput", KM3_XPAIRS * 2,
+				km3xthread, NULL);
+	test_printrate("km3", KM3_XPAIRS * 2, KM3_XPAIRS * km3_xblocks,
+		       "handoffs", msecs);
+
+	crossed = 0;
+	for (i=0; i<KM3_XPAIRS; i++) {
+		crossed += km3pairs[i].kp_crossed;
+		sem_destroy(km3pairs[i].kp_empty);
+		sem_destroy(km3pairs[i].kp_full);
+	}
+
+	thread_schedstats(&numcpus, &idleclocks, &steals);
+	kprintf("km3: %u of %u blocks freed on another CPU\n",
+		crossed, KM3_XPAIRS * km3_xblocks);
+	if (numcpus > 1 && crossed == 0) {
+		kprintf("km3: warning: %u CPUs but no frees crossed "
+			"CPUs\n", numcpus);
+	}
+}
+
+#if !OPT_DUMBVM
+static
+void
+km3_bigblocks(void)
+{
+	const size_t len = KM3_BIGPAGES * PAGE_SIZE;
+	unsigned i, nblocks;
+	uint32_t *p;
+	size_t j;
+
+	nblocks = 2 * (mainbus_ramsize() / len) + 1;
+
+	for (i=0; i<nblocks; i++) {
+		p = kmalloc(len);
+		if (p == NULL) {
+			panic("km3: out of memory after %u %u-page blocks "
+			      "(leak?)\n", i, KM3_BIGPAGES);
+		}
+		for (j=0; j<len / sizeof(*p); j++) {
+			p[j] = i ^ j;
+		}
+		for (j=0; j<len / sizeof(*p); j++) {
+			if (p[j] != (i ^ j)) {
+				panic("km3: %u-page block %u corrupt at "
+				      "word %u\n", KM3_BIGPAGES, i,
+				      (unsigned) j);
+			}
+		}
+		kfree(p);
+	}
+	kprintf("km3: %u %u-page blocks allocated and freed, %lu KB "
+		"in all\n", nblocks, KM3_BIGPAGES,
+		(unsigned long) (nblocks * (len / 1024)));
+}
+#endif
+
+int
+mallocthroughput(int nargs, char **args)
+{
+	uint32_t msecs;
+	unsigned nthreads;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting kmalloc throughput test...\n");
+
+	for (nthreads = 1; nthreads <= 8; nthreads *= 2) {
+		msecs = test_runthreads("mallocthroughput", nthreads,
+					km3thread, NULL);
+		test_printrate("km3", nthreads,
+			       nthreads * KM3_ROUNDS * KM3_BATCH,
+			       "pairs", msecs);
+	}
+
+	km3_crosscpu();
+#if !OPT_DUMBVM
+	km3_bigblocks();
+#endif
+
+	kprintf("kmalloc throughput test done\n");
+
+	return 0;
+}
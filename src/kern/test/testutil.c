@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Helpers shared by the kernel tests.
+ */
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+struct runthreads {
+	void (*rt_func)(void *data, unsigned long num);
+	void *rt_data;
+	struct semaphore *rt_sem;
+};
+
+static
+void
+runthreads_thread(void *rtv, unsigned long num)
+{
+	struct runthreads *rt = rtv;
+
+	rt->rt_func(rt->rt_data, num);
+	V(rt->rt_sem);
+}
+
+/*
+ * Fork NTHREADS threads running FUNC(DATA, i), i = 0..NTHREADS-1,
+ * wait for all of them to finish, and return how long that took in
+ * milliseconds (at least 1, so it can be divided by).
+ */
+uint32_t
+test_runthreads(const char *name, unsigned nthreads,
+		void (*func)(void *data, unsigned long num), void *data)
+{
+	struct runthreads rt;
+	time_t startsecs, endsecs, secs;
+	uint32_t startnsecs, endnsecs, nsecs, msecs;
+	unsigned i;
+	int result;
+
+	rt.rt_func = func;
+	rt.rt_data = data;
+	rt.rt_sem = sem_create(name, 0);
+	if (rt.rt_sem == NULL) {
+		panic("%s: sem_create failed\n", name);
+	}
+
+	gettime(&startsecs, &startnsecs);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork(name, runthreads_thread, &rt, i, NULL);
+		if (result) {
+			panic("%s: thread_fork failed: %s\n", name,
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(rt.rt_sem);
+	}
+	gettime(&endsecs, &endnsecs);
+	getinterval(startsecs, startnsecs, endsecs, endnsecs, &secs, &nsecs);
+
+	sem_destroy(rt.rt_sem);
+
+	msecs = secs * 1000 + nsecs / 1000000;
+	return msecs > 0 ? msecs : 1;
+}
+
+/*
+ * Print a line reporting that NTHREADS threads did NOPS of WHAT in
+ * MSECS milliseconds, and the rate.
+ */
+void
+test_printrate(const char *tag, unsigned nthreads, uint32_t nops,
+	       const char *what, uint32_t msecs)
+{
+	kprintf("%s: %u threads: %lu %s in %lu.%03lu s, %lu %s/sec\n",
+		tag, nthreads, (unsigned long) nops, what,
+		(unsigned long) (msecs / 1000),
+		(unsigned long) (msecs % 1000),
+		(unsigned long) (nops * 1000ULL / msecs), what);
+}
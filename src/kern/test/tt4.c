@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Thread test 4: load balancing.
+ *
+ * Forks a batch of compute-bound threads from one thread, so they all
+ * start out on one cpu's run queue, with uneven amounts of work:
+ * thread i does i+1 units. Then waits for them all and reports how
+ * long it took, how much of the cpus' time went idle, and how many
+ * threads idle cpus stole to balance the load. With more than one
+ * cpu, it fails unless some thread ran on a cpu other than the one
+ * it was forked on.
+ *
+ * Run it on System/161 configured with 1 to 8 cpus to compare.
+ */
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <test.h>
+
+#define TT4_THREADS	8	/* default number of threads */
+#define TT4_UNIT	20	/* matrix multiplies in one unit of work */
+#define TT4_DIM		32	/* matrix dimension */
+
+/*
+ * Thread NUM does NUM+1 units of work, and records in cpumasks[NUM]
+ * which cpus it was on at the start of each unit and at the end.
+ */
+static
+void
+tt4_thread(void *cpumasks, unsigned long num)
+{
+	static const unsigned dim = TT4_DIM;
+	uint32_t *cpumask = &((uint32_t *)cpumasks)[num];
+	uint32_t *m1, *m2, *m3;
+	uint32_t tot;
+	unsigned long u;
+	unsigned i, j, k, n;
+
+	m1 = kmalloc(dim * dim * sizeof(uint32_t));
+	m2 = kmalloc(dim * dim * sizeof(uint32_t));
+	m3 = kmalloc(dim * dim * sizeof(uint32_t));
+	KASSERT(m1 != NULL && m2 != NULL && m3 != NULL);
+
+	for (i=0; i<dim*dim; i++) {
+		m1[i] = random();
+		m2[i] = random();
+	}
+
+	/* No yields and no printing; just compute. */
+	*cpumask = 0;
+	for (u=0; u<=num; u++) {
+		*cpumask |= 1U << (curcpu->c_number % 32);
+		for (n=0; n<TT4_UNIT; n++) {
+			for (i=0; i<dim; i++) {
+				for (j=0; j<dim; j++) {
+					tot = 0;
+					for (k=0; k<dim; k++) {
+						tot += m1[i*dim+k] *
+							m2[k*dim+j];
+					}
+					m3[i*dim+j] = tot;
+				}
+			}
+		}
+	}
+	*cpumask |= 1U << (curcpu->c_number % 32);
+
+	kfree(m1);
+	kfree(m2);
+	kfree(m3);
+}
+
+static
+void
+runtest4(unsigned nthreads)
+{
+	unsigned i, numcpus, idle0, idle1, steals0, steals1;
+	unsigned forkcpu, moved;
+	unsigned long units, cpumsecs, idlemsecs;
+	uint32_t *cpumasks;
+	uint32_t msecs;
+
+	cpumasks = kmalloc(nthreads * sizeof(*cpumasks));
+	if (cpumasks == NULL) {
+		panic("tt4: out of memory\n");
+	}
+
+	units = 0;
+	for (i=0; i<nthreads; i++) {
+		units += i+1;
+	}
+
+	thread_schedstats(&numcpus, &idle0, &steals0);
+	kprintf("Starting thread test 4 (%u threads, %lu units of work, "
+		"%u cpus)\n", nthreads, units, numcpus);
+
+	/* The threads all start out on the cpu we fork them from. */
+	forkcpu = curcpu->c_number % 32;
+	msecs = test_runthreads("tt4", nthreads, tt4_thread, cpumasks);
+	thread_schedstats(&numcpus, &idle1, &steals1);
+
+	cpumsecs = (unsigned long)msecs * numcpus;
+	idlemsecs = (unsigned long)(idle1 - idle0) * 1000 / HZ;
+
+	moved = 0;
+	for (i=0; i<nthreads; i++) {
+		if (cpumasks[i] & ~(1U << forkcpu)) {
+			moved++;
+		}
+	}
+
+	test_printrate("tt4", nthreads, units, "units", msecs);
+	kprintf("tt4: cpus idle %lu.%03lu s of %lu.%03lu s (%lu%%)\n",
+		idlemsecs / 1000, idlemsecs % 1000,
+		cpumsecs / 1000, cpumsecs % 1000,
+		cpumsecs > 0 ? idlemsecs * 100 / cpumsecs : 0);
+	kprintf("tt4: %u threads stolen by idle cpus\n", steals1 - steals0);
+	kprintf("tt4: %u of %u threads ran on a cpu other than cpu %u\n",
+		moved, nthreads, forkcpu);
+
+	/*
+	 * With more than one cpu and more than one thread, the other
+	 * cpus sit idle until they steal something, so some thread
+	 * must have ended up elsewhere.
+	 */
+	if (numcpus > 1 && nthreads > 1 && moved == 0) {
+		panic("tt4: %u cpus, but no thread left cpu %u\n",
+		      numcpus, forkcpu);
+	}
+
+	kfree(cpumasks);
+	kprintf("Thread test 4 done\n");
+}
+
+int
+threadtest4(int nargs, char **args)
+{
+	if (nargs == 1) {
+		runtest4(TT4_THREADS);
+	}
+	else if (nargs == 2 && atoi(args[1]) > 0) {
+		runtest4(atoi(args[1]));
+	}
+	else {
+		kprintf("Usage: tt4 [computethreads]\n");
+		return 1;
+	}
+	return 0;
+}
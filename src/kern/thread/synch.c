@@ -33,12 +33,14 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <kmemcache.h>
 
 ////////////////////////////////////////////////////////////
 //
@@ -147,30 +149,68 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * Locks come from a cache; a cached lock keeps its wait channel and
+ * spinlock, so creating and destroying one is just setting the name.
+ */
+static
+int
+lock_ctor(void *obj)
+{
+	struct lock *lock = obj;
+
+	lock->lk_namebuf[0] = 0;
+	lock->lk_wchan = wchan_create(lock->lk_namebuf);
+	if (lock->lk_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&lock->lk_lock);
+	lock->lk_holder = NULL;
+	return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_cleanup(&lock->lk_lock);
+	wchan_destroy(lock->lk_wchan);
+}
+
+static struct kmem_cache lock_cache =
+	KMEM_CACHE_INITIALIZER("lock", sizeof(struct lock),
+			       lock_ctor, lock_dtor);
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
+	size_t len;
 
-        lock = kmalloc(sizeof(struct lock));
+        lock = kmem_cache_alloc(&lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
-        lock->lk_name = kstrdup(name);
-        if (lock->lk_name == NULL) {
-                kfree(lock);
-                return NULL;
-        }
-
-	lock->lk_wchan = wchan_create(lock->lk_name);
-	if (lock->lk_wchan == NULL) {
-		kfree(lock->lk_name);
-		kfree(lock);
-		return NULL;
+	len = strlen(name);
+	if (len < sizeof(lock->lk_namebuf)) {
+		strcpy(lock->lk_namebuf, name);
+		lock->lk_name = lock->lk_namebuf;
 	}
-	spinlock_init(&lock->lk_lock);
-	lock->lk_holder = NULL;
+	else {
+		/* the wchan gets a truncated copy */
+		len = sizeof(lock->lk_namebuf) - 1;
+		memcpy(lock->lk_namebuf, name, len);
+		lock->lk_namebuf[len] = 0;
+		lock->lk_name = kstrdup(name);
+		if (lock->lk_name == NULL) {
+			kmem_cache_free(&lock_cache, lock);
+			return NULL;
+		}
+	}
+	KASSERT(lock->lk_holder == NULL);
         
         return lock;
 }
@@ -181,11 +221,10 @@ lock_destroy(struct lock *lock)
         KASSERT(lock != NULL);
 
 	KASSERT(lock->lk_holder == NULL);
-	spinlock_cleanup(&lock->lk_lock);
-	wchan_destroy(lock->lk_wchan);
-        
-        kfree(lock->lk_name);
-        kfree(lock);
+	if (lock->lk_name != lock->lk_namebuf) {
+		kfree(lock->lk_name);
+	}
+	kmem_cache_free(&lock_cache, lock);
 }
 
 void
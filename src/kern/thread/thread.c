@@ -46,10 +46,12 @@
 #include <synch.h>
 #include <addrspace.h>
 #include <mainbus.h>
+#include <clock.h>
 #include <vnode.h>
 #include <kern/sysexits.h>
 /* BEGIN A3 SETUP */
 #include <file.h>
+#include <kmemcache.h>
 #include "opt-dumbvm.h" /* to switch between dumb and real vm */
 #include <kern/wait.h> /* New include of macros to make exit codes for ASST1 */
 #include <pid.h> /* New include of pid functions for ASST 1 */
@@ -74,6 +76,17 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Scheduler state; see schedule(). */
+static volatile unsigned sched_boostgen;
+static unsigned sched_lastboost;
+static void sched_enqueue(struct cpu *c, struct thread *t);
+static bool thread_steal(void);
+static void thread_kick_idle(struct cpu *busy);
+
+/* Work stealing tunables; see thread_steal. */
+#define STEAL_COLD_HARDCLOCKS	2
+#define STEAL_ANYWAY_COUNT	2
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -120,9 +133,102 @@ thread_checkstack(struct thread *thread)
  */
 bool isUserSpace;
 
+/*
+ * Thread structures come from a cache, and keep their kernel stack
+ * while they're in it: a thread that exits leaves its stack for the
+ * next thread_fork instead of freeing it. The stack is the only thing
+ * the constructor sets up; it's NULL until thread_fork (or cpu_create)
+ * first needs one.
+ *
+ * Only THREAD_STACKCACHE cached threads keep their stacks; past that,
+ * thread_cache_free frees the stack. Otherwise a burst of threads
+ * would leave up to KMEM_CACHE_MAX stacks sitting in the cache for
+ * good. thread_cachedstacks counts the stacks in the cache.
+ */
+#define THREAD_STACKCACHE 4
+
+static struct spinlock thread_stacklock = SPINLOCK_INITIALIZER;
+static unsigned thread_cachedstacks;
+
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	thread->t_stack = NULL;
+	return 0;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	if (thread->t_stack != NULL) {
+		spinlock_acquire(&thread_stacklock);
+		KASSERT(thread_cachedstacks > 0);
+		thread_cachedstacks--;
+		spinlock_release(&thread_stacklock);
+		kfree(thread->t_stack);
+	}
+}
+
+static struct kmem_cache thread_cache =
+	KMEM_CACHE_INITIALIZER("thread", sizeof(struct thread),
+			       thread_ctor, thread_dtor);
+
+/*
+ * Get a thread structure from the cache, with or without a stack.
+ */
+static
+struct thread *
+thread_cache_alloc(void)
+{
+	struct thread *thread;
+
+	thread = kmem_cache_alloc(&thread_cache);
+	if (thread != NULL && thread->t_stack != NULL) {
+		spinlock_acquire(&thread_stacklock);
+		KASSERT(thread_cachedstacks > 0);
+		thread_cachedstacks--;
+		spinlock_release(&thread_stacklock);
+	}
+	return thread;
+}
+
+/*
+ * Give a thread structure back to the cache. Its stack goes with it
+ * if there's room, and is freed if not.
+ */
+static
+void
+thread_cache_free(struct thread *thread)
+{
+	bool keep = false;
+
+	if (thread->t_stack != NULL) {
+		spinlock_acquire(&thread_stacklock);
+		if (thread_cachedstacks < THREAD_STACKCACHE) {
+			thread_cachedstacks++;
+			keep = true;
+		}
+		spinlock_release(&thread_stacklock);
+		if (!keep) {
+			kfree(thread->t_stack);
+			thread->t_stack = NULL;
+		}
+	}
+	kmem_cache_free(&thread_cache, thread);
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
+ *
+ * The stack is left as the cache had it, which may be NULL or may be
+ * a stack a previous thread used.
  */
 static
 struct thread *
@@ -132,15 +238,21 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = thread_cache_alloc();
 	if (thread == NULL) {
 		return NULL;
 	}
 
-	thread->t_name = kstrdup(name);
-	if (thread->t_name == NULL) {
-		kfree(thread);
-		return NULL;
+	if (strlen(name) < sizeof(thread->t_namebuf)) {
+		strcpy(thread->t_namebuf, name);
+		thread->t_name = thread->t_namebuf;
+	}
+	else {
+		thread->t_name = kstrdup(name);
+		if (thread->t_name == NULL) {
+			thread_cache_free(thread);
+			return NULL;
+		}
 	}
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
@@ -148,10 +260,16 @@ thread_create(const char *name)
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 
+	/* Scheduler fields; new threads start at the top */
+	thread->t_priority = 0;
+	thread->t_recentcpu = 0;
+	thread->t_slice = 0;
+	thread->t_boostgen = sched_boostgen;
+	thread->t_lastran = 0;
+
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
@@ -201,6 +319,8 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_idleclocks = 0;
+	c->c_steals = 0;
 
         /* BEGIN A3 SETUP */
 #if !OPT_DUMBVM
@@ -235,14 +355,17 @@ cpu_create(unsigned hardware_number)
 		 * make it possible to free the boot stack?)
 		 */
 		/*c->c_curthread->t_stack = ... */
+		KASSERT(c->c_curthread->t_stack == NULL);
 
 		/* Also, set the initial process ID - New for ASST1. */
 		c->c_curthread->t_pid = BOOTUP_PID;
 	}
 	else {
-		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
 		if (c->c_curthread->t_stack == NULL) {
-			panic("cpu_create: couldn't allocate stack");
+			c->c_curthread->t_stack = kmalloc(STACK_SIZE);
+			if (c->c_curthread->t_stack == NULL) {
+				panic("cpu_create: couldn't allocate stack");
+			}
 		}
 		thread_checkstack_init(c->c_curthread);
 
@@ -286,18 +409,17 @@ thread_destroy(struct thread *thread)
 	/* VM fields, cleaned up in thread_exit */
 	KASSERT(thread->t_addrspace == NULL);
 
-	/* Thread subsystem fields */
-	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
-	}
+	/* Thread subsystem fields; the stack may stay with the cached thread */
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
-	kfree(thread->t_name);
-	kfree(thread);
+	if (thread->t_name != thread->t_namebuf) {
+		kfree(thread->t_name);
+	}
+	thread_cache_free(thread);
 }
 
 /*
@@ -488,7 +610,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	sched_enqueue(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -496,6 +618,10 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else if (targetcpu->c_runqueue.tl_count >= STEAL_ANYWAY_COUNT) {
+		/* Backing up; get someone to come and steal. */
+		thread_kick_idle(targetcpu);
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -534,11 +660,13 @@ thread_fork(const char *name,
 	}
 
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
+	/* Allocate a stack, unless the cached thread already has one */
 	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
 	}
 	thread_checkstack_init(newthread);
 
@@ -567,6 +695,12 @@ thread_fork(const char *name,
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
 
+	/*
+	 * Start at the parent's priority, so a CPU hog can't get
+	 * back to the top by forking.
+	 */
+	newthread->t_priority = curthread->t_priority;
+
 	/* VFS fields */
 	if (curthread->t_cwd != NULL) {
 		VOP_INCREF(curthread->t_cwd);
@@ -671,6 +805,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		return;
 	}
 
+	/* Remember when it last ran here, for thread_steal. */
+	cur->t_lastran = curcpu->c_hardclocks;
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
@@ -704,8 +841,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	cur->t_state = newstate;
 
 	/*
-	 * Get the next thread. While there isn't one, call md_idle().
-	 * curcpu->c_isidle must be true when md_idle is
+	 * Get the next thread. While there isn't one, try to steal
+	 * one from another cpu, and if that fails call cpu_idle().
+	 * curcpu->c_isidle must be true when cpu_idle is
 	 * called. Unlock the runqueue while idling too, to make sure
 	 * things can be added to it.
 	 *
@@ -726,12 +864,17 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!thread_steal()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
 
+	/* Fresh time slice */
+	next->t_slice = 0;
+
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
 	 * curthread and it may not be, depending on how curthread and
@@ -940,139 +1083,319 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multilevel feedback queue. Each thread has a priority
+ * from 0 (highest) to SCHED_NPRIO-1, and each CPU's run queue is kept
+ * in priority order, first-come first-served within a priority, so
+ * thread_switch always picks the best runnable thread.
+ *
+ * Threads start at the top. Every clock tick a thread runs is charged
+ * to it (t_recentcpu); once it has used SCHED_ALLOT ticks at its
+ * priority, whether all at once or across many sleeps, it drops a
+ * level. So CPU-bound jobs sink to the bottom within a few ticks,
+ * while interactive ones, which run briefly and sleep, stay near the
+ * top and preempt them as soon as they wake.
+ *
+ * Lower priorities get longer time slices (SCHED_SLICE), since the
+ * jobs down there are the ones that benefit from running longer.
+ * A thread only gets preempted at the end of its slice if something
+ * of the same or better priority is waiting; and it gets preempted
+ * right away, at the next tick, if something better is. With nothing
+ * waiting it just keeps running, and the timer doesn't switch at all.
+ *
+ * So that jobs at the bottom can't starve forever, and so a job that
+ * turns interactive gets back up, every SCHED_BOOST_HARDCLOCKS all
+ * threads go back to the top. That's done lazily: CPU 0 bumps
+ * sched_boostgen, and each thread notices the next time it's looked
+ * at (on a tick, on being put on a run queue, or by schedule()).
  */
 
+#define SCHED_SLICE(pri)	(1U << (pri))		/* ticks */
+#define SCHED_ALLOT(pri)	(4 * SCHED_SLICE(pri))	/* ticks */
+#define SCHED_BOOST_HARDCLOCKS	HZ			/* once a second */
+
+/*
+ * sched_checkboost: if there's been a priority boost since T last
+ * saw one, move T to the top.
+ */
+static
 void
-schedule(void)
+sched_checkboost(struct thread *t)
 {
+	unsigned gen = sched_boostgen;
+
+	if (t->t_boostgen != gen) {
+		t->t_boostgen = gen;
+		t->t_priority = 0;
+		t->t_recentcpu = 0;
+	}
+}
+
+/*
+ * sched_enqueue: put T on C's run queue, after everything of the same
+ * or better priority. C's run queue must be locked.
+ */
+static
+void
+sched_enqueue(struct cpu *c, struct thread *t)
+{
+	struct threadlistnode *tln;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	sched_checkboost(t);
+
 	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
+	 * Search from the tail, since the common case is a thread
+	 * going at the end of its priority. (Not THREADLIST_FORALL_REV,
+	 * which can't handle reaching the head bookend.)
 	 */
+	for (tln = c->c_runqueue.tl_tail.tln_prev; tln->tln_prev != NULL;
+	     tln = tln->tln_prev) {
+		if (tln->tln_self->t_priority <= t->t_priority) {
+			threadlist_insertafter(&c->c_runqueue,
+					       tln->tln_self, t);
+			return;
+		}
+	}
+	threadlist_addhead(&c->c_runqueue, t);
+}
+
+/*
+ * This is called periodically from hardclock(). It reshuffles the
+ * current CPU's run queue by job priority. Threads are always put on
+ * it in order, but a boost changes everyone's priority.
+ */
+void
+schedule(void)
+{
+	struct threadlist old;
+	struct thread *t;
+
+	if (curcpu->c_number == 0 &&
+	    curcpu->c_hardclocks - sched_lastboost >= SCHED_BOOST_HARDCLOCKS) {
+		sched_lastboost = curcpu->c_hardclocks;
+		sched_boostgen++;
+	}
+
+	threadlist_init(&old);
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	while ((t = threadlist_remhead(&curcpu->c_runqueue)) != NULL) {
+		threadlist_addtail(&old, t);
+	}
+	while ((t = threadlist_remhead(&old)) != NULL) {
+		sched_enqueue(curcpu->c_self, t);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+	threadlist_cleanup(&old);
+}
+
+/*
+ * Charge the current thread for the tick that just happened, and
+ * decide whether to preempt it. Called from hardclock().
+ */
+void
+thread_timeslice(void)
+{
+	struct thread *cur, *next;
+	bool preempt;
+
+	cur = curthread;
+
+	/* Nothing to charge if the CPU was idle. */
+	if (curcpu->c_isidle) {
+		curcpu->c_idleclocks++;
+		return;
+	}
+
+	sched_checkboost(cur);
+	cur->t_slice++;
+	cur->t_recentcpu++;
+	if (cur->t_recentcpu >= SCHED_ALLOT(cur->t_priority)) {
+		if (cur->t_priority < SCHED_NPRIO - 1) {
+			cur->t_priority++;
+		}
+		cur->t_recentcpu = 0;
+	}
+
+	preempt = false;
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	if (!threadlist_isempty(&curcpu->c_runqueue)) {
+		next = curcpu->c_runqueue.tl_head.tln_next->tln_self;
+		if (next->t_priority < cur->t_priority) {
+			preempt = true;
+		}
+		else if (next->t_priority == cur->t_priority &&
+			 cur->t_slice >= SCHED_SLICE(cur->t_priority)) {
+			preempt = true;
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (preempt) {
+		thread_yield();
+	}
 }
 
 /*
  * Thread migration.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * Load balancing is done by stealing: a cpu that runs out of threads
+ * looks at the other cpus' run queues and takes one, instead of going
+ * idle. Busy cpus do nothing for it, so none of it is on the timer
+ * path; and nothing moves unless some cpu would otherwise be idle.
  *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
+ * which is fairly slow. So we prefer threads that haven't run on
+ * their cpu for at least STEAL_COLD_HARDCLOCKS, whose cache footprint
+ * is likely gone anyway, and threads that have never run. A cpu that
+ * has only a thread that ran recently waiting gets to keep it; it'll
+ * get to it soon. Once there are STEAL_ANYWAY_COUNT threads waiting,
+ * we take one regardless, from the tail, where the lowest priority
+ * ones are. A stolen thread counts as having just run on its new cpu,
+ * so it doesn't get passed straight on again.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * An idle cpu only looks again when it wakes up, which is at least
+ * every hardclock; thread_make_runnable also sends an idle cpu an
+ * interrupt when a run queue backs up, so work doesn't wait for that.
  */
-void
-thread_consider_migration(void)
-{
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
 
-	my_count = total_count = 0;
-	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+/*
+ * thread_steal_from: try to take a thread off C's run queue and put
+ * it on ours. Returns true if we got one.
+ */
+static
+bool
+thread_steal_from(struct cpu *c)
+{
+	struct threadlistnode *tln;
+	struct thread *t, *victim;
+
+	victim = NULL;
+	spinlock_acquire(&c->c_runqueue_lock);
+	for (tln = c->c_runqueue.tl_tail.tln_prev; tln->tln_prev != NULL;
+	     tln = tln->tln_prev) {
+		t = tln->tln_self;
+		/*
+		 * Never take c's curthread; it can be on the run queue
+		 * briefly while c is coming out of idle. See
+		 * thread_switch.
+		 */
+		if (t == c->c_curthread) {
+			continue;
 		}
-		spinlock_release(&c->c_runqueue_lock);
+		if (t->t_lastran == 0 ||
+		    c->c_hardclocks - t->t_lastran >= STEAL_COLD_HARDCLOCKS) {
+			victim = t;
+			break;
+		}
+		if (victim == NULL &&
+		    c->c_runqueue.tl_count >= STEAL_ANYWAY_COUNT) {
+			/* fallback if nothing's cold */
+			victim = t;
+		}
+	}
+	if (victim != NULL) {
+		threadlist_remove(&c->c_runqueue, victim);
+		victim->t_cpu = curcpu->c_self;
+		victim->t_lastran = curcpu->c_hardclocks;
 	}
+	spinlock_release(&c->c_runqueue_lock);
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
+	if (victim == NULL) {
+		return false;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u\n",
+	      victim->t_name, c->c_number, curcpu->c_number);
+
 	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
-	}
+	sched_enqueue(curcpu->c_self, victim);
+	curcpu->c_steals++;
 	spinlock_release(&curcpu->c_runqueue_lock);
+	return true;
+}
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
+/*
+ * thread_steal: called by a cpu with nothing to run, without its run
+ * queue lock held. Look for the busiest other cpu and try to take a
+ * thread from it. The run queue lengths are peeked at without locks;
+ * they're only a hint for where to look.
+ */
+static
+bool
+thread_steal(void)
+{
+	unsigned i, numcpus, start, count, bestcount;
+	struct cpu *c, *best;
+
+	numcpus = cpuarray_num(&allcpus);
+	if (numcpus <= 1) {
+		return false;
+	}
+
+	/* Start at the next cpu, so idle cpus don't all pile on one. */
+	start = curcpu->c_number + 1;
+	best = NULL;
+	bestcount = 0;
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, (start + i) % numcpus);
 		if (c == curcpu->c_self) {
 			continue;
 		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+		count = c->c_runqueue.tl_count;
+		if (count > bestcount) {
+			best = c;
+			bestcount = count;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
+	if (best == NULL) {
+		return false;
+	}
+	return thread_steal_from(best);
+}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+/*
+ * thread_kick_idle: a run queue has a thread waiting on a busy cpu;
+ * wake up an idle cpu, if there is one, so it can come and steal it.
+ * Like thread_steal, reads c_isidle without locks, as a hint.
+ */
+static
+void
+thread_kick_idle(struct cpu *busy)
+{
+	unsigned i, numcpus;
+	struct cpu *c;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != busy && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
 	}
+}
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+/*
+ * thread_schedstats: get the number of cpus, and the total over all
+ * cpus of hardclocks that found the cpu idle and threads stolen.
+ */
+void
+thread_schedstats(unsigned *numcpus, unsigned *idleclocks, unsigned *steals)
+{
+	unsigned i, n;
+	struct cpu *c;
+
+	n = cpuarray_num(&allcpus);
+	*numcpus = n;
+	*idleclocks = 0;
+	*steals = 0;
+	for (i=0; i<n; i++) {
+		c = cpuarray_get(&allcpus, i);
+		*idleclocks += c->c_idleclocks;
+		*steals += c->c_steals;
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -1261,7 +1584,19 @@ ipi_broadcast(int code)
 void
 ipi_tlbshootdown(unsigned targetcpu, const struct tlbshootdown *mapping)
 {
-        int n;
+	ipi_tlbshootdown_batch(targetcpu, mapping, 1);
+}
+
+/*
+ * Queue NUM shootdowns for the target CPU and send it one IPI for all
+ * of them. If they don't all fit in its queue, or NUM is
+ * TLBSHOOTDOWN_ALL, the target flushes its whole TLB instead.
+ */
+void
+ipi_tlbshootdown_batch(unsigned targetcpu,
+		       const struct tlbshootdown *mappings, int num)
+{
+        int n, i;
         struct cpu *target;
 
         target = cpuarray_get(&allcpus, targetcpu);
@@ -1269,12 +1604,17 @@ ipi_tlbshootdown(unsigned targetcpu, const struct tlbshootdown *mapping)
         spinlock_acquire(&target->c_ipi_lock);
 
         n = target->c_numshootdown;
-        if (n == TLBSHOOTDOWN_MAX) {
+        if (n == TLBSHOOTDOWN_ALL) {
+                /* already flushing everything */
+        }
+        else if (num == TLBSHOOTDOWN_ALL || n + num > TLBSHOOTDOWN_MAX) {
                 target->c_numshootdown = TLBSHOOTDOWN_ALL;
         }
         else {
-                target->c_shootdown[n] = *mapping;
-                target->c_numshootdown = n+1;
+                for (i=0; i<num; i++) {
+                        target->c_shootdown[n+i] = mappings[i];
+                }
+                target->c_numshootdown = n+num;
         }
 
         target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
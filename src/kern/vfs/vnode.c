@@ -53,6 +53,7 @@ vnode_init(struct vnode *vn, const struct vnode_ops *ops,
 	vn->vn_opencount = 0;
 	vn->vn_fs = fs;
 	vn->vn_data = fsdata;
+	vn->vn_filecache = NULL;
 	vn->offset = 0;
 	char lname[] = "vlock";
 	vn->v_lock = lock_create(lname);
@@ -68,6 +69,7 @@ vnode_cleanup(struct vnode *vn)
 {
 	KASSERT(vn->vn_refcount==1);
 	KASSERT(vn->vn_opencount==0);
+	KASSERT(vn->vn_filecache==NULL);
 
 	vn->vn_ops = NULL;
 	vn->vn_refcount = 0;
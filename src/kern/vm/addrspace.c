@@ -29,6 +29,8 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
 #include <kern/unistd.h>
 #include <limits.h>
 #include <lib.h>
@@ -44,6 +46,8 @@
 #include <vfs.h>
 #include <syscall.h>
 
+#include "opt-cow.h"
+
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -75,9 +79,104 @@ as_create(void)
 		return NULL;
 	}
 
+	as->as_heap = NULL;
+	as->as_heapend = 0;
+	as->as_lastobj = NULL;
+
+	mmu_initas(as);
+
 	return as;
 }
 
+/*
+ * as_searchobj: find where a region at VA goes in as_objects, which
+ * is kept sorted by base address: returns the number of regions whose
+ * base is at or below VA. The one that might contain VA, if any, is
+ * just before that.
+ */
+static
+unsigned
+as_searchobj(struct addrspace *as, vaddr_t va)
+{
+	struct vm_object *vmo;
+	unsigned lo, hi, mid;
+
+	lo = 0;
+	hi = vm_object_array_num(as->as_objects);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		vmo = vm_object_array_get(as->as_objects, mid);
+		if (vmo->vmo_base <= va) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * as_lookup: find the region containing VA, or return NULL if there
+ * isn't one. Faults come in runs on the same region, so the last one
+ * found is tried first, before the binary search.
+ */
+static
+struct vm_object *
+as_lookup(struct addrspace *as, vaddr_t va)
+{
+	struct vm_object *vmo;
+	unsigned i;
+
+	vmo = as->as_lastobj;
+	if (vmo != NULL && va >= vmo->vmo_base &&
+	    va - vmo->vmo_base < PAGE_SIZE * lpage_table_num(vmo->vmo_lpages)) {
+		return vmo;
+	}
+
+	i = as_searchobj(as, va);
+	if (i == 0) {
+		return NULL;
+	}
+	vmo = vm_object_array_get(as->as_objects, i - 1);
+	if (va - vmo->vmo_base >= PAGE_SIZE * lpage_table_num(vmo->vmo_lpages)) {
+		return NULL;
+	}
+	as->as_lastobj = vmo;
+	return vmo;
+}
+
+/*
+ * as_addobj: add VMO to the address space, keeping as_objects sorted.
+ * The caller has checked that it doesn't overlap anything. It goes
+ * after any region with the same base, which can only be an empty
+ * one (like a new heap), so that as_searchobj finds it rather than
+ * that.
+ */
+static
+int
+as_addobj(struct addrspace *as, struct vm_object *vmo)
+{
+	unsigned i, num;
+	int result;
+
+	num = vm_object_array_num(as->as_objects);
+	result = vm_object_array_setsize(as->as_objects, num + 1);
+	if (result) {
+		return result;
+	}
+	for (i = num; i > 0; i--) {
+		if (vm_object_array_get(as->as_objects, i - 1)->vmo_base <=
+		    vmo->vmo_base) {
+			break;
+		}
+		vm_object_array_set(as->as_objects, i,
+				    vm_object_array_get(as->as_objects, i - 1));
+	}
+	vm_object_array_set(as->as_objects, i, vmo);
+	return 0;
+}
+
 /*
  * as_copy: duplicate an address space. Creates a new address space and
  * copies each vm_object in the source address space into the new one.
@@ -110,11 +209,11 @@ as_copy(struct addrspace *as, struct addrspace **ret)
 	KASSERT(as == curthread->t_addrspace);
 
 
-	/* copy the vmos */
+	/* copy the vmos (in order, so newas stays sorted) */
 	for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
 		vmo = vm_object_array_get(as->as_objects, i);
 
-		result = vm_object_copy(vmo, newas, &newvmo);
+		result = vm_object_copy(vmo, as, newas, &newvmo);
 		if (result) {
 			goto fail;
 		}
@@ -124,7 +223,12 @@ as_copy(struct addrspace *as, struct addrspace **ret)
 			vm_object_destroy(newas, newvmo);
 			goto fail;
 		}
+
+		if (vmo == as->as_heap) {
+			newas->as_heap = newvmo;
+		}
 	}
+	newas->as_heapend = as->as_heapend;
 	
 	*ret = newas;
 	return 0;
@@ -144,45 +248,107 @@ fail:
 int
 as_fault(struct addrspace *as, int faulttype, vaddr_t va)
 {
-	struct vm_object *faultobj = NULL;
+	struct vm_object *faultobj;
 	struct lpage *lp;
-	vaddr_t bot=0, top;
-	unsigned i, index;
+	unsigned index;
+	bool canwrite, counted = false;
 	int result;
 
 	/* Find the vm_object concerned */
-	for (i=0; i<vm_object_array_num(as->as_objects); i++) {
-		struct vm_object *vmo;
-
-		vmo = vm_object_array_get(as->as_objects, i);
-		bot = vmo->vmo_base;
-		top = bot + PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
-		if (va >= bot && va < top) {
-			faultobj = vmo;
-			break;
-		}
-	}
-
+	faultobj = as_lookup(as, va);
 	if (faultobj == NULL) {
 		DEBUG(DB_VM, "vm_fault: EFAULT: va=0x%x\n", va);
 		return EFAULT;
 	}
+	canwrite = (faultobj->vmo_prot & PROT_WRITE) != 0;
+
+	/* Check that it allows this access */
+	if (faultobj->vmo_prot == PROT_NONE ||
+	    (faulttype != VM_FAULT_READ && !canwrite)) {
+		DEBUG(DB_VM, "vm_fault: EFAULT: va=0x%x (protection)\n", va);
+		return EFAULT;
+	}
 
 	/* Now get the logical page */
-	index = (va - bot) / PAGE_SIZE;
-	lp = lpage_array_get(faultobj->vmo_lpages, index);
+	index = (va - faultobj->vmo_base) / PAGE_SIZE;
+	lp = lpage_table_get(faultobj->vmo_lpages, index);
+
+	if (lp == NULL) {
+		/* first touch; it may come from the executable */
+		result = vm_object_filepage(faultobj, index, &lp);
+		if (result) {
+			return result;
+		}
+	}
+
+	if (lp == NULL && faulttype == VM_FAULT_READ &&
+	    (faultobj->vmo_mapflags & MAP_SHARED) == 0) {
+		/* nothing's been written here; read the zero page */
+		faultobj->vmo_zeromapped = true;
+		mmu_map_zero(as, va);
+		return 0;
+	}
 
 	if (lp == NULL) {
 		/* zerofill page */
+		if (faultobj->vmo_zeromapped) {
+			/* get rid of any read-only zero page mapping */
+			mmu_unmap(as, va);
+		}
+		result = lpage_table_prepare(faultobj->vmo_lpages, index);
+		if (result) {
+			return result;
+		}
 		result = lpage_zerofill(&lp);
 		if (result) {
 			kprintf("vm: zerofill fault at 0x%x failed\n", va);
 			return result;
 		}
-		lpage_array_set(faultobj->vmo_lpages, index, lp);
+		if (faultobj->vmo_mapflags & MAP_SHARED) {
+			/* shared anonymous memory; nobody has it yet */
+			lp->lp_mapshared = true;
+		}
+		vm_object_swaphint(faultobj, index, lp);
+		lpage_table_set(faultobj->vmo_lpages, index, lp);
+	}
+	else {
+		/* usually it's resident and just needs reloading */
+		if (lpage_fastfault(lp, as, faulttype, va, canwrite)) {
+			goto done;
+		}
+		/* if it's swapped out, bring in its swap neighbours too */
+		counted = vm_object_readahead(faultobj, index);
+#if OPT_COW
+		if (faulttype != VM_FAULT_READ && lpage_isshared(lp)) {
+			/* first write to a copy-on-write page: get a copy */
+			struct lpage *newlp;
+
+			/* get rid of the read-only mapping of the shared page */
+			mmu_unmap(as, va);
+			result = lpage_unshare(lp, &newlp);
+			if (result) {
+				kprintf("vm: copy-on-write fault at 0x%x "
+					"failed\n", va);
+				return result;
+			}
+			vm_object_swaphint(faultobj, index, newlp);
+			lpage_table_set(faultobj->vmo_lpages, index, newlp);
+			lp = newlp;
+		}
+#endif
 	}
 	
-	return lpage_fault(lp, as, faulttype, va);
+	result = lpage_fault(lp, as, faulttype, va, canwrite, counted);
+	if (result) {
+		return result;
+	}
+
+ done:
+	if (faulttype == VM_FAULT_READ) {
+		/* map whatever else is handy nearby */
+		vm_object_faultaround(faultobj, as, index);
+	}
+	return 0;
 }
 
 /*
@@ -225,8 +391,8 @@ as_activate(struct addrspace *as)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored.
+ * write, or execute permission should be set on the segment. They
+ * become the region's vmo_prot; see as_fault.
  *
  * Does not allow overlapping regions.
  */
@@ -240,11 +406,8 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	int result;
 	vaddr_t check_vaddr;	/* vaddr to use for overlap check */
 
-	(void)readable;
-	(void)writeable;	// XXX
-	(void)executable;
-
-	/* align base address */
+	/* align base address, keeping the part of the first page in sz */
+	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
 	vaddr &= PAGE_FRAME;
 
 	/* redzone must be aligned */
@@ -266,7 +429,7 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		vmo = vm_object_array_get(as->as_objects, i);
 		KASSERT(vmo != NULL);
 		bot = vmo->vmo_base;
-		top = bot + PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
+		top = bot + PAGE_SIZE * lpage_table_num(vmo->vmo_lpages);
 
 		/* Check guard band, if any */
 		KASSERT(bot >= vmo->vmo_lower_redzone);
@@ -286,9 +449,12 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	}
 	vmo->vmo_base = vaddr;
 	vmo->vmo_lower_redzone = lower_redzone;
+	vmo->vmo_prot = (readable ? PROT_READ : 0) |
+		(writeable ? PROT_WRITE : 0) |
+		(executable ? PROT_EXEC : 0);
 
 	/* Add it to the parent address space. */
-	result = vm_object_array_add(as->as_objects, vmo, NULL);
+	result = as_addobj(as, vmo);
 	if (result) {
 		vm_object_destroy(as, vmo);
 		return result;
@@ -298,6 +464,30 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	return 0;
 }
 
+/*
+ * as_define_filedata: arrange for the FILESIZE bytes of memory at
+ * VADDR, which must lie in a region already set up with
+ * as_define_region, to be loaded on demand from the file V at
+ * OFFSET. Each page is read in the first time it's touched; nothing is
+ * read now.
+ */
+int
+as_define_filedata(struct addrspace *as, vaddr_t vaddr, size_t filesize,
+		   struct vnode *v, off_t offset)
+{
+	struct vm_object *vmo;
+
+	if (filesize == 0) {
+		return 0;
+	}
+
+	vmo = as_lookup(as, vaddr);
+	if (vmo == NULL) {
+		return EFAULT;
+	}
+	return vm_object_setfile(vmo, v, offset, vaddr, filesize);
+}
+
 /*
  * as_prepare_load: called before loading executable segments.
  */
@@ -313,16 +503,329 @@ as_prepare_load(struct addrspace *as)
 }
 
 /*
- * as_complete_load: called after loading executable segments.
+ * as_complete_load: called after loading executable segments. Now
+ * that we know where they end, put the heap region right after them.
+ * It starts out empty; as_sbrk grows it.
  */
 int
 as_complete_load(struct addrspace *as)
 {
-	/*
-	 * Do nothing.
-	 */
+	struct vm_object *vmo;
+	vaddr_t top, vmotop;
+	unsigned i;
+	int result;
 
-	(void)as;
+	KASSERT(as->as_heap == NULL);
+
+	top = 0;
+	for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
+		vmo = vm_object_array_get(as->as_objects, i);
+		vmotop = vmo->vmo_base +
+			PAGE_SIZE * lpage_table_num(vmo->vmo_lpages);
+		if (vmotop > top) {
+			top = vmotop;
+		}
+	}
+
+	vmo = vm_object_create(0);
+	if (vmo == NULL) {
+		return ENOMEM;
+	}
+	vmo->vmo_base = top;
+	vmo->vmo_lower_redzone = 0;
+	vmo->vmo_prot = PROT_READ | PROT_WRITE;
+
+	result = as_addobj(as, vmo);
+	if (result) {
+		vm_object_destroy(as, vmo);
+		return result;
+	}
+
+	as->as_heap = vmo;
+	as->as_heapend = top;
+	return 0;
+}
+
+/*
+ * as_sbrk: move the break (the end of the heap) by AMOUNT bytes and
+ * hand back the old one. The heap vm_object is resized to cover the
+ * break, a page at a time, with vm_object_setsize: growing it reserves
+ * swap for the new pages, which are zero-filled on first touch, and
+ * shrinking it frees the pages and swap given up.
+ *
+ * The heap may not grow into another region (normally the stack, and
+ * its guard band) or shrink below where it started.
+ */
+int
+as_sbrk(struct addrspace *as, int amount, vaddr_t *oldbreak)
+{
+	struct vm_object *heap, *vmo;
+	vaddr_t base, newbreak, newtop, bot, shrink;
+	unsigned i, npages;
+	int result;
+
+	heap = as->as_heap;
+	if (heap == NULL) {
+		/* no program loaded */
+		return EINVAL;
+	}
+	base = heap->vmo_base;
+
+	if (amount < 0) {
+		/* negate unsigned; -amount overflows for INT_MIN */
+		shrink = (vaddr_t)0 - (vaddr_t)amount;
+		if (shrink > as->as_heapend - base) {
+			return EINVAL;
+		}
+		newbreak = as->as_heapend - shrink;
+	}
+	else {
+		newbreak = as->as_heapend + amount;
+		if (newbreak < as->as_heapend || newbreak > MIPS_KSEG0) {
+			return ENOMEM;
+		}
+	}
+
+	npages = (newbreak - base + PAGE_SIZE - 1) / PAGE_SIZE;
+	newtop = base + npages * PAGE_SIZE;
+
+	if (npages > lpage_table_num(heap->vmo_lpages)) {
+		for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
+			vmo = vm_object_array_get(as->as_objects, i);
+			if (vmo == heap || vmo->vmo_base < base) {
+				continue;
+			}
+			bot = vmo->vmo_base - vmo->vmo_lower_redzone;
+			if (newtop > bot) {
+				return ENOMEM;
+			}
+		}
+	}
+
+	result = vm_object_setsize(as, heap, npages);
+	if (result) {
+		return result;
+	}
+
+	*oldbreak = as->as_heapend;
+	as->as_heapend = newbreak;
+	return 0;
+}
+
+/*
+ * as_findspace: find a place for a new region of SZ bytes, which is a
+ * multiple of the page size. Regions made by mmap go between the heap
+ * and the stack: search down from the top of user space for the
+ * highest gap big enough, not counting the guard band of the region
+ * above, and don't go below the heap.
+ */
+static
+int
+as_findspace(struct addrspace *as, size_t sz, vaddr_t *ret)
+{
+	struct vm_object *vmo;
+	vaddr_t lo, hi, bot, top;
+	unsigned i;
+
+	hi = MIPS_KSEG0;
+ again:
+	if (hi < sz) {
+		return ENOMEM;
+	}
+	lo = hi - sz;
+	for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
+		vmo = vm_object_array_get(as->as_objects, i);
+		bot = vmo->vmo_base - vmo->vmo_lower_redzone;
+		top = vmo->vmo_base +
+			PAGE_SIZE * lpage_table_num(vmo->vmo_lpages);
+		if (lo < top && hi > bot) {
+			/* in the way; try below it */
+			hi = bot;
+			goto again;
+		}
+	}
+	if (as->as_heap != NULL && lo < as->as_heap->vmo_base) {
+		return ENOMEM;
+	}
+
+	*ret = lo;
+	return 0;
+}
+
+/*
+ * as_mmap: make a new region of LEN bytes for mmap, and hand back
+ * where it went.
+ *
+ * With MAP_ANONYMOUS it's zero-filled. Otherwise it maps the file VN
+ * from OFFSET, which must be page-aligned: MAP_PRIVATE mappings page
+ * in from the file the same way as executables, and anything past the
+ * end of the file reads as zeros; MAP_SHARED mappings share the file's
+ * filecache with everyone else mapping it (see vm_object_mapfile).
+ *
+ * PROT becomes the region's vmo_prot, and must be made of PROT_READ,
+ * PROT_WRITE and PROT_EXEC. A private read-only mapping shares the
+ * file's pages like program text does.
+ */
+int
+as_mmap(struct addrspace *as, size_t len, int prot, int flags,
+	struct vnode *vn, off_t offset, vaddr_t *ret)
+{
+	struct vm_object *vmo;
+	struct stat st;
+	vaddr_t base;
+	size_t sz, filesize;
+	int result;
+
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if ((prot & ~(PROT_READ|PROT_WRITE|PROT_EXEC)) != 0) {
+		return EINVAL;
+	}
+	sz = ROUNDUP(len, PAGE_SIZE);
+	if (sz < len) {
+		return ENOMEM;
+	}
+
+	result = as_findspace(as, sz, &base);
+	if (result) {
+		return result;
+	}
+
+	vmo = vm_object_create(sz/PAGE_SIZE);
+	if (vmo == NULL) {
+		return ENOMEM;
+	}
+	vmo->vmo_base = base;
+	vmo->vmo_lower_redzone = 0;
+	vmo->vmo_prot = prot;
+	vmo->vmo_mapflags = flags;
+
+	if (flags & MAP_ANONYMOUS) {
+		/* nothing else to do */
+	}
+	else if (flags & MAP_SHARED) {
+		result = vm_object_mapfile(vmo, vn, offset);
+		if (result) {
+			vm_object_destroy(as, vmo);
+			return result;
+		}
+	}
+	else {
+		result = VOP_STAT(vn, &st);
+		if (result) {
+			vm_object_destroy(as, vmo);
+			return result;
+		}
+		filesize = 0;
+		if (offset < st.st_size) {
+			filesize = st.st_size - offset < (off_t)len ?
+				st.st_size - offset : len;
+		}
+		if (filesize > 0) {
+			result = vm_object_setfile(vmo, vn, offset,
+						   base, filesize);
+			if (result) {
+				vm_object_destroy(as, vmo);
+				return result;
+			}
+		}
+	}
+
+	result = as_addobj(as, vmo);
+	if (result) {
+		vm_object_destroy(as, vmo);
+		return result;
+	}
+
+	*ret = base;
+	return 0;
+}
+
+/*
+ * as_munmap: remove the pages from VADDR to VADDR+LEN of a region made
+ * by mmap. That can be the whole region, or the end of it; we don't
+ * split regions, so punching a hole, or removing the start, is EINVAL.
+ */
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct vm_object *vmo;
+	vaddr_t bot, top, end;
+	unsigned i;
+
+	if (len == 0 || vaddr % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	end = ROUNDUP(vaddr + len, PAGE_SIZE);
+	if (end <= vaddr) {
+		return EINVAL;
+	}
+
+	i = as_searchobj(as, vaddr);
+	if (i == 0) {
+		return EINVAL;
+	}
+	i--;
+	vmo = vm_object_array_get(as->as_objects, i);
+	bot = vmo->vmo_base;
+	top = bot + PAGE_SIZE * lpage_table_num(vmo->vmo_lpages);
+	if (vaddr >= top) {
+		return EINVAL;
+	}
+	if (vmo->vmo_mapflags == 0 || end < top) {
+		/* not ours to take apart */
+		return EINVAL;
+	}
+	if (vaddr > bot) {
+		return vm_object_setsize(as, vmo, (vaddr - bot) / PAGE_SIZE);
+	}
+	vm_object_array_remove(as->as_objects, i);
+	if (as->as_lastobj == vmo) {
+		as->as_lastobj = NULL;
+	}
+	vm_object_destroy(as, vmo);
+	return 0;
+}
+
+/*
+ * as_msync: write back the changes to the pages from VADDR to
+ * VADDR+LEN that belong to shared file mappings. Everything in the
+ * range has to be mapped. All writes are done synchronously, so the
+ * MS_ flags don't make any difference.
+ */
+int
+as_msync(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct vm_object *vmo;
+	vaddr_t top, end, stop;
+	int result;
+
+	if (vaddr % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	end = ROUNDUP(vaddr + len, PAGE_SIZE);
+	if (end < vaddr) {
+		return ENOMEM;
+	}
+
+	while (vaddr < end) {
+		vmo = as_lookup(as, vaddr);
+		if (vmo == NULL) {
+			return ENOMEM;
+		}
+		top = vmo->vmo_base +
+			PAGE_SIZE * lpage_table_num(vmo->vmo_lpages);
+
+		stop = end < top ? end : top;
+		result = vm_object_sync(vmo,
+					(vaddr - vmo->vmo_base) / PAGE_SIZE,
+					(stop - vaddr) / PAGE_SIZE);
+		if (result) {
+			return result;
+		}
+		vaddr = stop;
+	}
 	return 0;
 }
 
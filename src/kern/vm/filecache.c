@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <vnode.h>
+#include <vm.h>
+#include <vmprivate.h>
+
+/*
+ * filecache: the pages of a file that is mapped MAP_SHARED.
+ *
+ * fc_pages grows to cover the highest page anyone has touched; pages
+ * nobody has touched are NULL. Pages are only ever added, until the
+ * whole filecache is destroyed.
+ *
+ * The filecache holds a reference to each of its lpages (and a swap
+ * reservation for it, as every holder of an lpage does), and each
+ * vm_object mapping the file holds another for each page it has
+ * touched. The filecache itself doesn't hold the vnode; the vm_objects
+ * attached to it do.
+ *
+ * fc_users counts the attached vm_objects. When it drops to zero the
+ * detacher writes the dirty pages back without holding filecache_lock
+ * (fc_busy counts detachers doing that); whoever finds the filecache
+ * with no users and nobody busy afterwards gets rid of it. Anyone who
+ * attaches in the meantime just picks up the same filecache.
+ *
+ * Synchronization: filecache_lock covers vn_filecache in every vnode
+ * and everything in every filecache. No file I/O is done while holding
+ * it: vfs_biglock ranks above it, since a thread in the file system
+ * can fault on a shared mapping.
+ */
+struct filecache {
+	struct vnode *fc_vnode;
+	struct lpage_table *fc_pages;	/* by page number in the file */
+	unsigned fc_users;		/* vm_objects attached */
+	unsigned fc_busy;		/* detachers writing back */
+};
+
+static struct lock *filecache_lock;
+
+/* Stats counters */
+static volatile uint32_t ct_fchits;
+static volatile uint32_t ct_fcmisses;
+static struct spinlock fcstats_spinlock = SPINLOCK_INITIALIZER;
+
+/*
+ * filecache_bootstrap: set up the lock.
+ *
+ * Synchronization: none; runs at boot.
+ */
+void
+filecache_bootstrap(void)
+{
+	filecache_lock = lock_create("filecache");
+	if (filecache_lock == NULL) {
+		panic("vm: No memory for filecache lock\n");
+	}
+}
+
+/*
+ * filecache_attach: hand back the filecache for VN, creating it if
+ * nobody has it mapped, and count one more user. The caller must keep
+ * its reference to VN until it detaches.
+ *
+ * Synchronization: takes filecache_lock.
+ */
+int
+filecache_attach(struct vnode *vn, struct filecache **ret)
+{
+	struct filecache *fc;
+
+	lock_acquire(filecache_lock);
+	fc = vn->vn_filecache;
+	if (fc == NULL) {
+		fc = kmalloc(sizeof(struct filecache));
+		if (fc == NULL) {
+			lock_release(filecache_lock);
+			return ENOMEM;
+		}
+		fc->fc_pages = lpage_table_create();
+		if (fc->fc_pages == NULL) {
+			kfree(fc);
+			lock_release(filecache_lock);
+			return ENOMEM;
+		}
+		fc->fc_vnode = vn;
+		fc->fc_users = 0;
+		fc->fc_busy = 0;
+		vn->vn_filecache = fc;
+	}
+	fc->fc_users++;
+	lock_release(filecache_lock);
+
+	*ret = fc;
+	return 0;
+}
+
+/*
+ * filecache_destroy: get rid of a filecache nobody is using. Its
+ * pages have been written back, so this just drops its references.
+ */
+static
+void
+filecache_destroy(struct filecache *fc)
+{
+	struct lpage *lp;
+	unsigned i;
+
+	for (i=0; i<lpage_table_num(fc->fc_pages); i++) {
+		lp = lpage_table_get(fc->fc_pages, i);
+		if (lp != NULL) {
+			lpage_destroy(lp);
+		}
+	}
+	lpage_table_setsize(fc->fc_pages, 0);
+	lpage_table_destroy(fc->fc_pages);
+	kfree(fc);
+}
+
+/*
+ * filecache_detach: drop a user of FC. If it was the last, write back
+ * all the dirty pages, and unless someone has started using it again
+ * by then, destroy it.
+ *
+ * Synchronization: takes filecache_lock, but not across the writes.
+ * The pages can't go away while we're busy, and while we don't hold
+ * the lock only new pages can appear.
+ */
+void
+filecache_detach(struct filecache *fc)
+{
+	struct lpage *lp;
+	unsigned i;
+	int result;
+
+	lock_acquire(filecache_lock);
+	KASSERT(fc->fc_users > 0);
+	fc->fc_users--;
+	if (fc->fc_users > 0) {
+		lock_release(filecache_lock);
+		return;
+	}
+	fc->fc_busy++;
+
+	for (i=0; i<lpage_table_num(fc->fc_pages); i++) {
+		lp = lpage_table_get(fc->fc_pages, i);
+		if (lp == NULL) {
+			continue;
+		}
+		lock_release(filecache_lock);
+		result = lpage_sync(lp);
+		if (result) {
+			kprintf("vm: writing back mapped file: %s\n",
+				strerror(result));
+		}
+		lock_acquire(filecache_lock);
+	}
+
+	KASSERT(fc->fc_busy > 0);
+	fc->fc_busy--;
+	if (fc->fc_users > 0 || fc->fc_busy > 0) {
+		lock_release(filecache_lock);
+		return;
+	}
+	KASSERT(fc->fc_vnode->vn_filecache == fc);
+	fc->fc_vnode->vn_filecache = NULL;
+	lock_release(filecache_lock);
+
+	filecache_destroy(fc);
+}
+
+/*
+ * filecache_getpage: hand back the lpage for page PAGENO of the file,
+ * with a new reference (and the caller's swap reservation) for the
+ * caller. A page nobody has touched yet is created file-backed,
+ * holding whatever part of the file falls in it; past the end of the
+ * file it's just zeros.
+ *
+ * Synchronization: takes filecache_lock. The file size is looked up
+ * first, since VOP_STAT takes vfs_biglock.
+ */
+int
+filecache_getpage(struct filecache *fc, unsigned pageno, struct lpage **ret)
+{
+	struct stat st;
+	struct lpage *lp;
+	off_t offset;
+	unsigned len;
+	int result;
+
+	result = VOP_STAT(fc->fc_vnode, &st);
+	if (result) {
+		return result;
+	}
+	offset = (off_t)pageno * PAGE_SIZE;
+	if (offset >= st.st_size) {
+		len = 0;
+	}
+	else if (st.st_size - offset < PAGE_SIZE) {
+		len = st.st_size - offset;
+	}
+	else {
+		len = PAGE_SIZE;
+	}
+
+	lock_acquire(filecache_lock);
+	KASSERT(fc->fc_users > 0);
+
+	if (pageno >= lpage_table_num(fc->fc_pages)) {
+		result = lpage_table_setsize(fc->fc_pages, pageno + 1);
+		if (result) {
+			lock_release(filecache_lock);
+			return result;
+		}
+	}
+
+	lp = lpage_table_get(fc->fc_pages, pageno);
+	if (lp == NULL) {
+		result = lpage_table_prepare(fc->fc_pages, pageno);
+		if (result) {
+			lock_release(filecache_lock);
+			return result;
+		}
+		result = swap_reserve(1);
+		if (result) {
+			lock_release(filecache_lock);
+			return result;
+		}
+		lp = lpage_create_file(fc->fc_vnode, offset, 0, len);
+		if (lp == NULL) {
+			swap_unreserve(1);
+			lock_release(filecache_lock);
+			return ENOMEM;
+		}
+		lp->lp_mapshared = true;
+		lpage_table_set(fc->fc_pages, pageno, lp);
+
+		spinlock_acquire(&fcstats_spinlock);
+		ct_fcmisses++;
+		spinlock_release(&fcstats_spinlock);
+	}
+	else {
+		spinlock_acquire(&fcstats_spinlock);
+		ct_fchits++;
+		spinlock_release(&fcstats_spinlock);
+	}
+	lpage_share(lp);
+	lock_release(filecache_lock);
+
+	*ret = lp;
+	return 0;
+}
+
+/*
+ * filecache_printstats: print the counters.
+ */
+void
+filecache_printstats(void)
+{
+	uint32_t hits, misses;
+
+	spinlock_acquire(&fcstats_spinlock);
+	hits = ct_fchits;
+	misses = ct_fcmisses;
+	spinlock_release(&fcstats_spinlock);
+
+	kprintf("vm: filecache: %lu pages found, %lu pages created\n",
+		(unsigned long) hits, (unsigned long) misses);
+}
@@ -29,8 +29,12 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <kmemcache.h>
 
 /*
  * Kernel malloc.
@@ -75,6 +79,14 @@ fill_deadbeef(void *vptr, size_t len)
 //    cannot recursively use the subpage allocator. (We could probably
 //    make that work, but it would be painful.)
 //
+//    To find the pageref for a block being freed without searching,
+//    there's also a table from page address to pageref (prmap).
+//
+//    In front of all this, each CPU keeps a small magazine of free
+//    blocks of each size, so that most kmallocs and kfrees only touch
+//    the current CPU's magazine and don't take the global lock. See
+//    "Per-CPU magazines" below.
+//
 
 #undef  SLOW	/* consistency checks */
 #undef SLOWER	/* lots of consistency checks */
@@ -89,6 +101,10 @@ static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
 #define SMALLEST_SUBPAGE_SIZE 16
 #define LARGEST_SUBPAGE_SIZE 2048
 
+/* per-CPU magazine size, and how many blocks to move at a time */
+#define KM_MAGSIZE 8
+#define KM_BATCH   (KM_MAGSIZE / 2)
+
 #elif PAGE_SIZE == 8192
 #error "No support for 8k pages (yet?)"
 #else
@@ -118,67 +134,45 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
+ * Pagerefs come a page at a time from alloc_kpages, as many as are
+ * needed, so the heap can grow as far as there's RAM for it. Free
+ * ones are kept on a list (linked through next_all). Pages of
+ * pagerefs are never given back; they cost 1/256 of the heap pages
+ * they describe at most.
  *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
- *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * The list is protected by kmalloc_spinlock (below). Adding a page to
+ * it is done without the lock held, by pageref_grow, because
+ * alloc_kpages might need to come back into kmalloc.
  */
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+#define PAGEREFS_PER_PAGE (PAGE_SIZE / sizeof(struct pageref))
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+static struct pageref *freepagerefs;
+static unsigned npagerefs;	/* total, free or not */
+static unsigned npagerefpages;
 
 static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
+	struct pageref *p;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			continue;
-		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
-		}
-		KASSERT(0);
+	p = freepagerefs;
+	if (p == NULL) {
+		/* ran out; caller should pageref_grow */
+		return NULL;
 	}
-
-	/* ran out */
-	return NULL;
+	freepagerefs = p->next_all;
+	return p;
 }
 
 static
 void
 freepageref(struct pageref *p)
 {
-	size_t i, j;
-	uint32_t k;
-
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	p->next_samesize = NULL;
+	p->next_all = freepagerefs;
+	freepagerefs = p;
 }
 
 ////////////////////////////////////////
@@ -189,14 +183,132 @@ static struct pageref *allbase;
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the pages and pagerefs. Most allocations and
+ * frees don't get this far; they're served from the per-CPU
+ * magazines, which don't need it.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
+static void magazine_printstats(void);
+static unsigned magazine_cached(unsigned blktype);
+
+////////////////////////////////////////
+
+/*
+ * prmap: page address -> pageref, for every page the subpage
+ * allocator has, so kfree can find the page a block belongs to in
+ * constant time. It's a two-level table indexed by virtual page
+ * number: the top level is here in the BSS, and each leaf is a page
+ * of pointers, covering 4M of address space, got from alloc_kpages
+ * the first time a page in its range is used. Leaves are never
+ * freed. A NULL entry means the page isn't a subpage allocator page,
+ * so kfree of something there was a multi-page allocation.
+ *
+ * Entries are set and cleared with kmalloc_spinlock held, but read
+ * without it: the entry for a page that has a block allocated in it
+ * can't change until that block is freed.
+ */
+
+#define PRMAP_LEAFSIZE	(PAGE_SIZE / sizeof(struct pageref *))
+#define PRMAP_TOPSIZE	(((vaddr_t)-1 / PAGE_SIZE + 1) / PRMAP_LEAFSIZE)
+
+static struct pageref **prmap[PRMAP_TOPSIZE];
+
+static
+struct pageref *
+prmap_get(vaddr_t addr)
+{
+	struct pageref **leaf;
+	vaddr_t pagenum;
+
+	pagenum = addr / PAGE_SIZE;
+	leaf = prmap[pagenum / PRMAP_LEAFSIZE];
+	if (leaf == NULL) {
+		return NULL;
+	}
+	return leaf[pagenum % PRMAP_LEAFSIZE];
+}
+
+static
+void
+prmap_set(vaddr_t addr, struct pageref *pr)
+{
+	struct pageref **leaf;
+	vaddr_t pagenum;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	pagenum = addr / PAGE_SIZE;
+	leaf = prmap[pagenum / PRMAP_LEAFSIZE];
+	KASSERT(leaf != NULL);
+	leaf[pagenum % PRMAP_LEAFSIZE] = pr;
+}
+
+/*
+ * prmap_prepare: make sure the leaf for ADDR exists. Returns nonzero
+ * if we couldn't get a page for it. Call without kmalloc_spinlock;
+ * alloc_kpages might need to come back into kmalloc.
+ */
+static
+int
+prmap_prepare(vaddr_t addr)
+{
+	vaddr_t topix, leafpage;
+
+	topix = addr / PAGE_SIZE / PRMAP_LEAFSIZE;
+	if (prmap[topix] != NULL) {
+		return 0;
+	}
+
+	leafpage = alloc_kpages(1);
+	if (leafpage == 0) {
+		return -1;
+	}
+	bzero((void *)leafpage, PAGE_SIZE);
+
+	spinlock_acquire(&kmalloc_spinlock);
+	if (prmap[topix] == NULL) {
+		prmap[topix] = (struct pageref **)leafpage;
+		leafpage = 0;
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	if (leafpage != 0) {
+		/* someone else got there first */
+		free_kpages(leafpage);
+	}
+	return 0;
+}
+
+/*
+ * pageref_grow: add a page of pagerefs to the free list. Returns
+ * nonzero if we couldn't get a page. Call without kmalloc_spinlock.
+ */
+static
+int
+pageref_grow(void)
+{
+	struct pageref *prs;
+	vaddr_t page;
+	unsigned i;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return -1;
+	}
+	prs = (struct pageref *)page;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<PAGEREFS_PER_PAGE; i++) {
+		freepageref(&prs[i]);
+	}
+	npagerefs += PAGEREFS_PER_PAGE;
+	npagerefpages++;
+	spinlock_release(&kmalloc_spinlock);
+	return 0;
+}
+
 ////////////////////////////////////////
 
 /* SLOWER implies SLOW */
@@ -260,14 +372,14 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(sc < npagerefs);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(ac < npagerefs);
 		ac++;
 	}
 
@@ -330,6 +442,56 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
+/*
+ * sizeclass_printstats: print, for each block size, how many pages
+ * it has and how full they are. Blocks sitting in the per-CPU
+ * magazines are counted as free here, though the pages count them as
+ * allocated.
+ */
+static
+void
+sizeclass_printstats(void)
+{
+	struct pageref *pr;
+	unsigned i, npages, nblocks, nfree, ncached, nused;
+	unsigned totpages, totbytes, usedbytes;
+
+	kprintf("Size  Pages  Blocks   Used  Cached   Free  Util\n");
+	totpages = totbytes = usedbytes = 0;
+	for (i=0; i<NSIZES; i++) {
+		npages = nfree = 0;
+		spinlock_acquire(&kmalloc_spinlock);
+		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
+			npages++;
+			nfree += pr->nfree;
+		}
+		spinlock_release(&kmalloc_spinlock);
+		ncached = magazine_cached(i);
+
+		nblocks = npages * (PAGE_SIZE / sizes[i]);
+		nused = nblocks - nfree;
+		nused = nused > ncached ? nused - ncached : 0;
+
+		kprintf("%4lu %6u %7u %6u %7u %6u  %3u%%\n",
+			(unsigned long) sizes[i], npages, nblocks, nused,
+			ncached, nblocks - nused - ncached,
+			nblocks > 0 ? nused * 100 / nblocks : 0);
+
+		totpages += npages;
+		totbytes += nblocks * sizes[i];
+		usedbytes += nused * sizes[i];
+	}
+	kprintf("Total: %u pages, %u of %u bytes used (%u%%)\n",
+		totpages, usedbytes, totbytes,
+		totbytes > 0 ? (unsigned)((uint64_t)usedbytes * 100 / totbytes)
+		: 0);
+
+	spinlock_acquire(&kmalloc_spinlock);
+	kprintf("Pagerefs: %u in %u pages, %u in use\n",
+		npagerefs, npagerefpages, totpages);
+	spinlock_release(&kmalloc_spinlock);
+}
+
 void
 kheap_printstats(void)
 {
@@ -345,6 +507,10 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	sizeclass_printstats();
+	magazine_printstats();
+	kmem_cache_printstats();
 }
 
 ////////////////////////////////////////
@@ -357,6 +523,8 @@ remove_lists(struct pageref *pr, int blktype)
 
 	KASSERT(blktype>=0 && blktype<NSIZES);
 
+	prmap_set(PR_PAGEADDR(pr), NULL);
+
 	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
 		checksubpage(*guy);
 		if (*guy == pr) {
@@ -392,22 +560,27 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * subpage_kmalloc: get up to N blocks of size class BLKTYPE from the
+ * pages, into BLOCKS. Returns how many it got; at least one, unless
+ * we're out of memory, in which case 0.
+ */
 static
-void *
-subpage_kmalloc(size_t sz)
+unsigned
+subpage_kmalloc(unsigned blktype, void **blocks, unsigned n)
 {
-	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
-	void *retptr;		// our result
+	unsigned got;		// blocks we have so far
 
 	volatile int i;
 
+	KASSERT(blktype < NSIZES);
+	KASSERT(n > 0);
 
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
+	got = 0;
 
 	spinlock_acquire(&kmalloc_spinlock);
 
@@ -419,7 +592,7 @@ subpage_kmalloc(size_t sz)
 		KASSERT(PR_BLOCKTYPE(pr) == blktype);
 		checksubpage(pr);
 
-		if (pr->nfree > 0) {
+		while (pr->nfree > 0 && got < n) {
 
 		doalloc: /* comes here after getting a whole fresh page */
 
@@ -428,7 +601,7 @@ subpage_kmalloc(size_t sz)
 			fla = prpage + pr->freelist_offset;
 			fl = (struct freelist *)fla;
 
-			retptr = fl;
+			blocks[got++] = fl;
 			fl = fl->next;
 			pr->nfree--;
 
@@ -442,14 +615,19 @@ subpage_kmalloc(size_t sz)
 				KASSERT(pr->nfree == 0);
 				pr->freelist_offset = INVALID_OFFSET;
 			}
-
-			checksubpages();
-
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
+		}
+		if (got == n) {
+			break;
 		}
 	}
 
+	if (got > 0) {
+		/* good enough; don't get a new page for the rest */
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+		return got;
+	}
+
 	/*
 	 * No page of the right size available.
 	 * Make a new one.
@@ -464,17 +642,26 @@ subpage_kmalloc(size_t sz)
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
-		return NULL;
+		return 0;
+	}
+	if (prmap_prepare(prpage)) {
+		free_kpages(prpage);
+		kprintf("kmalloc: Subpage allocator couldn't get a page "
+			"for its page map\n"); 
+		return 0;
 	}
 	spinlock_acquire(&kmalloc_spinlock);
 
-	pr = allocpageref();
-	if (pr==NULL) {
-		/* Couldn't allocate accounting space for the new page. */
+	while ((pr = allocpageref()) == NULL) {
 		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
-		return NULL;
+		if (pageref_grow()) {
+			/* Couldn't allocate accounting space for the page. */
+			free_kpages(prpage);
+			kprintf("kmalloc: Subpage allocator couldn't get "
+				"pageref\n"); 
+			return 0;
+		}
+		spinlock_acquire(&kmalloc_spinlock);
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
@@ -504,13 +691,19 @@ subpage_kmalloc(size_t sz)
 	pr->next_all = allbase;
 	allbase = pr;
 
+	prmap_set(prpage, pr);
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
 
+/*
+ * subpage_kfree: return the N blocks in BLOCKS to their pages. They
+ * must all be subpage blocks (see prmap_get).
+ */
 static
-int
-subpage_kfree(void *ptr)
+void
+subpage_kfree(void **blocks, unsigned n)
 {
 	int blktype;		// index into sizes[] that we're using
 	vaddr_t ptraddr;	// same as ptr
@@ -519,14 +712,20 @@ subpage_kfree(void *ptr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
+	vaddr_t freepages[KM_MAGSIZE]; // pages that became free
+	unsigned i, nfreepages;
 
-	ptraddr = (vaddr_t)ptr;
+	KASSERT(n <= KM_MAGSIZE);
+	nfreepages = 0;
 
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
+	for (i=0; i<n; i++) {
+		ptraddr = (vaddr_t)blocks[i];
+		pr = prmap_get(ptraddr);
+		KASSERT(pr != NULL);
 		prpage = PR_PAGEADDR(pr);
 		blktype = PR_BLOCKTYPE(pr);
 
@@ -534,65 +733,233 @@ subpage_kfree(void *ptr)
 		KASSERT(blktype>=0 && blktype<NSIZES);
 		checksubpage(pr);
 
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
+		offset = ptraddr - prpage;
+		KASSERT(offset < PAGE_SIZE && offset % sizes[blktype] == 0);
+
+		/*
+		 * We probably ought to check for free twice by seeing
+		 * if the block is already on the free list. But that's
+		 * expensive, so we don't.
+		 */
+
+		fla = prpage + offset;
+		fl = (struct freelist *)fla;
+		if (pr->freelist_offset == INVALID_OFFSET) {
+			fl->next = NULL;
+		} else {
+			fl->next = (struct freelist *)
+				(prpage + pr->freelist_offset);
+		}
+		pr->freelist_offset = offset;
+		pr->nfree++;
+
+		KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+		if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+			/* Whole page is free. */
+			remove_lists(pr, blktype);
+			freepageref(pr);
+			freepages[nfreepages++] = prpage;
 		}
 	}
 
-	if (pr==NULL) {
-		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
-		return -1;
+	/* Call free_kpages without kmalloc_spinlock. */
+	spinlock_release(&kmalloc_spinlock);
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
 	}
 
-	offset = ptraddr - prpage;
+#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+#endif
+}
 
-	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
-		panic("kfree: subpage free of invalid addr %p\n", ptr);
+////////////////////////////////////////
+//
+// Per-CPU magazines.
+//
+//    Each CPU has, for each block size, a magazine: a stack of up to
+//    KM_MAGSIZE free blocks. kmalloc pops a block off the current
+//    CPU's magazine and kfree pushes one on, with interrupts off so
+//    the thread can't be switched out (and so can't move to another
+//    CPU) while it's at it; no lock is needed, since nobody else
+//    touches another CPU's magazines except kheap_printstats, which
+//    only reads counters.
+//
+//    When the magazine is empty, kmalloc gets KM_BATCH blocks from
+//    the pages at once with subpage_kmalloc; when it's full, kfree
+//    gives KM_BATCH back with subpage_kfree. Both of those take
+//    kmalloc_spinlock once for the whole batch.
+//
+//    Blocks sitting in magazines count as allocated as far as their
+//    pages are concerned, so a page with one in a magazine isn't
+//    given back. That's at most KM_MAGSIZE blocks of each size per
+//    CPU.
+//
+//    Before there's a curthread (early in boot) there's no current
+//    CPU, and everything goes straight to the pages.
+//
+
+#define KM_MAXCPUS	32
+
+struct kmalloc_magazine {
+	unsigned km_num;
+	void *km_blocks[KM_MAGSIZE];
+};
+
+struct kmalloc_cpu {
+	struct kmalloc_magazine kc_mags[NSIZES];
+	uint32_t kc_hits;	/* kmallocs served from a magazine */
+	uint32_t kc_misses;	/* kmallocs that had to refill */
+};
+
+static struct kmalloc_cpu kmalloc_cpus[KM_MAXCPUS];
+
+/*
+ * magazine_cpu: get the current CPU's magazines, or NULL if we can't
+ * use them. Call with interrupts off.
+ */
+static
+struct kmalloc_cpu *
+magazine_cpu(void)
+{
+	if (!CURCPU_EXISTS() || curcpu->c_number >= KM_MAXCPUS) {
+		return NULL;
 	}
+	return &kmalloc_cpus[curcpu->c_number];
+}
 
-	/*
-	 * Clear the block to 0xdeadbeef to make it easier to detect
-	 * uses of dangling pointers.
-	 */
-	fill_deadbeef(ptr, sizes[blktype]);
+static
+void *
+magazine_kmalloc(size_t sz)
+{
+	struct kmalloc_cpu *kc;
+	struct kmalloc_magazine *mag;
+	void *blocks[KM_BATCH];
+	void *ret;
+	unsigned blktype, n;
+	int spl;
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
+	blktype = blocktype(sz);
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
-
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+	spl = splhigh();
+	kc = magazine_cpu();
+	if (kc != NULL) {
+		mag = &kc->kc_mags[blktype];
+		if (mag->km_num > 0) {
+			ret = mag->km_blocks[--mag->km_num];
+			kc->kc_hits++;
+			splx(spl);
+			return ret;
+		}
+		kc->kc_misses++;
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+	splx(spl);
+
+	/* Empty; get a batch. This can sleep, so interrupts are back on. */
+	n = subpage_kmalloc(blktype, blocks, kc != NULL ? KM_BATCH : 1);
+	if (n == 0) {
+		return NULL;
 	}
+	ret = blocks[--n];
+
+	/* We may be on another CPU by now, and it may have filled up. */
+	spl = splhigh();
+	kc = magazine_cpu();
+	if (kc != NULL) {
+		mag = &kc->kc_mags[blktype];
+		while (n > 0 && mag->km_num < KM_MAGSIZE) {
+			mag->km_blocks[mag->km_num++] = blocks[--n];
+		}
+	}
+	splx(spl);
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
-	spinlock_acquire(&kmalloc_spinlock);
-	checksubpages();
-	spinlock_release(&kmalloc_spinlock);
-#endif
+	if (n > 0) {
+		subpage_kfree(blocks, n);
+	}
+	return ret;
+}
 
-	return 0;
+/*
+ * magazine_printstats: print how well the magazines are doing. The
+ * counters are read without stopping anyone, so they're approximate.
+ */
+static
+void
+magazine_printstats(void)
+{
+	unsigned i, j, cached;
+	uint32_t hits, misses;
+
+	hits = misses = 0;
+	cached = 0;
+	for (i=0; i<KM_MAXCPUS; i++) {
+		hits += kmalloc_cpus[i].kc_hits;
+		misses += kmalloc_cpus[i].kc_misses;
+		for (j=0; j<NSIZES; j++) {
+			cached += kmalloc_cpus[i].kc_mags[j].km_num;
+		}
+	}
+	kprintf("Per-CPU magazines: %lu hits, %lu misses, "
+		"%u blocks cached\n", (unsigned long) hits,
+		(unsigned long) misses, cached);
+}
+
+/*
+ * magazine_cached: how many blocks of size class BLKTYPE are sitting
+ * in magazines. Approximate, like magazine_printstats.
+ */
+static
+unsigned
+magazine_cached(unsigned blktype)
+{
+	unsigned i, cached;
+
+	cached = 0;
+	for (i=0; i<KM_MAXCPUS; i++) {
+		cached += kmalloc_cpus[i].kc_mags[blktype].km_num;
+	}
+	return cached;
+}
+
+static
+void
+magazine_kfree(void *ptr, unsigned blktype)
+{
+	struct kmalloc_cpu *kc;
+	struct kmalloc_magazine *mag;
+	void *blocks[KM_BATCH + 1];
+	unsigned n;
+	int spl;
+
+	n = 0;
+	spl = splhigh();
+	kc = magazine_cpu();
+	if (kc == NULL) {
+		blocks[n++] = ptr;
+	}
+	else {
+		mag = &kc->kc_mags[blktype];
+		if (mag->km_num == KM_MAGSIZE) {
+			/* Full; give the oldest half back below. */
+			for (n=0; n<KM_BATCH; n++) {
+				blocks[n] = mag->km_blocks[n];
+			}
+			for (; n<KM_MAGSIZE; n++) {
+				mag->km_blocks[n - KM_BATCH] =
+					mag->km_blocks[n];
+			}
+			mag->km_num -= KM_BATCH;
+			n = KM_BATCH;
+		}
+		mag->km_blocks[mag->km_num++] = ptr;
+	}
+	splx(spl);
+
+	if (n > 0) {
+		subpage_kfree(blocks, n);
+	}
 }
 
 //
@@ -615,20 +982,45 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
-	return subpage_kmalloc(sz);
+	return magazine_kmalloc(sz);
 }
 
 void
 kfree(void *ptr)
 {
-	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
-	 */
+	struct pageref *pr;
+	vaddr_t offset;
+	unsigned blktype;
+
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+
+	/*
+	 * If it's not on one of our pages, it's a big allocation.
+	 */
+	pr = prmap_get((vaddr_t)ptr);
+	if (pr == NULL) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
+		return;
+	}
+
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype < NSIZES);
+	offset = (vaddr_t)ptr - PR_PAGEADDR(pr);
+
+	/* Check for proper positioning and alignment */
+	if (offset % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
 	}
+
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers.
+	 */
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	magazine_kfree(ptr, blktype);
 }
 
@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <kmemcache.h>
+
+/*
+ * Object caches. See kmemcache.h.
+ *
+ * Each cache keeps its free objects in a small array under its own
+ * spinlock, so caches for different types don't contend with each
+ * other; the objects themselves come from kmalloc, whose per-CPU
+ * magazines keep that side cheap too.
+ */
+
+/* list of all caches that have been used, for kmem_cache_printstats */
+static struct kmem_cache *allcaches;
+static struct spinlock allcaches_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * kmem_cache_list: put KC on the list of caches if it isn't yet.
+ */
+static
+void
+kmem_cache_list(struct kmem_cache *kc)
+{
+	spinlock_acquire(&allcaches_lock);
+	if (!kc->kc_listed) {
+		kc->kc_next = allcaches;
+		allcaches = kc;
+		kc->kc_listed = true;
+	}
+	spinlock_release(&allcaches_lock);
+}
+
+/*
+ * kmem_cache_unlist: take KC off the list of caches.
+ */
+static
+void
+kmem_cache_unlist(struct kmem_cache *kc)
+{
+	struct kmem_cache **p;
+
+	spinlock_acquire(&allcaches_lock);
+	if (kc->kc_listed) {
+		for (p = &allcaches; *p != NULL; p = &(*p)->kc_next) {
+			if (*p == kc) {
+				*p = kc->kc_next;
+				break;
+			}
+		}
+		kc->kc_listed = false;
+	}
+	spinlock_release(&allcaches_lock);
+}
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+
+	KASSERT(size > 0);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+	spinlock_init(&kc->kc_lock);
+	kc->kc_num = 0;
+	kc->kc_hits = 0;
+	kc->kc_misses = 0;
+	kc->kc_overflows = 0;
+	kc->kc_next = NULL;
+	kc->kc_listed = false;
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	void *obj;
+
+	kmem_cache_unlist(kc);
+
+	spinlock_acquire(&kc->kc_lock);
+	while (kc->kc_num > 0) {
+		obj = kc->kc_objs[--kc->kc_num];
+		spinlock_release(&kc->kc_lock);
+		if (kc->kc_dtor != NULL) {
+			kc->kc_dtor(obj);
+		}
+		kfree(obj);
+		spinlock_acquire(&kc->kc_lock);
+	}
+	spinlock_release(&kc->kc_lock);
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	void *obj;
+	int result;
+
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_num > 0) {
+		obj = kc->kc_objs[--kc->kc_num];
+		kc->kc_hits++;
+		spinlock_release(&kc->kc_lock);
+		return obj;
+	}
+	kc->kc_misses++;
+	spinlock_release(&kc->kc_lock);
+
+	if (!kc->kc_listed) {
+		kmem_cache_list(kc);
+	}
+
+	obj = kmalloc(kc->kc_size);
+	if (obj == NULL) {
+		return NULL;
+	}
+	if (kc->kc_ctor != NULL) {
+		result = kc->kc_ctor(obj);
+		if (result) {
+			kfree(obj);
+			return NULL;
+		}
+	}
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	KASSERT(obj != NULL);
+
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_num < KMEM_CACHE_MAX) {
+		kc->kc_objs[kc->kc_num++] = obj;
+		spinlock_release(&kc->kc_lock);
+		return;
+	}
+	kc->kc_overflows++;
+	spinlock_release(&kc->kc_lock);
+
+	if (kc->kc_dtor != NULL) {
+		kc->kc_dtor(obj);
+	}
+	kfree(obj);
+}
+
+/*
+ * kmem_cache_printstats: print one line per cache. Called from
+ * kheap_printstats.
+ */
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+	uint32_t hits, misses, overflows;
+	unsigned num;
+
+	spinlock_acquire(&allcaches_lock);
+	for (kc = allcaches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		hits = kc->kc_hits;
+		misses = kc->kc_misses;
+		overflows = kc->kc_overflows;
+		num = kc->kc_num;
+		spinlock_release(&kc->kc_lock);
+
+		kprintf("kmem_cache %-12s %4lu bytes: %lu hits, %lu misses, "
+			"%lu destroyed, %u cached\n", kc->kc_name,
+			(unsigned long) kc->kc_size, (unsigned long) hits,
+			(unsigned long) misses, (unsigned long) overflows,
+			num);
+	}
+	spinlock_release(&allcaches_lock);
+}
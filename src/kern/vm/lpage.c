@@ -33,9 +33,13 @@
 #include <spinlock.h>
 #include <synch.h>
 #include <thread.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <vmprivate.h>
+#include <kmemcache.h>
 #include <machine/coremap.h>
 
 /* 
@@ -48,12 +52,20 @@ static volatile uint32_t ct_minfaults;
 static volatile uint32_t ct_majfaults;
 static volatile uint32_t ct_discard_evictions;
 static volatile uint32_t ct_write_evictions;
+static volatile uint32_t ct_copies;
+static volatile uint32_t ct_shares;
+static volatile uint32_t ct_cowcopies;
+static volatile uint32_t ct_precleans;
+static volatile uint32_t ct_swapassigns;
+static volatile uint32_t ct_readaheads;
+static volatile uint32_t ct_filereads;
+static volatile uint32_t ct_filewrites;
 static struct spinlock stats_spinlock = SPINLOCK_INITIALIZER;
 
 void
 vm_printstats(void)
 {
-	uint32_t zf, mn, mj, de, we, te;
+	uint32_t zf, mn, mj, de, we, te, cp, sh, cc, pc, sa, ra, fr, fw;
 
 	spinlock_acquire(&stats_spinlock);
 	zf = ct_zerofills;
@@ -61,18 +73,65 @@ vm_printstats(void)
 	mj = ct_majfaults;
 	de = ct_discard_evictions;
 	we = ct_write_evictions;
+	cp = ct_copies;
+	sh = ct_shares;
+	cc = ct_cowcopies;
+	pc = ct_precleans;
+	sa = ct_swapassigns;
+	ra = ct_readaheads;
+	fr = ct_filereads;
+	fw = ct_filewrites;
 	spinlock_release(&stats_spinlock);
 
 	te = de+we;
 
 	kprintf("vm: %lu zerofills %lu minorfaults %lu majorfaults\n",
 		(unsigned long) zf, (unsigned long) mn, (unsigned long) mj);
+	kprintf("vm: %lu pages read from files, %lu written back to files\n",
+		(unsigned long) fr, (unsigned long) fw);
 	kprintf("vm: %lu evictions (%lu discarding, %lu writes)\n",
 		(unsigned long) te, (unsigned long) de, (unsigned long) we);
+	kprintf("vm: %lu pages cleaned ahead of eviction by pageout\n",
+		(unsigned long) pc);
+	kprintf("vm: %lu swap pages assigned at pageout\n",
+		(unsigned long) sa);
+	kprintf("vm: %lu pages read ahead on major faults\n",
+		(unsigned long) ra);
+	kprintf("vm: %lu page copies (%lu copy-on-write), %lu pages shared\n",
+		(unsigned long) cp, (unsigned long) cc, (unsigned long) sh);
+	swap_printstats();
+	filecache_printstats();
 	vm_printmdstats();
 	//return 0;
 }
 
+/*
+ * Cache of lpage structures. The spinlock is the only part that
+ * survives between uses; everything else lpage_create sets.
+ */
+static
+int
+lpage_ctor(void *obj)
+{
+	struct lpage *lp = obj;
+
+	spinlock_init(&lp->lp_spinlock);
+	return 0;
+}
+
+static
+void
+lpage_dtor(void *obj)
+{
+	struct lpage *lp = obj;
+
+	spinlock_cleanup(&lp->lp_spinlock);
+}
+
+static struct kmem_cache lpage_cache =
+	KMEM_CACHE_INITIALIZER("lpage", sizeof(struct lpage),
+			       lpage_ctor, lpage_dtor);
+
 /*
  * Create a logical page object.
  * Synchronization: none.
@@ -82,14 +141,50 @@ lpage_create(void)
 {
 	struct lpage *lp;
 
-	lp = kmalloc(sizeof(struct lpage));
+	lp = kmem_cache_alloc(&lpage_cache);
 	if (lp==NULL) {
 		return NULL;
 	}
 
 	lp->lp_swapaddr = INVALID_SWAPADDR;
+	lp->lp_swaphint = INVALID_SWAPADDR;
 	lp->lp_paddr = INVALID_PADDR;
-	spinlock_init(&lp->lp_spinlock);
+	lp->lp_seq = 0;
+	lp->lp_refcount = 1;
+	lp->lp_vnode = NULL;
+	lp->lp_fileoff = 0;
+	lp->lp_fileskip = 0;
+	lp->lp_filelen = 0;
+	lp->lp_mapshared = false;
+
+	return lp;
+}
+
+/*
+ * Create a logical page object whose contents are LEN bytes of the
+ * file VN from OFFSET, starting SKIP bytes into the page. It's not
+ * resident; the first fault reads it in (see lpage_pagein). Like a
+ * zerofill page, it uses the swap reservation its vm_object made.
+ * LEN may be 0 for a page of a shared mapping that is past the end
+ * of the file; it's just zero-filled.
+ * Synchronization: none.
+ */
+struct lpage *
+lpage_create_file(struct vnode *vn, off_t offset, unsigned skip, unsigned len)
+{
+	struct lpage *lp;
+
+	KASSERT(vn != NULL);
+	KASSERT(skip + len <= PAGE_SIZE);
+
+	lp = lpage_create();
+	if (lp == NULL) {
+		return NULL;
+	}
+	lp->lp_vnode = vn;
+	lp->lp_fileoff = offset;
+	lp->lp_fileskip = skip;
+	lp->lp_filelen = len;
 
 	return lp;
 }
@@ -102,8 +197,12 @@ lpage_create(void)
  * page if it's resident, so it might be pinned. So lock and pin
  * together.
  *
- * We assume that lpages are not shared between address spaces and
- * address spaces are not shared between threads.
+ * If the lpage is shared (copy-on-write) this only drops a reference.
+ * The departing vm_object was holding a swap reservation for the slot,
+ * not the swap page itself, so give the reservation back. Likewise an
+ * lpage that never got a swap page is still holding its reservation.
+ *
+ * We assume that address spaces are not shared between threads.
  */
 void 					
 lpage_destroy(struct lpage *lp)
@@ -112,15 +211,24 @@ lpage_destroy(struct lpage *lp)
 
 	KASSERT(lp != NULL);
 
+	lpage_lock(lp);
+	KASSERT(lp->lp_refcount > 0);
+	if (lp->lp_refcount > 1) {
+		lp->lp_refcount--;
+		lpage_unlock(lp);
+		swap_unreserve(1);
+		return;
+	}
+	lpage_unlock(lp);
+
 	lpage_lock_and_pin(lp);
 
 	pa = lp->lp_paddr & PAGE_FRAME;
 	if (pa != INVALID_PADDR) {
 		DEBUG(DB_VM, "lpage_destroy: freeing paddr 0x%x\n", pa);
-		lp->lp_paddr = INVALID_PADDR;
+		LP_SETPADDR(lp, INVALID_PADDR);
 		lpage_unlock(lp);
-		coremap_free(pa, false /* iskern */);
-		coremap_unpin(pa);
+		coremap_freeuser(pa);
 	}
 	else {
 		lpage_unlock(lp);
@@ -131,9 +239,11 @@ lpage_destroy(struct lpage *lp)
 		      lp->lp_swapaddr);
 		swap_free(lp->lp_swapaddr);
 	}
+	else {
+		swap_unreserve(1);
+	}
 
-	spinlock_cleanup(&lp->lp_spinlock);
-	kfree(lp);
+	kmem_cache_free(&lpage_cache, lp);
 }
 
 
@@ -185,6 +295,10 @@ lpage_unlock(struct lpage *lp)
  * However, if you've got the other lpage locked *and* its physical
  * page pinned, that can't happen, so it's safe to lock and pin
  * multiple pages.
+ *
+ * A shared (copy-on-write) lpage can be paged in by another process
+ * while we have it unlocked, so a page that was paged out on us may
+ * be back by the time we relock. Just go around again.
  */
 void
 lpage_lock_and_pin(struct lpage *lp)
@@ -210,62 +324,56 @@ lpage_lock_and_pin(struct lpage *lp)
 		if (pinned != INVALID_PADDR) {
 			coremap_unpin(pinned);
 		}
-		/*
-		 * If what we just got out of the lpage is *now*
-		 * invalid, because the page was paged out on us,
-		 * we're done. The page can't be paged in again behind
-		 * our back, so assert it hasn't after regrabbing the
-		 * lpage lock.
-		 */
-		if (pa == INVALID_PADDR) {
-			lpage_lock(lp);
-			KASSERT((lp->lp_paddr & PAGE_FRAME) == INVALID_PADDR);
-			break;
+		pinned = INVALID_PADDR;
+		/* Pin what we got (if anything) and try again. */
+		if (pa != INVALID_PADDR) {
+			coremap_pin(pa);
+			pinned = pa;
 		}
-		/* Pin what we got and try again. */
-		coremap_pin(pa);
-		pinned = pa;
 		lpage_lock(lp);
 	}
 }
 
 /*
- * lpage_materialize: create a new lpage and allocate swap and RAM for it.
+ * lpage_materialize: create a new lpage and allocate RAM for it.
  * Do not do anything with the page contents though.
  *
- * Returns the lpage locked and the physical page pinned.
+ * No swap page is allocated here; the lpage inherits the swap
+ * reservation its vm_object made for the slot, and lpage_getswap
+ * turns that into a real swap page the first time the page needs to
+ * be written out. Most zero-filled stack and heap pages never are.
+ *
+ * Returns the lpage locked and the physical page pinned. If ZEROED,
+ * the page is all zeros; otherwise its contents are garbage.
  */
 
 static
 int
-lpage_materialize(struct lpage **lpret, paddr_t *paret)
+lpage_materialize(struct lpage **lpret, paddr_t *paret, bool zeroed)
 {
 	struct lpage *lp;
 	paddr_t pa;
-	off_t swa;
 
 	lp = lpage_create();
 	if (lp == NULL) {
 		return ENOMEM;
 	}
 
-	swa = swap_alloc();
-	if (swa == INVALID_SWAPADDR) {
-		lpage_destroy(lp);
-		return ENOSPC;
+	if (zeroed) {
+		pa = coremap_allocuser_zeroed(lp);
+	}
+	else {
+		pa = coremap_allocuser(lp);
 	}
-	lp->lp_swapaddr = swa;
-
-	pa = coremap_allocuser(lp);
 	if (pa == INVALID_PADDR) {
-		/* lpage_destroy will clean up the swap */
+		/* lpage_destroy will give back the reservation */
 		lpage_destroy(lp);
 		return ENOSPC;
 	}
 
 	lpage_lock(lp);
 
-	lp->lp_paddr = pa | LPF_DIRTY;
+	LP_SETPADDR(lp, pa | LPF_DIRTY);
 
 	KASSERT(coremap_pageispinned(pa));
 
@@ -274,6 +382,166 @@ lpage_materialize(struct lpage **lpret, paddr_t *paret)
 	return 0;
 }
 
+/*
+ * lpage_filein: read the file data of a file-backed lpage into the
+ * physical page PA, which the caller has pinned, and zero the rest.
+ *
+ * Synchronization: the file fields of an lpage don't change. The
+ * caller must hold vfs_biglock, taken before PA was pinned (see
+ * lpage_pagein), and no spinlocks. Sleeps for the I/O.
+ */
+static
+int
+lpage_filein(struct lpage *lp, paddr_t pa)
+{
+	struct iovec iov;
+	struct uio ku;
+	char *kva;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(coremap_pageispinned(pa));
+
+	if (lp->lp_filelen < PAGE_SIZE) {
+		coremap_zero_page(pa);
+	}
+
+	kva = (char *)PADDR_TO_KVADDR(pa);
+	uio_kinit(&iov, &ku, kva + lp->lp_fileskip, lp->lp_filelen,
+		  lp->lp_fileoff, UIO_READ);
+	result = VOP_READ(lp->lp_vnode, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		/* the file got shorter under us */
+		kprintf("vm: short read paging in from file\n");
+		return EIO;
+	}
+	return 0;
+}
+
+/*
+ * lpage_pagein: bring a non-resident lpage back in from swap.
+ *
+ * Called with the lpage locked and (having come from
+ * lpage_lock_and_pin) not resident. Returns with the lpage locked and
+ * its physical page pinned, or on error with the lpage unlocked.
+ *
+ * The lpage is pointed at its new physical page *before* the read is
+ * started, and the page stays pinned until the caller is done with it.
+ * That is the page's "in transit" state: anyone else who wants the
+ * lpage meanwhile (a copy-on-write sharer, or someone trying to
+ * destroy it) finds it resident and sleeps in coremap_pin until the
+ * I/O completes, instead of starting a second read. Since nothing
+ * else is held across the I/O, pageins of different pages can run
+ * at the same time.
+ *
+ * If someone else got the page in while we were allocating memory
+ * (again, only possible with sharing) we give ours back and use theirs.
+ *
+ * A file-backed page that has never been written to swap is read from
+ * its file instead, and comes in clean. If that read fails the page is
+ * put back out and the error returned. A page of a shared file mapping
+ * that comes from swap is newer than the file, so it comes in dirty.
+ *
+ * File I/O needs vfs_biglock, and vfs_biglock must be taken before
+ * pinning a page: a thread inside the file system holding vfs_biglock
+ * can fault on a page (copying to or from a user buffer) and wait for
+ * its pin. So take it before allocating the frame, and keep it until
+ * the read is done. (The swap file is a raw device and doesn't use
+ * vfs_biglock.)
+ */
+static
+int
+lpage_pagein(struct lpage *lp, paddr_t *paret)
+{
+	paddr_t pa;
+	off_t swa;
+	bool filein;
+	int result;
+
+	KASSERT(spinlock_do_i_hold(&lp->lp_spinlock));
+
+	while (1) {
+		pa = lp->lp_paddr & PAGE_FRAME;
+		if (pa != INVALID_PADDR) {
+			/* someone else paged it in; lock_and_pin pinned it */
+			KASSERT(coremap_pageispinned(pa));
+			break;
+		}
+
+		/* a non-resident page's swap address doesn't change */
+		filein = lp->lp_swapaddr == INVALID_SWAPADDR;
+		lpage_unlock(lp);
+
+		if (filein) {
+			vfs_biglock_acquire();
+		}
+		pa = coremap_allocuser(lp);
+		if (pa == INVALID_PADDR) {
+			if (filein) {
+				vfs_biglock_release();
+			}
+			return ENOMEM;
+		}
+		KASSERT(coremap_pageispinned(pa));
+
+		lpage_lock(lp);
+		if ((lp->lp_paddr & PAGE_FRAME) != INVALID_PADDR) {
+			/* A sharer beat us to it. */
+			KASSERT(lp->lp_refcount > 1);
+			lpage_unlock(lp);
+			coremap_freeuser(pa);
+			if (filein) {
+				vfs_biglock_release();
+			}
+			lpage_lock_and_pin(lp);
+			continue;
+		}
+
+		swa = lp->lp_swapaddr;
+		KASSERT(filein == (swa == INVALID_SWAPADDR));
+		KASSERT(swa != INVALID_SWAPADDR || lp->lp_vnode != NULL);
+		LP_SETPADDR(lp, pa);
+		lpage_unlock(lp);
+
+		if (!filein) {
+			swap_pagein(pa, swa);
+		}
+		else {
+			result = lpage_filein(lp, pa);
+			vfs_biglock_release();
+			if (result) {
+				lpage_lock(lp);
+				KASSERT((lp->lp_paddr & PAGE_FRAME) == pa);
+				LP_SETPADDR(lp, INVALID_PADDR);
+				lpage_unlock(lp);
+				coremap_freeuser(pa);
+				return result;
+			}
+		}
+
+		spinlock_acquire(&stats_spinlock);
+		ct_majfaults++;
+		if (filein) {
+			ct_filereads++;
+		}
+		spinlock_release(&stats_spinlock);
+
+		lpage_lock(lp);
+		KASSERT((lp->lp_paddr & PAGE_FRAME) == pa);
+		if (!filein && LP_ISFILESHARED(lp)) {
+			/* the file hasn't seen this data yet */
+			LP_SET(lp, LPF_DIRTY);
+		}
+		break;
+	}
+
+	*paret = pa;
+	return 0;
+}
+
 /*
  * lpage_copy: create a new lpage and copy data from another lpage.
  *
@@ -282,16 +550,12 @@ lpage_materialize(struct lpage **lpret, paddr_t *paret)
  *
  *      1. Create newlp.
  *      2. Materialize a page for newlp, so it's locked and pinned.
- *      3. Lock and pin oldlp.
- *      4. Extract the physical address and swap address.
- *      5. If oldlp wasn't present,
- *      5a.    Unlock oldlp.
- *      5b.    Page in.
- *      5c.    This pins the page in the coremap.
- *      5d.    Leave the page pinned and relock oldlp.
- *      5e.    Assert nobody else paged the page in.
+ *      3. Unlock newlp; nobody else knows about it yet.
+ *      4. Lock and pin oldlp.
+ *      5. If oldlp wasn't present, page it in (see lpage_pagein),
+ *         which leaves it locked and pinned.
  *      6. Copy.
- *      7. Unlock the lpages first, so we can enter the coremap.
+ *      7. Unlock the lpage first, so we can enter the coremap.
  *      8. Unpin the physical pages.
  *      
  */
@@ -300,46 +564,31 @@ lpage_copy(struct lpage *oldlp, struct lpage **lpret)
 {
 	struct lpage *newlp;
 	paddr_t newpa, oldpa;
-	off_t swa;
 	int result;
 
-	result = lpage_materialize(&newlp, &newpa);
+	result = lpage_materialize(&newlp, &newpa, false);
 	if (result) {
 		return result;
 	}
 	KASSERT(coremap_pageispinned(newpa));
 
+	/*
+	 * Don't hold newlp locked: we may sleep below. It's pinned,
+	 * which is all it needs.
+	 */
+	lpage_unlock(newlp);
+
 	/* Pin the physical page and lock the lpage. */
 	lpage_lock_and_pin(oldlp);
 	oldpa = oldlp->lp_paddr & PAGE_FRAME;
 
-	/*
-	 * If there is no physical page, we allocate one, which pins
-	 * it, and then (re)lock the lpage. Since we are single-
-	 * threaded (if we weren't, we'd hold the address space lock
-	 * to exclude sibling threads) nobody else should have paged
-	 * the page in behind our back.
-	 */
 	if (oldpa == INVALID_PADDR) {
-		/*
-		 * XXX this is mostly copied from lpage_fault
-		 */
-		swa = oldlp->lp_swapaddr;
-		lpage_unlock(oldlp);
-		oldpa = coremap_allocuser(oldlp);
-		if (oldpa == INVALID_PADDR) {
-			coremap_unpin(newlp->lp_paddr & PAGE_FRAME);
+		result = lpage_pagein(oldlp, &oldpa);
+		if (result) {
+			coremap_unpin(newpa);
 			lpage_destroy(newlp);
-			return ENOMEM;
+			return result;
 		}
-		KASSERT(coremap_pageispinned(oldpa));
-		lock_acquire(global_paging_lock);
-		swap_pagein(oldpa, swa);
-		lpage_lock(oldlp);
-		lock_release(global_paging_lock);
-		/* Assert nobody else did the pagein. */
-		KASSERT((oldlp->lp_paddr & PAGE_FRAME) == INVALID_PADDR);
-		oldlp->lp_paddr = oldpa;
 	}
 
 	KASSERT(coremap_pageispinned(oldpa));
@@ -349,11 +598,92 @@ lpage_copy(struct lpage *oldlp, struct lpage **lpret)
 	KASSERT(LP_ISDIRTY(newlp));
 
 	lpage_unlock(oldlp);
-	lpage_unlock(newlp);
 
 	coremap_unpin(newpa);
 	coremap_unpin(oldpa);
 
+	spinlock_acquire(&stats_spinlock);
+	ct_copies++;
+	spinlock_release(&stats_spinlock);
+
+	*lpret = newlp;
+	return 0;
+}
+
+/*
+ * lpage_share: add a reference to an lpage, so it can be placed in
+ * another vm_object (copy-on-write fork). The new holder's vm_object
+ * keeps the swap reservation it made for the slot; see lpage_destroy.
+ *
+ * The caller is responsible for getting rid of any writable mappings
+ * of the page; once shared, lpage_fault only maps it read-only.
+ */
+void
+lpage_share(struct lpage *lp)
+{
+	lpage_lock(lp);
+	KASSERT(lp->lp_refcount > 0);
+	lp->lp_refcount++;
+	lpage_unlock(lp);
+
+	spinlock_acquire(&stats_spinlock);
+	ct_shares++;
+	spinlock_release(&stats_spinlock);
+}
+
+/*
+ * lpage_isshared: returns true if the lpage has more than one holder
+ * and is shared copy-on-write, that is, isn't a MAP_SHARED page.
+ *
+ * Synchronization: the answer can go from true to false behind the
+ * caller's back (if the other holders go away) but not the reverse,
+ * because only the caller's own address space can share it further.
+ */
+int
+lpage_isshared(struct lpage *lp)
+{
+	int rv;
+
+	lpage_lock(lp);
+	rv = lp->lp_refcount > 1 && !lp->lp_mapshared;
+	lpage_unlock(lp);
+	return rv;
+}
+
+/*
+ * lpage_unshare: make a private copy of a shared lpage for the caller
+ * and drop the caller's reference to the shared one. Called on the
+ * first write to a copy-on-write page.
+ *
+ * The copy needs a swap reservation of its own. Since the other
+ * holders may go away while we're copying, which would leave us
+ * holding the shared page's swap page rather than a reservation,
+ * reserve one more page up front and let lpage_destroy settle the
+ * accounting for the old lpage.
+ */
+int
+lpage_unshare(struct lpage *lp, struct lpage **lpret)
+{
+	struct lpage *newlp;
+	int result;
+
+	result = swap_reserve(1);
+	if (result) {
+		return result;
+	}
+
+	result = lpage_copy(lp, &newlp);
+	if (result) {
+		swap_unreserve(1);
+		return result;
+	}
+
+	lpage_destroy(lp);
+
+	spinlock_acquire(&stats_spinlock);
+	ct_cowcopies++;
+	spinlock_release(&stats_spinlock);
+
 	*lpret = newlp;
 	return 0;
 }
@@ -377,7 +707,7 @@ lpage_zerofill(struct lpage **lpret)
 	paddr_t pa;
 	int result;
 
-	result = lpage_materialize(&lp, &pa);
+	result = lpage_materialize(&lp, &pa, true);
 	if (result) {
 		return result;
 	}
@@ -387,8 +717,6 @@ lpage_zerofill(struct lpage **lpret)
 	/* Don't actually need the lpage locked. */
 	lpage_unlock(lp);
 
-	coremap_zero_page(pa);
-
 	KASSERT(coremap_pageispinned(pa));
 	coremap_unpin(pa);
 
@@ -400,27 +728,112 @@ lpage_zerofill(struct lpage **lpret)
 	return 0;
 }
 
+/*
+ * lpage_fastfault - try to handle a fault on LP without locking it or
+ * pinning its physical page. This is the common case of a TLB miss on
+ * a page that's in memory and only needs its mapping reloaded. Returns
+ * true if that's been done, or false to have the caller use
+ * lpage_fault.
+ *
+ * Only faults that leave the lpage alone can be handled here: reads,
+ * and writes to a page that is dirty already and can be written in
+ * place. The mapping is made the way lpage_fault would make it;
+ * CANWRITE is false if the region is read-only.
+ *
+ * Synchronization: none of our own. We note lp_seq and then read
+ * lp_paddr, and mmu_map_fast checks, with coremap_spinlock held, that
+ * lp_seq hasn't moved since (so what we read is current) and that the
+ * page isn't pinned (so it isn't in transit, or being cleaned or
+ * evicted) before loading the TLB. Anyone who wants to do something
+ * to the page afterwards has to pin it and take it out of the TLB
+ * first, as usual. Both fields are volatile, so the reads happen in
+ * order.
+ */
+bool
+lpage_fastfault(struct lpage *lp, struct addrspace *as, int faulttype,
+		vaddr_t va, bool canwrite)
+{
+	unsigned seq;
+	paddr_t pa;
+	int writable;
+
+	seq = lp->lp_seq;
+	pa = lp->lp_paddr;
+	if ((pa & PAGE_FRAME) == INVALID_PADDR) {
+		return false;
+	}
+
+	writable = canwrite && (pa & LPF_DIRTY) &&
+		(lp->lp_refcount == 1 || lp->lp_mapshared);
+	if (faulttype != VM_FAULT_READ && !writable) {
+		/* needs to be marked dirty, or copied */
+		return false;
+	}
+
+	return mmu_map_fast(as, va, pa & PAGE_FRAME, writable, lp, seq,
+			    false);
+}
+
+/*
+ * lpage_prefault - map LP at VA, if it's resident, before anyone
+ * faults on it (see vm_object_faultaround). It's mapped as for a
+ * read fault, in a region that's writable if CANWRITE. If it isn't
+ * resident or anything is going on with it, forget it; it'll be
+ * handled when it's really touched.
+ *
+ * Synchronization: as for lpage_fastfault.
+ */
+void
+lpage_prefault(struct lpage *lp, struct addrspace *as, vaddr_t va,
+	       bool canwrite)
+{
+	unsigned seq;
+	paddr_t pa;
+	int writable;
+
+	seq = lp->lp_seq;
+	pa = lp->lp_paddr;
+	if ((pa & PAGE_FRAME) == INVALID_PADDR) {
+		return;
+	}
+
+	writable = canwrite && (pa & LPF_DIRTY) &&
+		(lp->lp_refcount == 1 || lp->lp_mapshared);
+	(void)mmu_map_fast(as, va, pa & PAGE_FRAME, writable, lp, seq, true);
+}
+
 /*
  * lpage_fault - handle a fault on a specific lpage. If the page is
  * not resident, get a physical page from coremap and swap it in.
  * 
- * You do not yet need to distinguish a readonly fault from a write
- * fault. When we implement sharing, there will be a difference.
+ * Pages are only marked dirty on write faults; a clean page is mapped
+ * read-only so that we find out when it gets written. Pages of
+ * read-only regions (CANWRITE false) are always mapped read-only;
+ * as_fault doesn't let write faults on them through.
+ *
+ * A shared (copy-on-write) lpage is mapped read-only. Write faults on
+ * shared pages are turned into copies by as_fault before we get here,
+ * so VM_FAULT_READONLY only happens once the other holders are gone.
+ * MAP_SHARED pages are written in place no matter who else has them.
  *
  * Synchronization: Lock the lpage while checking if it's in memory. 
- * If it's not, unlock the page while allocting space and loading the
- * page in. This only works because lpages are not currently sharable.
- * The page should be locked again as soon as it is loaded, but be 
- * careful of interactions with other locks while modifying the coremap.
+ * If it's not, lpage_pagein unlocks it while allocating space and
+ * loading the page in, and marks the page in transit meanwhile.
  *
  * After it has been loaded, the page must be pinned so that it is not
  * evicted while changes are made to the TLB. It can be unpinned as soon
  * as the TLB is updated. 
+ *
+ * COUNTED is true if the caller has already counted this fault (it
+ * was paged in by lpage_readahead); otherwise a fault on a resident
+ * page counts as a minor fault.
  */
 int
-lpage_fault(struct lpage *lp, struct addrspace *as, int faulttype, vaddr_t va)
+lpage_fault(struct lpage *lp, struct addrspace *as, int faulttype, vaddr_t va,
+	    bool canwrite, bool counted)
 {
-	paddr_t pa, swa;
+	paddr_t pa;
+	int result;
 
 	/* Pin the physical page and lock the lpage. */
 	lpage_lock_and_pin(lp);
@@ -429,36 +842,42 @@ lpage_fault(struct lpage *lp, struct addrspace *as, int faulttype, vaddr_t va)
 
 	// If the page is not in memeory, get it from swap
 	if (pa == INVALID_PADDR) {
-			swa = lp->lp_swapaddr;
-			lpage_unlock(lp);
-			// Have a page frame allocated
-			pa = coremap_allocuser(lp);
-			if (pa == INVALID_PADDR) {
-				coremap_unpin(lp->lp_paddr & PAGE_FRAME);
-				lpage_destroy(lp);
-				return ENOMEM;
-			}
-			KASSERT(coremap_pageispinned(pa));
-			lock_acquire(global_paging_lock);
-			// Add page contents from swap to physical memory
-			swap_pagein(pa, swa);
-			lpage_lock(lp);
-			lock_release(global_paging_lock);
-			/* Assert nobody else did the pagein. */
-			KASSERT((lp->lp_paddr & PAGE_FRAME) == INVALID_PADDR);
-			lp->lp_paddr = pa;
+		result = lpage_pagein(lp, &pa);
+		if (result) {
+			return result;
+		}
+	}
+	else if (!counted) {
+		spinlock_acquire(&stats_spinlock);
+		ct_minfaults++;
+		spinlock_release(&stats_spinlock);
 	}
 
 	//Update TLB
 	switch (faulttype){
-	case VM_FAULT_READONLY:
-		mmu_map(as, va, pa, 0);
-		break;
 	case VM_FAULT_READ:
+		if (!canwrite ||
+		    (lp->lp_refcount > 1 && !lp->lp_mapshared) ||
+		    !LP_ISDIRTY(lp)) {
+			/*
+			 * Shared or clean: map read-only, so that the
+			 * first write faults again and we can copy it
+			 * or mark it dirty. Otherwise the pageout
+			 * thread's work would be undone by every read.
+			 */
+			mmu_map(as, va, pa, 0);
+			break;
+		}
+		mmu_map(as, va, pa, 1);
+		break;
+	case VM_FAULT_READONLY:
 	case VM_FAULT_WRITE:
+		KASSERT(canwrite);
+		KASSERT(lp->lp_refcount == 1 || lp->lp_mapshared);
 		// Set it to dirty
 		LP_SET(lp, LPF_DIRTY);
 		mmu_map(as, va, pa, 1);
+		break;
 	}
 
 	// Already unpinned in mmu_map
@@ -468,12 +887,53 @@ lpage_fault(struct lpage *lp, struct addrspace *as, int faulttype, vaddr_t va)
 }
 
 
+/*
+ * lpage_getswap: return the swap page for a resident lpage that's
+ * about to be written out, allocating it if this is the first time.
+ * The allocation uses up the reservation the lpage has been holding.
+ *
+ * Synchronization: called with the lpage locked and its physical page
+ * pinned; returns the same way. The lpage is unlocked while we go to
+ * the swap allocator, which sleeps; the pin keeps anyone else from
+ * evicting, cleaning, or destroying the page meanwhile, so nobody else
+ * can be allocating for it at the same time.
+ */
+static
+off_t
+lpage_getswap(struct lpage *lp)
+{
+	off_t swa, hint;
+
+	KASSERT(spinlock_do_i_hold(&lp->lp_spinlock));
+	KASSERT(coremap_pageispinned(lp->lp_paddr & PAGE_FRAME));
+
+	swa = lp->lp_swapaddr;
+	if (swa != INVALID_SWAPADDR) {
+		return swa;
+	}
+
+	hint = lp->lp_swaphint;
+	lpage_unlock(lp);
+	swa = swap_alloc(hint);
+	lpage_lock(lp);
+
+	KASSERT(lp->lp_swapaddr == INVALID_SWAPADDR);
+	lp->lp_swapaddr = swa;
+
+	spinlock_acquire(&stats_spinlock);
+	ct_swapassigns++;
+	spinlock_release(&stats_spinlock);
+
+	return swa;
+}
+
 /*
  * lpage_evict: Evict an lpage from physical memory.
  *
  * Synchronization: lock the lpage while accessing it. We come here
- * from the coremap and should have the global paging lock and should 
- * have pinned the physical page (see coremap.c:do_evict()). 
+ * from the coremap and should have pinned the physical page (see
+ * coremap.c:do_evict()), which keeps everyone else off it until we're
+ * done. 
  * This is why we must not hold lpage locks while entering the coremap code.
  *
  * Similar to lpage_fault, the lpage lock should not be held while performing
@@ -485,6 +945,7 @@ lpage_evict(struct lpage *lp)
 
 	paddr_t physical_address;
 	off_t swap_address;
+	bool wrote = false;
 
 	// Lock the lpage while accessing it.
 	KASSERT(lp != NULL);
@@ -501,19 +962,434 @@ lpage_evict(struct lpage *lp)
 		// If page is dirty..
 		if (LP_ISDIRTY(lp)) {
 			// Move page into swapspace.
+			swap_address = lpage_getswap(lp);
 			lpage_unlock(lp);
 			swap_pageout(physical_address, swap_address);
-		  	LP_CLEAR(lp, LPF_DIRTY);
 		  	lpage_lock(lp);
+		  	LP_CLEAR(lp, LPF_DIRTY);
+			wrote = true;
+		}
+		else {
+			/*
+			 * Clean: there's a copy in swap, or it's an
+			 * untouched page of an executable, or a shared
+			 * file page the file is up to date with, that
+			 * can be read from the file again.
+			 */
+			KASSERT(lp->lp_swapaddr != INVALID_SWAPADDR ||
+				lp->lp_vnode != NULL);
 		}
 
 		// Remove page from physical memory.
-		lp->lp_paddr = INVALID_PADDR;
+		LP_SETPADDR(lp, INVALID_PADDR);
 		lpage_unlock(lp);
 
+		spinlock_acquire(&stats_spinlock);
+		if (wrote) {
+			ct_write_evictions++;
+		}
+		else {
+			ct_discard_evictions++;
+		}
+		spinlock_release(&stats_spinlock);
 	}
 	else {
 		lpage_unlock(lp);
 	}
 
 }
+
+/*
+ * lpage_fileout: write the file data of a shared file page, whose
+ * physical page PA the caller has pinned, back to the file. The
+ * caller must hold vfs_biglock (see lpage_pagein).
+ *
+ * Synchronization: none needed for the file fields. Sleeps for the
+ * I/O, so the lpage must not be locked.
+ */
+static
+int
+lpage_fileout(struct lpage *lp, paddr_t pa)
+{
+	struct iovec iov;
+	struct uio ku;
+	char *kva;
+	int result;
+
+	KASSERT(coremap_pageispinned(pa));
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (lp->lp_filelen == 0) {
+		/* past the end of the file */
+		return 0;
+	}
+
+	kva = (char *)PADDR_TO_KVADDR(pa);
+	uio_kinit(&iov, &ku, kva + lp->lp_fileskip, lp->lp_filelen,
+		  lp->lp_fileoff, UIO_WRITE);
+	result = VOP_WRITE(lp->lp_vnode, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		kprintf("vm: short write paging out to file\n");
+		return EIO;
+	}
+	return 0;
+}
+
+/*
+ * lpage_fileclean: clean a dirty shared file page by writing it back
+ * to its file. Any swap page it has is given back (keeping the
+ * reservation), since from now on it can be read from the file. If
+ * the write fails the page stays dirty.
+ *
+ * Synchronization: called with the lpage locked, resident at PA, and
+ * pinned, and with vfs_biglock held; returns with the lpage unlocked.
+ * As in lpage_clean the caller has made sure the page isn't in any
+ * TLB.
+ */
+static
+int
+lpage_fileclean(struct lpage *lp, paddr_t pa)
+{
+	off_t swa;
+	int result;
+
+	KASSERT(spinlock_do_i_hold(&lp->lp_spinlock));
+	KASSERT(LP_ISFILESHARED(lp));
+	KASSERT((lp->lp_paddr & PAGE_FRAME) == pa);
+
+	lpage_unlock(lp);
+	result = lpage_fileout(lp, pa);
+	if (result) {
+		return result;
+	}
+
+	lpage_lock(lp);
+	KASSERT((lp->lp_paddr & PAGE_FRAME) == pa);
+	LP_CLEAR(lp, LPF_DIRTY);
+	swa = lp->lp_swapaddr;
+	lp->lp_swapaddr = INVALID_SWAPADDR;
+	lpage_unlock(lp);
+
+	if (swa != INVALID_SWAPADDR) {
+		swap_release(swa);
+	}
+
+	spinlock_acquire(&stats_spinlock);
+	ct_filewrites++;
+	spinlock_release(&stats_spinlock);
+
+	return 0;
+}
+
+/*
+ * lpage_clean: write a dirty lpage to swap but leave it in memory.
+ * This is what the pageout thread does so that eviction can later
+ * just discard the page. A shared file page is written back to its
+ * file instead; for that the caller must hold vfs_biglock.
+ *
+ * Synchronization: as for lpage_evict. The caller has pinned the
+ * physical page and made sure it isn't in any TLB, so nobody can write
+ * to it without first faulting (and waiting for the pin) and marking
+ * it dirty again.
+ */
+void
+lpage_clean(struct lpage *lp)
+{
+	paddr_t pa;
+	off_t swa;
+	int result;
+
+	KASSERT(lp != NULL);
+	lpage_lock(lp);
+
+	pa = lp->lp_paddr & PAGE_FRAME;
+	if (pa == INVALID_PADDR || !LP_ISDIRTY(lp)) {
+		lpage_unlock(lp);
+		return;
+	}
+	KASSERT(coremap_pageispinned(pa));
+
+	if (LP_ISFILESHARED(lp)) {
+		result = lpage_fileclean(lp, pa);
+		if (result) {
+			kprintf("vm: writing back to file: %s\n",
+				strerror(result));
+			return;
+		}
+		spinlock_acquire(&stats_spinlock);
+		ct_precleans++;
+		spinlock_release(&stats_spinlock);
+		return;
+	}
+
+	swa = lpage_getswap(lp);
+	lpage_unlock(lp);
+
+	swap_pageout(pa, swa);
+
+	lpage_lock(lp);
+	KASSERT((lp->lp_paddr & PAGE_FRAME) == pa);
+	LP_CLEAR(lp, LPF_DIRTY);
+	lpage_unlock(lp);
+
+	spinlock_acquire(&stats_spinlock);
+	ct_precleans++;
+	spinlock_release(&stats_spinlock);
+}
+
+/*
+ * lpage_clean_cluster: like lpage_clean, for up to SWAP_CLUSTER pages
+ * at once. The pages get consecutive swap pages and are written with
+ * a single transfer. Pages that already had a swap page give it up
+ * for one in the new run; the old copy is stale anyway since the page
+ * is dirty.
+ *
+ * If there's only one page left to write, or no free run in swap long
+ * enough, fall back to cleaning the pages one at a time.
+ *
+ * Synchronization: as for lpage_clean; the caller has pinned all the
+ * physical pages (PAS) and made sure none of them is in a TLB.
+ */
+void
+lpage_clean_cluster(struct lpage **lps, const paddr_t *pas, unsigned n)
+{
+	struct lpage *todo[SWAP_CLUSTER];
+	paddr_t todopa[SWAP_CLUSTER];
+	off_t swa, oldswa, hint;
+	unsigned i, m;
+
+	KASSERT(n <= SWAP_CLUSTER);
+
+	/* Weed out anything that's no longer resident and dirty. */
+	m = 0;
+	for (i=0; i<n; i++) {
+		KASSERT(coremap_pageispinned(pas[i]));
+		/* these go to their files, one at a time */
+		KASSERT(!LP_ISFILESHARED(lps[i]));
+		lpage_lock(lps[i]);
+		if ((lps[i]->lp_paddr & PAGE_FRAME) == pas[i] &&
+		    LP_ISDIRTY(lps[i])) {
+			todo[m] = lps[i];
+			todopa[m] = pas[i];
+			m++;
+		}
+		lpage_unlock(lps[i]);
+	}
+
+	if (m < 2) {
+		for (i=0; i<m; i++) {
+			lpage_clean(todo[i]);
+		}
+		return;
+	}
+
+	/* Trade any existing swap pages back in for reservations. */
+	hint = INVALID_SWAPADDR;
+	for (i=0; i<m; i++) {
+		lpage_lock(todo[i]);
+		if (i == 0) {
+			hint = todo[i]->lp_swaphint;
+		}
+		oldswa = todo[i]->lp_swapaddr;
+		todo[i]->lp_swapaddr = INVALID_SWAPADDR;
+		lpage_unlock(todo[i]);
+		if (oldswa != INVALID_SWAPADDR) {
+			swap_release(oldswa);
+		}
+	}
+
+	swa = swap_alloc_run(m, hint);
+	if (swa == INVALID_SWAPADDR) {
+		for (i=0; i<m; i++) {
+			lpage_clean(todo[i]);
+		}
+		return;
+	}
+
+	for (i=0; i<m; i++) {
+		lpage_lock(todo[i]);
+		KASSERT(todo[i]->lp_swapaddr == INVALID_SWAPADDR);
+		todo[i]->lp_swapaddr = swa + i*PAGE_SIZE;
+		lpage_unlock(todo[i]);
+	}
+
+	swap_pageout_cluster(todopa, m, swa);
+
+	for (i=0; i<m; i++) {
+		lpage_lock(todo[i]);
+		KASSERT((todo[i]->lp_paddr & PAGE_FRAME) == todopa[i]);
+		LP_CLEAR(todo[i], LPF_DIRTY);
+		lpage_unlock(todo[i]);
+	}
+
+	spinlock_acquire(&stats_spinlock);
+	ct_precleans += m;
+	ct_swapassigns += m;
+	spinlock_release(&stats_spinlock);
+}
+
+/*
+ * lpage_readahead: if LP isn't resident, page it in, and along with it
+ * as many of NEXT[0..NNEXT-1] (the lpages following it in its
+ * vm_object) as are also out and sit in the swap pages right after
+ * LP's, all in one transfer. The pages are left resident, clean, and
+ * unmapped; the caller goes on to lpage_fault, which then finds LP in
+ * memory. If anything changes under us we just do less; lpage_fault
+ * will take care of LP regardless.
+ *
+ * Returns true if LP was paged in here. That counts as the fault's
+ * major fault, and the caller passes it on to lpage_fault so the
+ * fault isn't also counted as a minor one.
+ *
+ * Synchronization: the neighbours are first checked without pinning
+ * anything, which is only advisory. Then each page is allocated a
+ * frame (returned pinned) and rechecked under its lock; a page that
+ * is still out gets pointed at its frame, which puts it in transit as
+ * in lpage_pagein, and the run stops at the first one that isn't.
+ * The frames are unpinned once the data is in.
+ */
+bool
+lpage_readahead(struct lpage *lp, struct lpage **next, unsigned nnext)
+{
+	struct lpage *run[SWAP_CLUSTER];
+	paddr_t pas[SWAP_CLUSTER];
+	off_t swa;
+	unsigned i, n, m;
+	bool ok;
+
+	lpage_lock(lp);
+	swa = lp->lp_swapaddr;
+	ok = (lp->lp_paddr & PAGE_FRAME) == INVALID_PADDR;
+	lpage_unlock(lp);
+	if (!ok || swa == INVALID_SWAPADDR) {
+		/* resident, or comes from its file; lpage_fault does it */
+		return false;
+	}
+
+	run[0] = lp;
+	n = 1;
+	for (i=0; i<nnext && n<SWAP_CLUSTER; i++) {
+		if (next[i] == NULL) {
+			break;
+		}
+		lpage_lock(next[i]);
+		ok = (next[i]->lp_paddr & PAGE_FRAME) == INVALID_PADDR &&
+			next[i]->lp_swapaddr == swa + n*PAGE_SIZE;
+		lpage_unlock(next[i]);
+		if (!ok) {
+			break;
+		}
+		run[n++] = next[i];
+	}
+	if (n == 1) {
+		/* nothing to read ahead; let lpage_fault do it */
+		return false;
+	}
+
+	/* Claim the pages. */
+	for (m=0; m<n; m++) {
+		pas[m] = coremap_allocuser(run[m]);
+		if (pas[m] == INVALID_PADDR) {
+			break;
+		}
+		lpage_lock(run[m]);
+		ok = (run[m]->lp_paddr & PAGE_FRAME) == INVALID_PADDR &&
+			run[m]->lp_swapaddr == swa + m*PAGE_SIZE;
+		if (ok) {
+			LP_SETPADDR(run[m], pas[m]);
+		}
+		lpage_unlock(run[m]);
+		if (!ok) {
+			coremap_freeuser(pas[m]);
+			break;
+		}
+	}
+	if (m == 0) {
+		return false;
+	}
+
+	swap_pagein_cluster(pas, m, swa);
+
+	for (i=0; i<m; i++) {
+		coremap_unpin(pas[i]);
+	}
+
+	spinlock_acquire(&stats_spinlock);
+	ct_majfaults++;
+	ct_readaheads += m-1;
+	spinlock_release(&stats_spinlock);
+	return true;
+}
+
+/*
+ * lpage_sync: write a page of a shared file mapping back to the file
+ * if it has changes the file hasn't seen: that is, if it's resident
+ * and dirty, or if it's out in swap (see lpage_pagein), in which case
+ * it's paged in to be written. This is msync, and what happens when
+ * the last mapping of a file goes away.
+ *
+ * Synchronization: vfs_biglock goes before the pin, as in
+ * lpage_pagein. The page is taken out of whatever TLB it's in while
+ * it's written, so anyone writing it meanwhile faults, waits for the
+ * pin, and dirties it again.
+ */
+int
+lpage_sync(struct lpage *lp)
+{
+	paddr_t pa;
+	int result;
+
+	KASSERT(LP_ISFILESHARED(lp));
+
+	vfs_biglock_acquire();
+	lpage_lock_and_pin(lp);
+
+	pa = lp->lp_paddr & PAGE_FRAME;
+	if (pa == INVALID_PADDR) {
+		if (lp->lp_swapaddr == INVALID_SWAPADDR) {
+			/* not in memory or swap; the file has it */
+			lpage_unlock(lp);
+			vfs_biglock_release();
+			return 0;
+		}
+		result = lpage_pagein(lp, &pa);
+		if (result) {
+			vfs_biglock_release();
+			return result;
+		}
+	}
+
+	if (!LP_ISDIRTY(lp)) {
+		lpage_unlock(lp);
+		coremap_unpin(pa);
+		vfs_biglock_release();
+		return 0;
+	}
+
+	/* can't hold the lpage lock in the coremap */
+	lpage_unlock(lp);
+	coremap_unmap_page(pa);
+	lpage_lock(lp);
+
+	result = lpage_fileclean(lp, pa);
+	coremap_unpin(pa);
+	vfs_biglock_release();
+	return result;
+}
+
+/*
+ * lpage_setswaphint: record HINT as where LP would like to go in swap
+ * when it first gets a swap page. Has no effect if it already has one.
+ *
+ * Synchronization: takes the lpage lock.
+ */
+void
+lpage_setswaphint(struct lpage *lp, off_t hint)
+{
+	lpage_lock(lp);
+	lp->lp_swaphint = hint;
+	lpage_unlock(lp);
+}
@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#define LPTINLINE
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vm.h>
+#include <vmprivate.h>
+
+/*
+ * lpage_table: sparse two-level table of lpages. See vmprivate.h.
+ *
+ * Synchronization: none; the owner of the table (a vm_object, which
+ * one thread owns, or a filecache, under filecache_lock) takes care
+ * of that.
+ */
+
+/*
+ * Create an empty table.
+ */
+struct lpage_table *
+lpage_table_create(void)
+{
+	struct lpage_table *t;
+
+	t = kmalloc(sizeof(struct lpage_table));
+	if (t == NULL) {
+		return NULL;
+	}
+	t->lpt_leaves = NULL;
+	t->lpt_num = 0;
+	t->lpt_maxleaves = 0;
+	return t;
+}
+
+/*
+ * Destroy a table. The lpages in it are the caller's business; usually
+ * it has shrunk the table to nothing already.
+ */
+void
+lpage_table_destroy(struct lpage_table *t)
+{
+	unsigned i;
+
+	for (i=0; i<t->lpt_maxleaves; i++) {
+		if (t->lpt_leaves[i] != NULL) {
+			kfree(t->lpt_leaves[i]);
+		}
+	}
+	if (t->lpt_leaves != NULL) {
+		kfree(t->lpt_leaves);
+	}
+	kfree(t);
+}
+
+/*
+ * Store LP as page INDEX.
+ */
+void
+lpage_table_set(struct lpage_table *t, unsigned index, struct lpage *lp)
+{
+	struct lpage_leaf *leaf;
+
+	KASSERT(index < t->lpt_num);
+	leaf = t->lpt_leaves[index / LPT_LEAFPAGES];
+	if (leaf == NULL) {
+		/* the slot is NULL already; anything else needs a leaf */
+		KASSERT(lp == NULL);
+		return;
+	}
+	leaf->lpl_pages[index % LPT_LEAFPAGES] = lp;
+}
+
+/*
+ * Make sure page INDEX has a leaf to go in.
+ */
+int
+lpage_table_prepare(struct lpage_table *t, unsigned index)
+{
+	struct lpage_leaf *leaf;
+	unsigned i;
+
+	KASSERT(index < t->lpt_num);
+	if (t->lpt_leaves[index / LPT_LEAFPAGES] != NULL) {
+		return 0;
+	}
+
+	leaf = kmalloc(sizeof(struct lpage_leaf));
+	if (leaf == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<LPT_LEAFPAGES; i++) {
+		leaf->lpl_pages[i] = NULL;
+	}
+	t->lpt_leaves[index / LPT_LEAFPAGES] = leaf;
+	return 0;
+}
+
+/*
+ * Check if a leaf is empty.
+ */
+static
+bool
+lpage_leaf_isempty(struct lpage_leaf *leaf)
+{
+	unsigned i;
+
+	for (i=0; i<LPT_LEAFPAGES; i++) {
+		if (leaf->lpl_pages[i] != NULL) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Change the number of pages to NUM.
+ *
+ * Growing only has to make room for more leaf pointers, which we do
+ * by doubling, as heaps tend to grow a page at a time. Shrinking
+ * clears the dropped pages and frees any leaves left with nothing in
+ * them, so the table stays sparse after an sbrk or munmap.
+ */
+int
+lpage_table_setsize(struct lpage_table *t, unsigned num)
+{
+	struct lpage_leaf **newleaves;
+	struct lpage_leaf *leaf;
+	unsigned oldleaves, nleaves, newmax, i;
+
+	oldleaves = DIVROUNDUP(t->lpt_num, LPT_LEAFPAGES);
+	nleaves = DIVROUNDUP(num, LPT_LEAFPAGES);
+
+	if (nleaves > t->lpt_maxleaves) {
+		newmax = t->lpt_maxleaves * 2;
+		if (newmax < nleaves) {
+			newmax = nleaves;
+		}
+		newleaves = kmalloc(newmax * sizeof(struct lpage_leaf *));
+		if (newleaves == NULL) {
+			return ENOMEM;
+		}
+		for (i=0; i<t->lpt_maxleaves; i++) {
+			newleaves[i] = t->lpt_leaves[i];
+		}
+		for (; i<newmax; i++) {
+			newleaves[i] = NULL;
+		}
+		if (t->lpt_leaves != NULL) {
+			kfree(t->lpt_leaves);
+		}
+		t->lpt_leaves = newleaves;
+		t->lpt_maxleaves = newmax;
+	}
+
+	if (num < t->lpt_num) {
+		/* clear the dropped part of the last leaf we keep */
+		leaf = NULL;
+		if (num % LPT_LEAFPAGES != 0) {
+			leaf = t->lpt_leaves[nleaves - 1];
+		}
+		if (leaf != NULL) {
+			for (i = num % LPT_LEAFPAGES; i < LPT_LEAFPAGES; i++) {
+				leaf->lpl_pages[i] = NULL;
+			}
+			if (lpage_leaf_isempty(leaf)) {
+				kfree(leaf);
+				t->lpt_leaves[nleaves - 1] = NULL;
+			}
+		}
+		/* and drop the leaves after it */
+		for (i=nleaves; i<oldleaves; i++) {
+			if (t->lpt_leaves[i] != NULL) {
+				kfree(t->lpt_leaves[i]);
+				t->lpt_leaves[i] = NULL;
+			}
+		}
+	}
+
+	t->lpt_num = num;
+	return 0;
+}
@@ -32,6 +32,7 @@
 #include <kern/fcntl.h>
 #include <kern/stat.h>
 #include <lib.h>
+#include <spinlock.h>
 #include <uio.h>
 #include <bitmap.h>
 #include <synch.h>
@@ -60,7 +61,8 @@ static struct lock *swaplock;	// synchronizes swapmap and counters
 /*
  * A "reserved" page is one for which no swap page has actually
  * been allocated but for which we are committed to being able to
- * provide swap. This happens when zero-fill pages are allocated.
+ * provide swap. Every page of every vm_object starts out this way,
+ * and pages stay reserved until they are first written to swap.
  */
 static unsigned long swap_total_pages;
 static unsigned long swap_free_pages;
@@ -69,20 +71,141 @@ static unsigned long swap_reserved_pages;
 static struct vnode *swapstore;	// swap file
 
 /*
- * Only one page can be in transit to/from disk at once (at least under
- * present circumstances.) While the disk device will queue up multiple
- * concurrent requests correctly, there's no benefit to doing so. So we
- * enforce mutual exclusion at a higher level. This reduces the number
- * of pages marked in transit at any one time and thus (hopefully) makes
- * paging more intelligent and multipage allocation less likely to starve.
+ * Placement. Left to itself, first-fit allocation scatters each
+ * process's pages all over swap, so read-ahead (lpage_readahead)
+ * rarely finds a page's neighbours next to it. So each vm_object gets
+ * a stretch of swap of its own, picked by swap_objhint when it first
+ * needs one, and each of its pages carries a hint (lp_swaphint) for
+ * where in that stretch it belongs by its position in the object.
+ * swap_alloc and swap_alloc_run take the hinted place if it's free,
+ * and otherwise the nearest free place after it.
  *
- * This lock signals "intent to page" and should be construed as
- * advisory.
+ * To keep the search from walking the whole bitmap as swap gets big,
+ * swap is divided into chunks of SWAP_CHUNK pages, and swap_chunkfree
+ * counts the free pages in each; full chunks are skipped without
+ * looking at their bits. Allocations with no hint start at swap_rover,
+ * where the last one left off, and swap_objhint hands out stretches
+ * starting from swap_objnext, so different objects start out apart.
+ *
+ * All protected by swaplock.
+ */
+#define SWAP_CHUNK	32
+static uint8_t *swap_chunkfree;	// free pages in each chunk
+static unsigned swap_nchunks;
+static unsigned swap_rover;	// chunk to search from without a hint
+static unsigned swap_objnext;	// chunk to start the next object's stretch
+
+/*
+ * Stats counters. The cluster tables count transfers by size; entry
+ * N-1 is for transfers of N pages.
  */
+static volatile uint32_t ct_reads;
+static volatile uint32_t ct_pagesin;
+static volatile uint32_t ct_writes;
+static volatile uint32_t ct_pagesout;
+static volatile uint32_t ct_readclusters[SWAP_CLUSTER];
+static volatile uint32_t ct_writeclusters[SWAP_CLUSTER];
+static struct spinlock swapstats_spinlock = SPINLOCK_INITIALIZER;
 
-struct lock *global_paging_lock;
+/*
+ * There is no global paging lock. A page in transit to or from swap
+ * is pinned in the coremap for the duration of the I/O, and anyone
+ * else who wants it (to map it, evict it, or free it) sleeps in
+ * coremap_pin until the I/O is done. Paging of different pages can
+ * therefore proceed in parallel; the disk driver queues the requests.
+ */
 
 
+/*
+ * swap_markpage/swap_unmarkpage: mark swap page INDEX used or free,
+ * keeping the chunk counts in step.
+ *
+ * Synchronization: assumes we hold swaplock, except during bootstrap.
+ */
+static
+void
+swap_markpage(unsigned index)
+{
+	KASSERT(!bitmap_isset(swapmap, index));
+	bitmap_mark(swapmap, index);
+	KASSERT(swap_chunkfree[index / SWAP_CHUNK] > 0);
+	swap_chunkfree[index / SWAP_CHUNK]--;
+}
+
+static
+void
+swap_unmarkpage(unsigned index)
+{
+	KASSERT(bitmap_isset(swapmap, index));
+	bitmap_unmark(swapmap, index);
+	swap_chunkfree[index / SWAP_CHUNK]++;
+	KASSERT(swap_chunkfree[index / SWAP_CHUNK] <= SWAP_CHUNK);
+}
+
+/*
+ * swap_hintpage: turn a hint (a swap address, possibly past the end
+ * of swap, or INVALID_SWAPADDR for none) into the page index to start
+ * looking at, and the chunk for swap_rover if there's no hint.
+ *
+ * Synchronization: assumes we hold swaplock.
+ */
+static
+unsigned
+swap_hintpage(off_t hint)
+{
+	if (hint == INVALID_SWAPADDR) {
+		return swap_rover * SWAP_CHUNK;
+	}
+	return (hint / PAGE_SIZE) % swap_total_pages;
+}
+
+/*
+ * swap_findrun: find NPAGES consecutive free swap pages, starting the
+ * search at page START and going forward (around the end if need be).
+ * Returns the first page of the run, or 0 if there isn't one (page 0
+ * is never free).
+ *
+ * Chunks with no free pages are skipped whole. Page 0 is always in
+ * use, so a run never wraps around the end.
+ *
+ * Synchronization: assumes we hold swaplock.
+ */
+static
+unsigned
+swap_findrun(unsigned start, unsigned npages)
+{
+	unsigned n, pos, len, chunk;
+
+	len = 0;
+	pos = start;
+	for (n=0; n<swap_total_pages; ) {
+		chunk = pos / SWAP_CHUNK;
+		if (swap_chunkfree[chunk] == 0) {
+			/* skip to the start of the next chunk */
+			len = 0;
+			n += SWAP_CHUNK - pos % SWAP_CHUNK;
+			pos = (chunk + 1) * SWAP_CHUNK;
+			if (pos >= swap_total_pages) {
+				pos = 0;
+			}
+			continue;
+		}
+		if (bitmap_isset(swapmap, pos)) {
+			len = 0;
+		}
+		else if (++len == npages) {
+			return pos + 1 - npages;
+		}
+		n++;
+		pos++;
+		if (pos == swap_total_pages) {
+			len = 0;
+			pos = 0;
+		}
+	}
+	return 0;
+}
+
 /*
  * swap_bootstrap: Initializes swap information and finishes
  * bootstrapping the VM so that processes can use it.
@@ -97,6 +220,7 @@ swap_bootstrap(void)
 	char path[sizeof(swapfilename)];
 	off_t minsize;
 	size_t pmemsize;
+	unsigned i;
 
 	pmemsize = mainbus_ramsize();
 
@@ -134,6 +258,8 @@ swap_bootstrap(void)
 	swap_total_pages = st.st_size / PAGE_SIZE;
 	swap_free_pages = swap_total_pages;
 	swap_reserved_pages = 0;
+	swap_rover = 0;
+	swap_objnext = 0;
 
 	swapmap = bitmap_create(st.st_size/PAGE_SIZE);
 	DEBUG(DB_VM, "creating swap map with %lld entries\n",
@@ -142,14 +268,28 @@ swap_bootstrap(void)
 		panic("swap: No memory for swap bitmap\n");
 	}
 
+	swap_nchunks = DIVROUNDUP(swap_total_pages, SWAP_CHUNK);
+	swap_chunkfree = kmalloc(swap_nchunks * sizeof(swap_chunkfree[0]));
+	if (swap_chunkfree == NULL) {
+		panic("swap: No memory for swap chunk counts\n");
+	}
+	for (i=0; i<swap_nchunks; i++) {
+		swap_chunkfree[i] = SWAP_CHUNK;
+	}
+	if (swap_total_pages % SWAP_CHUNK != 0) {
+		swap_chunkfree[swap_nchunks-1] = swap_total_pages % SWAP_CHUNK;
+	}
+
 	swaplock = lock_create("swaplock");
 	if (swaplock == NULL) {
 		panic("swap: No memory for swap lock\n");
 	}
 
 	/* mark the first page of swap used so we can check for errors */
-	bitmap_mark(swapmap, 0);
+	swap_markpage(0);
 	swap_free_pages--;
+
+	filecache_bootstrap();
 }
 
 /*
@@ -161,20 +301,68 @@ void
 swap_shutdown(void)
 {
 	lock_destroy(swaplock);
+	kfree(swap_chunkfree);
 	bitmap_destroy(swapmap);
 	vfs_close(swapstore);
 }
 
 /*
- * swap_alloc: allocates a page in the swapfile.
+ * swap_objhint: pick a stretch of swap for a vm_object of NPAGES
+ * pages to put its pages in, and return the swap address for its
+ * page 0. This is only advice; nothing is set aside. Prefers a chunk
+ * that's completely free, and moves on by the object's size (up to an
+ * eighth of swap) so the next object starts somewhere else.
+ *
+ * Synchronization: uses swaplock.
+ */
+off_t
+swap_objhint(unsigned npages)
+{
+	unsigned n, chunk, span;
+
+	lock_acquire(swaplock);
+
+	chunk = swap_objnext;
+	for (n=0; n<swap_nchunks; n++) {
+		if (swap_chunkfree[chunk] == SWAP_CHUNK) {
+			break;
+		}
+		chunk = (chunk + 1) % swap_nchunks;
+	}
+	if (n == swap_nchunks) {
+		/* nothing wholly free; start where we'd have started */
+		chunk = swap_objnext;
+	}
+
+	span = DIVROUNDUP(npages, SWAP_CHUNK);
+	if (span > swap_nchunks / 8) {
+		span = swap_nchunks / 8;
+	}
+	if (span == 0) {
+		span = 1;
+	}
+	swap_objnext = (chunk + span) % swap_nchunks;
+
+	lock_release(swaplock);
+
+	if (chunk == 0) {
+		/* page 0 is never free; use the one after */
+		return PAGE_SIZE;
+	}
+	return (off_t)chunk * SWAP_CHUNK * PAGE_SIZE;
+}
+
+/*
+ * swap_alloc: allocates a page in the swapfile, at HINT if that's
+ * free (see swap_objhint) or else as close after it as possible.
  * The page should have already been reserved with swap_reserve.
  *
  * Synchronization: uses swaplock.
  */
 off_t
-swap_alloc(void)
+swap_alloc(off_t hint)
 {
-	uint32_t rv, index;
+	unsigned index;
 	
 	lock_acquire(swaplock);
 
@@ -184,16 +372,60 @@ swap_alloc(void)
 	KASSERT(swap_reserved_pages>0);
 	KASSERT(swap_free_pages>0);
 
-	rv = bitmap_alloc(swapmap, &index);
+	index = swap_findrun(swap_hintpage(hint), 1);
 	/* If this blows up, our counters are wrong */
-	KASSERT(rv == 0);
+	KASSERT(index != 0);
+	swap_markpage(index);
+	if (hint == INVALID_SWAPADDR) {
+		swap_rover = index / SWAP_CHUNK;
+	}
 
 	swap_reserved_pages--;
 	swap_free_pages--;
 
 	lock_release(swaplock);
 
-	return index*PAGE_SIZE;
+	return (off_t)index * PAGE_SIZE;
+}
+
+/*
+ * swap_alloc_run: allocates NPAGES contiguous pages in the swapfile,
+ * so they can be written with one transfer, starting at HINT or as
+ * close after it as possible. The pages should have already been
+ * reserved. Returns INVALID_SWAPADDR if there's no free run that
+ * long; the caller should then fall back to swap_alloc.
+ *
+ * Synchronization: uses swaplock.
+ */
+off_t
+swap_alloc_run(unsigned npages, off_t hint)
+{
+	unsigned i, index;
+
+	KASSERT(npages > 0 && npages <= SWAP_CLUSTER);
+
+	lock_acquire(swaplock);
+
+	KASSERT(swap_free_pages <= swap_total_pages);
+	KASSERT(swap_reserved_pages <= swap_free_pages);
+	KASSERT(swap_reserved_pages >= npages);
+
+	index = swap_findrun(swap_hintpage(hint), npages);
+	if (index == 0) {
+		lock_release(swaplock);
+		return INVALID_SWAPADDR;
+	}
+	for (i=index; i<index+npages; i++) {
+		swap_markpage(i);
+	}
+	if (hint == INVALID_SWAPADDR) {
+		swap_rover = (index + npages - 1) / SWAP_CHUNK;
+	}
+	swap_reserved_pages -= npages;
+	swap_free_pages -= npages;
+
+	lock_release(swaplock);
+	return (off_t)index * PAGE_SIZE;
 }
 
 /*
@@ -216,13 +448,41 @@ swap_free(off_t swapaddr)
 	KASSERT(swap_free_pages < swap_total_pages);
 	KASSERT(swap_reserved_pages <= swap_free_pages);
 
-	KASSERT(bitmap_isset(swapmap, index));
-	bitmap_unmark(swapmap, index);
+	swap_unmarkpage(index);
 	swap_free_pages++;
 
 	lock_release(swaplock);
 }
 
+/*
+ * swap_release: gives up a swap page but keeps the space reserved,
+ * that is, turns it back into a reservation. Used when the page it
+ * holds is about to be rewritten somewhere else.
+ *
+ * Synchronization: uses swaplock.
+ */
+void
+swap_release(off_t swapaddr)
+{
+	uint32_t index;
+
+	KASSERT(swapaddr != INVALID_SWAPADDR);
+	KASSERT(swapaddr % PAGE_SIZE == 0);
+
+	index = swapaddr / PAGE_SIZE;
+
+	lock_acquire(swaplock);
+
+	KASSERT(swap_free_pages < swap_total_pages);
+	swap_unmarkpage(index);
+	swap_free_pages++;
+	swap_reserved_pages++;
+
+	KASSERT(swap_reserved_pages <= swap_free_pages);
+
+	lock_release(swaplock);
+}
+
 /*
  * swap_reserve/unreserve: reserve some pages for future allocation, or
  * release such pages.
@@ -266,30 +526,45 @@ swap_unreserve(unsigned long npages)
 }
 
 /*
- * swap_io: Does one swap I/O. Panics on failure.
+ * swap_io: Does one swap I/O, of NPAGES physical pages to or from
+ * consecutive swap pages starting at SWAPADDR. The physical pages
+ * needn't be contiguous; each gets its own iovec. Panics on failure.
  *
- * Synchronization: none specifically. The physical page should be
- * marked "pinned" (locked) so it won't be touched by other people.
+ * Synchronization: none specifically. The physical pages should be
+ * marked "pinned" (locked) so they won't be touched by other people.
  */
 static
 void
-swap_io(paddr_t pa, off_t swapaddr, enum uio_rw rw)
+swap_io(const paddr_t *pas, unsigned npages, off_t swapaddr,
+	enum uio_rw rw)
 {
-	struct iovec iov;
+	struct iovec iov[SWAP_CLUSTER];
 	struct uio u;
 	vaddr_t va;
+	unsigned i;
 	int result;
 
-	KASSERT(lock_do_i_hold(global_paging_lock));
-
-	KASSERT(pa != INVALID_PADDR);
+	KASSERT(npages > 0 && npages <= SWAP_CLUSTER);
 	KASSERT(swapaddr % PAGE_SIZE == 0);
-	KASSERT(coremap_pageispinned(pa));
-	KASSERT(bitmap_isset(swapmap, swapaddr / PAGE_SIZE));
 
-	va = coremap_map_swap_page(pa);
+	for (i=0; i<npages; i++) {
+		KASSERT(pas[i] != INVALID_PADDR);
+		KASSERT(coremap_pageispinned(pas[i]));
+		KASSERT(bitmap_isset(swapmap, swapaddr / PAGE_SIZE + i));
+
+		va = coremap_map_swap_page(pas[i]);
+		iov[i].iov_kbase = (void *)va;
+		iov[i].iov_len = PAGE_SIZE;
+	}
+
+	u.uio_iov = iov;
+	u.uio_iovcnt = npages;
+	u.uio_offset = swapaddr;
+	u.uio_resid = npages * PAGE_SIZE;
+	u.uio_segflg = UIO_SYSSPACE;
+	u.uio_rw = rw;
+	u.uio_space = NULL;
 
-	uio_kinit(&iov, &u, (char *)va, PAGE_SIZE, swapaddr, rw);
 	if (rw==UIO_READ) {
 		result = VOP_READ(swapstore, &u);
 	}
@@ -297,7 +572,9 @@ swap_io(paddr_t pa, off_t swapaddr, enum uio_rw rw)
 		result = VOP_WRITE(swapstore, &u);
 	}
 
-	coremap_unmap_swap_page(va, pa);
+	for (i=0; i<npages; i++) {
+		coremap_unmap_swap_page((vaddr_t)iov[i].iov_kbase, pas[i]);
+	}
 
 	if (result==EIO) {
 		panic("swap: EIO on swapfile (offset %ld)\n",
@@ -311,6 +588,19 @@ swap_io(paddr_t pa, off_t swapaddr, enum uio_rw rw)
 		panic("swap: Error %d from swapfile (offset %ld)\n",
 		      result, (long)swapaddr);
 	}
+
+	spinlock_acquire(&swapstats_spinlock);
+	if (rw==UIO_READ) {
+		ct_reads++;
+		ct_pagesin += npages;
+		ct_readclusters[npages-1]++;
+	}
+	else {
+		ct_writes++;
+		ct_pagesout += npages;
+		ct_writeclusters[npages-1]++;
+	}
+	spinlock_release(&swapstats_spinlock);
 }
 
 /*
@@ -320,10 +610,9 @@ swap_io(paddr_t pa, off_t swapaddr, enum uio_rw rw)
 void
 swap_pagein(paddr_t pa, off_t swapaddr)
 {
-	swap_io(pa, swapaddr, UIO_READ);
+	swap_io(&pa, 1, swapaddr, UIO_READ);
 }
 
-
 /* 
  * swap_pageout: write one page from physical memory into swap.
  * Synchronization: none here. See swap_io().
@@ -331,5 +620,132 @@ swap_pagein(paddr_t pa, off_t swapaddr)
 void
 swap_pageout(paddr_t pa, off_t swapaddr)
 {
-	swap_io(pa, swapaddr, UIO_WRITE);
+	swap_io(&pa, 1, swapaddr, UIO_WRITE);
+}
+
+/*
+ * swap_pagein_cluster/swap_pageout_cluster: the same for NPAGES
+ * pages at consecutive swap addresses, in one transfer.
+ */
+void
+swap_pagein_cluster(const paddr_t *pas, unsigned npages, off_t swapaddr)
+{
+	swap_io(pas, npages, swapaddr, UIO_READ);
+}
+
+void
+swap_pageout_cluster(const paddr_t *pas, unsigned npages, off_t swapaddr)
+{
+	swap_io(pas, npages, swapaddr, UIO_WRITE);
+}
+
+/*
+ * swap_printstats: print transfer counts and the distribution of
+ * cluster sizes. Called from vm_printstats.
+ */
+static
+void
+swap_printclusters(const char *what, const uint32_t *table)
+{
+	unsigned i;
+
+	kprintf("swap: %s clusters:", what);
+	for (i=0; i<SWAP_CLUSTER; i++) {
+		kprintf(" %u:%lu", i+1, (unsigned long) table[i]);
+	}
+	kprintf("\n");
+}
+
+void
+swap_printstats(void)
+{
+	uint32_t rd, pi, wr, po;
+	uint32_t rc[SWAP_CLUSTER], wc[SWAP_CLUSTER];
+	unsigned i;
+
+	spinlock_acquire(&swapstats_spinlock);
+	rd = ct_reads;
+	pi = ct_pagesin;
+	wr = ct_writes;
+	po = ct_pagesout;
+	for (i=0; i<SWAP_CLUSTER; i++) {
+		rc[i] = ct_readclusters[i];
+		wc[i] = ct_writeclusters[i];
+	}
+	spinlock_release(&swapstats_spinlock);
+
+	kprintf("swap: %lu reads (%lu pages), %lu writes (%lu pages)\n",
+		(unsigned long) rd, (unsigned long) pi,
+		(unsigned long) wr, (unsigned long) po);
+	swap_printclusters("read", rc);
+	swap_printclusters("write", wc);
+}
+
+/*
+ * swap_printmap: print how full swap is and how broken up its free
+ * space is, and a map with one character per chunk of SWAP_CHUNK
+ * pages: '.' for all free, ':' for under half used, 'o' for half or
+ * more, '#' for full.
+ *
+ * Synchronization: uses swaplock.
+ */
+void
+swap_printmap(void)
+{
+	unsigned i, size, used, extents, len, longest;
+	char line[64 + 1];
+	unsigned col;
+
+	lock_acquire(swaplock);
+
+	extents = len = longest = 0;
+	for (i=0; i<swap_total_pages; i++) {
+		if (bitmap_isset(swapmap, i)) {
+			len = 0;
+			continue;
+		}
+		if (len == 0) {
+			extents++;
+		}
+		len++;
+		if (len > longest) {
+			longest = len;
+		}
+	}
+
+	kprintf("swap: %lu pages: %lu in use, %lu reserved, %lu free\n",
+		swap_total_pages, swap_total_pages - swap_free_pages,
+		swap_reserved_pages, swap_free_pages);
+	kprintf("swap: free space in %u extents, longest %u pages, "
+		"average %lu\n", extents, longest,
+		extents == 0 ? 0 : swap_free_pages / extents);
+
+	col = 0;
+	for (i=0; i<swap_nchunks; i++) {
+		size = SWAP_CHUNK;
+		if (i == swap_nchunks - 1 && swap_total_pages % SWAP_CHUNK) {
+			size = swap_total_pages % SWAP_CHUNK;
+		}
+		used = size - swap_chunkfree[i];
+		if (used == 0) {
+			line[col] = '.';
+		}
+		else if (used == size) {
+			line[col] = '#';
+		}
+		else if (used * 2 < size) {
+			line[col] = ':';
+		}
+		else {
+			line[col] = 'o';
+		}
+		col++;
+		if (col == sizeof(line) - 1 || i == swap_nchunks - 1) {
+			line[col] = 0;
+			kprintf("%6u %s\n", (i + 1 - col) * SWAP_CHUNK, line);
+			col = 0;
+		}
+	}
+
+	lock_release(swaplock);
 }
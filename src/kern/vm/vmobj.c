@@ -29,20 +29,22 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
 #include <lib.h>
 #include <array.h>
 #include <addrspace.h>
+#include <vnode.h>
+#include <vfs.h>
 #include <vm.h>
 #include <vmprivate.h>
 #include <machine/coremap.h>
 
+#include "opt-cow.h"
+
 /*
  * vm_object operations.
  */
 
-
-DEFARRAY_BYTYPE(lpage_array, struct lpage, /*noinline*/);
-
 /*
  * vm_object_create: Allocate a new vm_object with nothing in it.
  * Returns: new vm_object on success, NULL on error.
@@ -51,7 +53,6 @@ struct vm_object *
 vm_object_create(size_t npages)
 {
 	struct vm_object *vmo;
-	unsigned i;
 	int result;
 
 	result = swap_reserve(npages);
@@ -65,7 +66,7 @@ vm_object_create(size_t npages)
 		return NULL;
 	}
 
-	vmo->vmo_lpages = lpage_array_create();
+	vmo->vmo_lpages = lpage_table_create();
 	if (vmo->vmo_lpages == NULL) {
 		kfree(vmo);
 		swap_unreserve(npages);
@@ -75,30 +76,46 @@ vm_object_create(size_t npages)
 	vmo->vmo_base = 0xdeafbeef;		/* make sure these */
 	vmo->vmo_lower_redzone = 0xdeafbeef;	/* get filled in later */
 
+	vmo->vmo_vnode = NULL;
+	vmo->vmo_fileoff = 0;
+	vmo->vmo_filestart = 0;
+	vmo->vmo_filesize = 0;
+	vmo->vmo_prot = PROT_READ | PROT_WRITE | PROT_EXEC;
+	vmo->vmo_mapflags = 0;
+	vmo->vmo_filecache = NULL;
+	vmo->vmo_zeromapped = false;
+	vmo->vmo_swapbase = INVALID_SWAPADDR;
+
 	/* add the requested number of zerofilled pages */
-	result = lpage_array_setsize(vmo->vmo_lpages, npages);
+	result = lpage_table_setsize(vmo->vmo_lpages, npages);
 	if (result) {
-		lpage_array_destroy(vmo->vmo_lpages);
+		lpage_table_destroy(vmo->vmo_lpages);
 		kfree(vmo);
 		swap_unreserve(npages);
 		return NULL;
 	}
 
-	for (i=0; i<npages; i++) {
-		lpage_array_set(vmo->vmo_lpages, i, NULL);
-	}
-
 	return vmo;
 }
 
 /*
  * vm_object_copy: clone a vm_object.
  *
+ * With OPT_COW the lpages are shared with the new vm_object instead
+ * of being copied. AS is the address space VMO belongs to; we remove
+ * its TLB entries for the shared pages so that it can't keep writing
+ * them through a stale writable mapping.
+ *
+ * The pages of a MAP_SHARED mapping are always shared, and stay
+ * writable. Those of a file can be left untouched, since the child
+ * will find them in the filecache, but untouched anonymous ones have
+ * to be created now or parent and child would each get their own.
+ *
  * Synchronization: None; lpage_copy does the hard stuff.
  */
 int
-vm_object_copy(struct vm_object *vmo, struct addrspace *newas,
-	       struct vm_object **ret)
+vm_object_copy(struct vm_object *vmo, struct addrspace *as,
+	       struct addrspace *newas, struct vm_object **ret)
 {
 	struct vm_object *newvmo;
 
@@ -106,31 +123,91 @@ vm_object_copy(struct vm_object *vmo, struct addrspace *newas,
 	unsigned j;
 	int result;
 
-	newvmo = vm_object_create(lpage_array_num(vmo->vmo_lpages));
+	newvmo = vm_object_create(lpage_table_num(vmo->vmo_lpages));
 	if (newvmo == NULL) {
 		return ENOMEM;
 	}
 
 	newvmo->vmo_base = vmo->vmo_base;
 	newvmo->vmo_lower_redzone = vmo->vmo_lower_redzone;
+	newvmo->vmo_prot = vmo->vmo_prot;
+	newvmo->vmo_mapflags = vmo->vmo_mapflags;
 
-	for (j = 0; j < lpage_array_num(vmo->vmo_lpages); j++) {
-		lp = lpage_array_get(vmo->vmo_lpages, j);
-		newlp = lpage_array_get(newvmo->vmo_lpages, j);
+	if (vmo->vmo_vnode != NULL) {
+		VOP_INCREF(vmo->vmo_vnode);
+		VOP_INCOPEN(vmo->vmo_vnode);
+		newvmo->vmo_vnode = vmo->vmo_vnode;
+		newvmo->vmo_fileoff = vmo->vmo_fileoff;
+		newvmo->vmo_filestart = vmo->vmo_filestart;
+		newvmo->vmo_filesize = vmo->vmo_filesize;
+	}
+
+	if (vmo->vmo_filecache != NULL) {
+		result = filecache_attach(vmo->vmo_vnode,
+					  &newvmo->vmo_filecache);
+		if (result) {
+			goto fail;
+		}
+	}
+
+	for (j = 0; j < lpage_table_num(vmo->vmo_lpages); j++) {
+		lp = lpage_table_get(vmo->vmo_lpages, j);
+		newlp = lpage_table_get(newvmo->vmo_lpages, j);
 
 		/* new guy should be initialized to all zerofill */
 		KASSERT(newlp == NULL);
 
+		if (vmo->vmo_mapflags & MAP_SHARED) {
+			if (lp == NULL && vmo->vmo_vnode == NULL) {
+				result = lpage_table_prepare(vmo->vmo_lpages,
+							     j);
+				if (result) {
+					goto fail;
+				}
+				result = lpage_zerofill(&lp);
+				if (result) {
+					goto fail;
+				}
+				lp->lp_mapshared = true;
+				vm_object_swaphint(vmo, j, lp);
+				lpage_table_set(vmo->vmo_lpages, j, lp);
+			}
+			if (lp != NULL) {
+				result = lpage_table_prepare(newvmo->vmo_lpages,
+							     j);
+				if (result) {
+					goto fail;
+				}
+				lpage_share(lp);
+				lpage_table_set(newvmo->vmo_lpages, j, lp);
+			}
+			continue;
+		}
+
 		if (lp == NULL) {
 			/* old guy is zerofill too, don't do anything */
 			continue;
 		}
 
+		result = lpage_table_prepare(newvmo->vmo_lpages, j);
+		if (result) {
+			goto fail;
+		}
+
+#if OPT_COW
+		(void)newas;
+		lpage_share(lp);
+		mmu_unmap(as, vmo->vmo_base + PAGE_SIZE*j);
+		newlp = lp;
+#else
+		(void)as;
 		result = lpage_copy(lp, &newlp);
 		if (result) {
 			goto fail;
 		}
-		lpage_array_set(newvmo->vmo_lpages, j, newlp);
+		vm_object_swaphint(newvmo, j, newlp);
+#endif
+		lpage_table_set(newvmo->vmo_lpages, j, newlp);
 	}
 
 	*ret = newvmo;
@@ -154,9 +231,9 @@ vm_object_setsize(struct addrspace *as, struct vm_object *vmo, unsigned npages)
 	KASSERT(vmo != NULL);
 	KASSERT(vmo->vmo_lpages != NULL);
 
-	if (npages < lpage_array_num(vmo->vmo_lpages)) {
-		for (i=npages; i<lpage_array_num(vmo->vmo_lpages); i++) {
-			lp = lpage_array_get(vmo->vmo_lpages, i);
+	if (npages < lpage_table_num(vmo->vmo_lpages)) {
+		for (i=npages; i<lpage_table_num(vmo->vmo_lpages); i++) {
+			lp = lpage_table_get(vmo->vmo_lpages, i);
 			if (lp != NULL) {
 				KASSERT(as != NULL);
 				/* remove any tlb entry for this mapping */
@@ -164,15 +241,21 @@ vm_object_setsize(struct addrspace *as, struct vm_object *vmo, unsigned npages)
 				lpage_destroy(lp);
 			}
 			else {
+				if (vmo->vmo_zeromapped) {
+					/* may be reading the zero page */
+					KASSERT(as != NULL);
+					mmu_unmap(as,
+						  vmo->vmo_base+PAGE_SIZE*i);
+				}
 				swap_unreserve(1);
 			}
 		}
-		result = lpage_array_setsize(vmo->vmo_lpages, npages);
-		/* shrinking an array shouldn't fail */
+		result = lpage_table_setsize(vmo->vmo_lpages, npages);
+		/* shrinking a table shouldn't fail */
 		KASSERT(result==0);
 	}
-	else if (npages > lpage_array_num(vmo->vmo_lpages)) {
-		int oldsize = lpage_array_num(vmo->vmo_lpages);
+	else if (npages > lpage_table_num(vmo->vmo_lpages)) {
+		int oldsize = lpage_table_num(vmo->vmo_lpages);
 		unsigned newpages = npages - oldsize;
 
 		result = swap_reserve(newpages);
@@ -180,18 +263,316 @@ vm_object_setsize(struct addrspace *as, struct vm_object *vmo, unsigned npages)
 			return result;
 		}
 
-		result = lpage_array_setsize(vmo->vmo_lpages, npages);
+		result = lpage_table_setsize(vmo->vmo_lpages, npages);
 		if (result) {
 			swap_unreserve(newpages);
 			return result;
 		}
-		for (i=oldsize; i<npages; i++) {
-			lpage_array_set(vmo->vmo_lpages, i, NULL);
+	}
+	return 0;
+}
+
+/*
+ * vm_object_readahead: on a fault on page INDEX, if the page is in
+ * swap, read in the pages after it in the same vm_object along with
+ * it, when they sit in consecutive swap pages. See lpage_readahead.
+ * Returns true if it paged in page INDEX itself.
+ *
+ * Synchronization: none; assumes one thread uniquely owns the object.
+ */
+bool
+vm_object_readahead(struct vm_object *vmo, unsigned index)
+{
+	struct lpage *next[SWAP_CLUSTER-1];
+	unsigned i, n;
+
+	if (vmo->vmo_mapflags & MAP_SHARED) {
+		/* shared file pages need to come in dirty from swap */
+		return false;
+	}
+
+	n = 0;
+	for (i = index+1; i < lpage_table_num(vmo->vmo_lpages); i++) {
+		if (n == SWAP_CLUSTER-1) {
+			break;
 		}
+		next[n++] = lpage_table_get(vmo->vmo_lpages, i);
 	}
+
+	return lpage_readahead(lpage_table_get(vmo->vmo_lpages, index),
+			       next, n);
+}
+
+/*
+ * Fault-around window, in pages. After a read fault, the resident
+ * pages in the same naturally aligned block of this many pages get
+ * mapped along with the faulting one, like a small superpage, so a
+ * walk over memory that's already resident takes one trap per block
+ * rather than one per page. 1 turns it off. It's capped at a quarter
+ * of the 64-entry MIPS TLB so one fault can't push out too much else.
+ *
+ * Set from the kernel menu. Read without a lock: a fault that sees
+ * the old value is no worse off.
+ */
+#define FAULTAROUND_MAX		16
+static volatile unsigned vm_faultaround = 8;
+
+unsigned
+vm_get_faultaround(void)
+{
+	return vm_faultaround;
+}
+
+/*
+ * Change the fault-around window. It has to be a power of two.
+ */
+int
+vm_set_faultaround(unsigned npages)
+{
+	if (npages == 0 || npages > FAULTAROUND_MAX ||
+	    (npages & (npages - 1)) != 0) {
+		return EINVAL;
+	}
+	vm_faultaround = npages;
 	return 0;
 }
 
+/*
+ * vm_object_faultaround: after a read fault on page INDEX of VMO in
+ * AS, map the other pages in its fault-around block that are already
+ * in memory (see lpage_prefault). Pages that aren't, or are busy,
+ * are left to fault normally.
+ *
+ * Synchronization: none; assumes one thread uniquely owns the object.
+ */
+void
+vm_object_faultaround(struct vm_object *vmo, struct addrspace *as,
+		      unsigned index)
+{
+	struct lpage *lp;
+	unsigned window, start, end, i;
+
+	window = vm_faultaround;
+	if (window <= 1) {
+		return;
+	}
+
+	start = index & ~(window - 1);
+	end = start + window;
+	if (end > lpage_table_num(vmo->vmo_lpages)) {
+		end = lpage_table_num(vmo->vmo_lpages);
+	}
+
+	for (i = start; i < end; i++) {
+		if (i == index) {
+			continue;
+		}
+		lp = lpage_table_get(vmo->vmo_lpages, i);
+		if (lp == NULL) {
+			continue;
+		}
+		lpage_prefault(lp, as, vmo->vmo_base + PAGE_SIZE * i,
+			       (vmo->vmo_prot & PROT_WRITE) != 0);
+	}
+}
+
+/*
+ * vm_object_setfile: back the part of VMO from VADDR to VADDR+FILESIZE
+ * with the file VN, starting at OFFSET. Pages that haven't been
+ * touched yet get their contents from the file when they are (see
+ * vm_object_filepage); anything around the file data is zero-filled
+ * as usual.
+ *
+ * If VMO is read-only (vmo_prot must be set first) and the file data
+ * lines up with pages of the file, its whole pages are shared through
+ * the file's filecache instead. If the filecache can't be had, the
+ * pages are just private.
+ *
+ * Synchronization: none; assumes one thread uniquely owns the object.
+ */
+int
+vm_object_setfile(struct vm_object *vmo, struct vnode *vn, off_t offset,
+		  vaddr_t vaddr, size_t filesize)
+{
+	vaddr_t top;
+
+	top = vmo->vmo_base + PAGE_SIZE * lpage_table_num(vmo->vmo_lpages);
+	if (vaddr < vmo->vmo_base || vaddr + filesize > top ||
+	    vaddr + filesize < vaddr) {
+		return EINVAL;
+	}
+	if (vmo->vmo_vnode != NULL) {
+		/* only one piece of one file per object */
+		return EINVAL;
+	}
+
+	if ((vmo->vmo_prot & PROT_WRITE) == 0 &&
+	    offset % PAGE_SIZE == vaddr % PAGE_SIZE) {
+		if (filecache_attach(vn, &vmo->vmo_filecache)) {
+			vmo->vmo_filecache = NULL;
+		}
+	}
+
+	VOP_INCREF(vn);
+	VOP_INCOPEN(vn);
+	vmo->vmo_vnode = vn;
+	vmo->vmo_fileoff = offset;
+	vmo->vmo_filestart = vaddr;
+	vmo->vmo_filesize = filesize;
+	return 0;
+}
+
+/*
+ * vm_object_mapfile: make VMO, which was just created by mmap, a
+ * MAP_SHARED mapping of the file VN starting at OFFSET, which must be
+ * page-aligned. Its pages come from the file's filecache.
+ *
+ * Synchronization: none; assumes one thread uniquely owns the object.
+ */
+int
+vm_object_mapfile(struct vm_object *vmo, struct vnode *vn, off_t offset)
+{
+	int result;
+
+	KASSERT(vmo->vmo_vnode == NULL);
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	result = filecache_attach(vn, &vmo->vmo_filecache);
+	if (result) {
+		return result;
+	}
+
+	VOP_INCREF(vn);
+	VOP_INCOPEN(vn);
+	vmo->vmo_vnode = vn;
+	vmo->vmo_fileoff = offset;
+	vmo->vmo_filestart = vmo->vmo_base;
+	vmo->vmo_filesize = PAGE_SIZE * lpage_table_num(vmo->vmo_lpages);
+	return 0;
+}
+
+/*
+ * vm_object_filepage: page INDEX of VMO is being touched for the first
+ * time. If any of it comes from the backing file, create a file-backed
+ * lpage for it, install it, and return it in RET; otherwise set RET to
+ * NULL so the caller zero-fills it. If the vm_object uses the file's
+ * filecache and the page is all file data, it comes from there
+ * instead, and may be in use already. (In a MAP_SHARED mapping every
+ * page counts as file data; past the end of the file it's zeros.)
+ *
+ * Synchronization: none; assumes one thread uniquely owns the object.
+ */
+int
+vm_object_filepage(struct vm_object *vmo, unsigned index, struct lpage **ret)
+{
+	struct lpage *lp;
+	vaddr_t pagestart, lo, hi;
+	int result;
+
+	KASSERT(lpage_table_get(vmo->vmo_lpages, index) == NULL);
+
+	*ret = NULL;
+	if (vmo->vmo_vnode == NULL) {
+		return 0;
+	}
+
+	result = lpage_table_prepare(vmo->vmo_lpages, index);
+	if (result) {
+		return result;
+	}
+
+	pagestart = vmo->vmo_base + PAGE_SIZE * index;
+
+	if (vmo->vmo_filecache != NULL &&
+	    pagestart >= vmo->vmo_filestart &&
+	    pagestart + PAGE_SIZE <= vmo->vmo_filestart + vmo->vmo_filesize) {
+		result = filecache_getpage(vmo->vmo_filecache,
+			(vmo->vmo_fileoff + (pagestart - vmo->vmo_filestart))
+			/ PAGE_SIZE, &lp);
+		if (result) {
+			return result;
+		}
+		lpage_table_set(vmo->vmo_lpages, index, lp);
+		*ret = lp;
+		return 0;
+	}
+
+	lo = pagestart;
+	if (lo < vmo->vmo_filestart) {
+		lo = vmo->vmo_filestart;
+	}
+	hi = pagestart + PAGE_SIZE;
+	if (hi > vmo->vmo_filestart + vmo->vmo_filesize) {
+		hi = vmo->vmo_filestart + vmo->vmo_filesize;
+	}
+	if (lo >= hi) {
+		return 0;
+	}
+
+	lp = lpage_create_file(vmo->vmo_vnode,
+			       vmo->vmo_fileoff + (lo - vmo->vmo_filestart),
+			       lo - pagestart, hi - lo);
+	if (lp == NULL) {
+		return ENOMEM;
+	}
+	vm_object_swaphint(vmo, index, lp);
+	lpage_table_set(vmo->vmo_lpages, index, lp);
+	*ret = lp;
+	return 0;
+}
+
+/*
+ * vm_object_swaphint: LP has just been made for page INDEX of VMO;
+ * tell it where in swap to go, so that the object's pages are laid
+ * out there in order and read-ahead finds them together. The first
+ * time, pick a place in swap for the whole object.
+ *
+ * Synchronization: none; assumes one thread uniquely owns the object.
+ */
+void
+vm_object_swaphint(struct vm_object *vmo, unsigned index, struct lpage *lp)
+{
+	if (vmo->vmo_swapbase == INVALID_SWAPADDR) {
+		vmo->vmo_swapbase =
+			swap_objhint(lpage_table_num(vmo->vmo_lpages));
+	}
+	lpage_setswaphint(lp, vmo->vmo_swapbase + (off_t)index * PAGE_SIZE);
+}
+
+/*
+ * vm_object_sync: write back the changes to the NPAGES pages of VMO
+ * from INDEX, if it's a shared file mapping (see lpage_sync). Returns
+ * the first error, but tries all the pages.
+ *
+ * Synchronization: none; assumes one thread uniquely owns the object.
+ */
+int
+vm_object_sync(struct vm_object *vmo, unsigned index, unsigned npages)
+{
+	struct lpage *lp;
+	unsigned i;
+	int result, rv;
+
+	KASSERT(index + npages <= lpage_table_num(vmo->vmo_lpages));
+
+	if (vmo->vmo_filecache == NULL) {
+		return 0;
+	}
+
+	rv = 0;
+	for (i = index; i < index + npages; i++) {
+		lp = lpage_table_get(vmo->vmo_lpages, i);
+		if (lp == NULL) {
+			continue;
+		}
+		result = lpage_sync(lp);
+		if (result && rv == 0) {
+			rv = result;
+		}
+	}
+	return rv;
+}
+
 /*
  * vm_object_destroy: Deallocates a vm_object.
  *
@@ -204,8 +585,18 @@ vm_object_destroy(struct addrspace *as, struct vm_object *vmo)
 
 	result = vm_object_setsize(as, vmo, 0);
 	KASSERT(result==0);
+
+	if (vmo->vmo_filecache != NULL) {
+		/* the vnode stays open until this is done with it */
+		filecache_detach(vmo->vmo_filecache);
+	}
+
+	if (vmo->vmo_vnode != NULL) {
+		/* no lpages are left pointing at it */
+		vfs_close(vmo->vmo_vnode);
+	}
 	
-	lpage_array_destroy(vmo->vmo_lpages);
+	lpage_table_destroy(vmo->vmo_lpages);
 	kfree(vmo);
 }
 
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Purpose: measure how parallelvm scales with the number of CPUs. Run in
+# the installed root ($HOME/csc369/root), after compile.sh. For each CPU
+# count it writes a sys161 config like sys161.conf but with that many
+# cpus, boots the kernel, runs parallelvm, and prints the time the
+# kernel menu reports for it.
+#
+# Usage: scale.sh [cpucounts...]   (default: 1 2 4 8)
+set -e;
+if [ $# -eq 0 ]; then
+	set -- 1 2 4 8;
+fi
+echo "cpus  seconds";
+for n in "$@"; do
+	sed "s/cpus=[0-9]*/cpus=$n/" sys161.conf > sys161-scale.conf;
+	t=`sys161 -c sys161-scale.conf kernel "p testbin/parallelvm; q" 2>&1 |
+		grep "^Operation took" | head -1 | awk '{print $3}'`;
+	echo "$n     $t";
+done
+rm -f sys161-scale.conf;
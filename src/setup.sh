@@ -6,6 +6,7 @@ mkdir ~/csc369/root;
 chmod +x configure;
 ./configure;
 cp run.sh ~/csc369/root;
+cp scale.sh ~/csc369/root;
 cp .gdbinit ~/csc369/root;
 cp sys161.conf ~/csc369/root;
 chmod +x compile.sh;
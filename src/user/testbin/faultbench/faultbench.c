@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * faultbench - measure page fault latency.
+ *
+ * Touches each page of a large uninitialized (bss) array once, in
+ * order, so that every touch takes a zero-fill fault, and prints the
+ * average time per fault. To see what the kernel did for them,
+ * compare its "vm" stats before and after a run.
+ *
+ * Since a page only zero-fills the first time it is touched, each run
+ * measures one pass; run it several times for stable numbers.
+ *
+ * Usage: faultbench [npages]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define NPAGES     256
+#define PAGESIZE   4096
+
+static char data[NPAGES * PAGESIZE];
+
+int
+main(int argc, char *argv[])
+{
+	time_t startsecs, endsecs;
+	unsigned long startnsecs, endnsecs;
+	unsigned long long nsecs;
+	int npages, i;
+
+	npages = NPAGES;
+	if (argc > 1) {
+		npages = atoi(argv[1]);
+	}
+	if (npages <= 0 || npages > NPAGES) {
+		errx(1, "Usage: faultbench [npages] (at most %d)", NPAGES);
+	}
+
+	__time(&startsecs, &startnsecs);
+
+	for (i=0; i<npages; i++) {
+		data[i*PAGESIZE] = 1;
+	}
+
+	__time(&endsecs, &endnsecs);
+
+	nsecs = (endsecs - startsecs) * 1000000000ULL;
+	nsecs += endnsecs;
+	nsecs -= startnsecs;
+
+	printf("faultbench: %d zero-fill faults in %lu.%09lu s\n",
+	       npages, (unsigned long)(nsecs / 1000000000ULL),
+	       (unsigned long)(nsecs % 1000000000ULL));
+	printf("faultbench: %lu ns per fault\n",
+	       (unsigned long)(nsecs / npages));
+	return 0;
+}
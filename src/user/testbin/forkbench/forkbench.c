@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * forkbench - measure fork latency.
+ *
+ * Touches a good-sized array (so the parent has a fair number of
+ * resident, dirty pages) and then forks repeatedly. Each child writes
+ * one page and exits; the parent waits for it before forking again.
+ *
+ * Prints the average time per fork+exit+wait. To see how many pages
+ * were copied per fork, compare the kernel's "vm" stats (page copies
+ * vs. pages shared) before and after a run.
+ *
+ * Usage: forkbench [nforks]
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define NPAGES     128
+#define PAGESIZE   4096
+#define NFORKS     64
+
+static char data[NPAGES * PAGESIZE];
+
+int
+main(int argc, char *argv[])
+{
+	time_t startsecs, endsecs;
+	unsigned long startnsecs, endnsecs;
+	unsigned long long nsecs;
+	int nforks, i, j, status;
+	pid_t pid;
+
+	nforks = NFORKS;
+	if (argc > 1) {
+		nforks = atoi(argv[1]);
+	}
+	if (nforks <= 0) {
+		errx(1, "Usage: forkbench [nforks]");
+	}
+
+	/* make every page resident and dirty */
+	for (j=0; j<NPAGES; j++) {
+		data[j*PAGESIZE] = j;
+	}
+
+	__time(&startsecs, &startnsecs);
+
+	for (i=0; i<nforks; i++) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			/* child: dirty one page and leave */
+			data[(i % NPAGES) * PAGESIZE]++;
+			_exit(0);
+		}
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (WIFSIGNALED(status) || WEXITSTATUS(status) != 0) {
+			errx(1, "child %d failed", pid);
+		}
+	}
+
+	__time(&endsecs, &endnsecs);
+
+	/* make sure the children didn't scribble on us */
+	for (j=0; j<NPAGES; j++) {
+		if (data[j*PAGESIZE] != (char)j) {
+			errx(1, "page %d corrupted", j);
+		}
+	}
+
+	nsecs = (endsecs - startsecs) * 1000000000ULL;
+	nsecs += endnsecs;
+	nsecs -= startnsecs;
+
+	printf("forkbench: %d forks of %d-page process in %lu.%09lu s\n",
+	       nforks, NPAGES, (unsigned long)(nsecs / 1000000000ULL),
+	       (unsigned long)(nsecs % 1000000000ULL));
+	printf("forkbench: %lu us per fork\n",
+	       (unsigned long)(nsecs / 1000 / nforks));
+	return 0;
+}
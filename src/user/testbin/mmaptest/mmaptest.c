@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * mmaptest - exercise mmap, munmap, and msync.
+ *
+ * Checks that:
+ *    - anonymous memory comes up zeroed and can be used and unmapped;
+ *    - MAP_SHARED anonymous memory is shared with a forked child;
+ *    - a MAP_SHARED file mapping shows the file, and changes made
+ *      through it (including by a child) reach the file after msync;
+ *    - changes through a MAP_PRIVATE file mapping don't.
+ *
+ * Leaves the file "mmaptest.dat" behind.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define PAGESIZE   4096
+#define NPAGES     3
+#define FILENAME   "mmaptest.dat"
+
+static char buf[NPAGES * PAGESIZE];
+
+static
+void
+waitchild(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed");
+	}
+}
+
+static
+void
+test_anon(void)
+{
+	char *p;
+	int i;
+
+	p = mmap(NULL, NPAGES * PAGESIZE, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap anonymous");
+	}
+	for (i=0; i<NPAGES * PAGESIZE; i++) {
+		if (p[i] != 0) {
+			errx(1, "anonymous memory not zeroed at %d", i);
+		}
+	}
+	for (i=0; i<NPAGES * PAGESIZE; i++) {
+		p[i] = (char)i;
+	}
+	for (i=0; i<NPAGES * PAGESIZE; i++) {
+		if (p[i] != (char)i) {
+			errx(1, "anonymous memory wrong at %d", i);
+		}
+	}
+	if (munmap(p, NPAGES * PAGESIZE) < 0) {
+		err(1, "munmap anonymous");
+	}
+	printf("mmaptest: anonymous memory ok\n");
+}
+
+static
+void
+test_anonshared(void)
+{
+	volatile int *p;
+	pid_t pid;
+
+	p = mmap(NULL, PAGESIZE, PROT_READ|PROT_WRITE,
+		 MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap shared anonymous");
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		p[0] = 0x1234;
+		_exit(0);
+	}
+	waitchild(pid);
+
+	if (p[0] != 0x1234) {
+		errx(1, "shared anonymous memory: child's write not seen");
+	}
+	if (munmap((void *)p, PAGESIZE) < 0) {
+		err(1, "munmap shared anonymous");
+	}
+	printf("mmaptest: shared anonymous memory ok\n");
+}
+
+static
+void
+makefile(void)
+{
+	int fd, i;
+
+	for (i=0; i<NPAGES * PAGESIZE; i++) {
+		buf[i] = 'a' + i % 26;
+	}
+	fd = open(FILENAME, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", FILENAME);
+	}
+	if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+		err(1, "%s: write", FILENAME);
+	}
+	close(fd);
+}
+
+static
+void
+readfile(void)
+{
+	int fd;
+
+	fd = open(FILENAME, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", FILENAME);
+	}
+	if (read(fd, buf, sizeof(buf)) != sizeof(buf)) {
+		err(1, "%s: read", FILENAME);
+	}
+	close(fd);
+}
+
+static
+void
+test_fileshared(void)
+{
+	char *p;
+	pid_t pid;
+	int fd, i;
+
+	makefile();
+	fd = open(FILENAME, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s", FILENAME);
+	}
+	/* map the last two pages */
+	p = mmap(NULL, 2 * PAGESIZE, PROT_READ|PROT_WRITE, MAP_SHARED,
+		 fd, PAGESIZE);
+	if (p == MAP_FAILED) {
+		err(1, "mmap %s", FILENAME);
+	}
+	close(fd);
+
+	for (i=0; i<2 * PAGESIZE; i++) {
+		if (p[i] != buf[PAGESIZE + i]) {
+			errx(1, "shared mapping doesn't match file at %d", i);
+		}
+	}
+
+	p[0] = 'X';
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		if (p[0] != 'X') {
+			errx(1, "child doesn't see parent's write");
+		}
+		p[PAGESIZE] = 'Y';
+		_exit(0);
+	}
+	waitchild(pid);
+	if (p[PAGESIZE] != 'Y') {
+		errx(1, "parent doesn't see child's write");
+	}
+
+	if (msync(p, 2 * PAGESIZE, MS_SYNC) < 0) {
+		err(1, "msync");
+	}
+	readfile();
+	if (buf[PAGESIZE] != 'X' || buf[2 * PAGESIZE] != 'Y') {
+		errx(1, "changes didn't reach the file after msync");
+	}
+	if (munmap(p, 2 * PAGESIZE) < 0) {
+		err(1, "munmap %s", FILENAME);
+	}
+	printf("mmaptest: shared file mapping ok\n");
+}
+
+static
+void
+test_fileprivate(void)
+{
+	char *p;
+	int fd;
+
+	makefile();
+	fd = open(FILENAME, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", FILENAME);
+	}
+	p = mmap(NULL, NPAGES * PAGESIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE,
+		 fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap %s", FILENAME);
+	}
+	close(fd);
+
+	if (memcmp(p, buf, sizeof(buf)) != 0) {
+		errx(1, "private mapping doesn't match file");
+	}
+	p[0] = 'Z';
+	if (munmap(p, NPAGES * PAGESIZE) < 0) {
+		err(1, "munmap %s", FILENAME);
+	}
+	readfile();
+	if (buf[0] != 'a') {
+		errx(1, "private change reached the file");
+	}
+	printf("mmaptest: private file mapping ok\n");
+}
+
+int
+main(void)
+{
+	test_anon();
+	test_anonshared();
+	test_fileshared();
+	test_fileprivate();
+	printf("mmaptest: passed\n");
+	return 0;
+}
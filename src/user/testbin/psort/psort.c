@@ -39,6 +39,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -60,6 +61,9 @@
 
 #define WORKNUM      (128*1024)
 
+/* mmap offsets have to be a multiple of this */
+#define PAGESIZE     4096
+
 
 static int workspace[WORKNUM];
 
@@ -350,6 +354,33 @@ dowrite(const char *path, int fd, const void *buf, size_t len)
 	}
 }
 
+/*
+ * Returns NULL if the file can't be mapped (not every file system
+ * supports mmap); the caller falls back to reading.
+ */
+static
+const void *
+domap(int fd, size_t len, off_t offset)
+{
+	void *ptr;
+
+	ptr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, offset);
+	if (ptr == MAP_FAILED) {
+		return NULL;
+	}
+	return ptr;
+}
+
+static
+void
+dounmap(const char *path, const void *ptr, size_t len)
+{
+	if (munmap((void *)ptr, len) < 0) {
+		complain("%s: munmap", path);
+		exit(1);
+	}
+}
+
 static
 void
 dolseek(const char *name, int fd, off_t offset, int whence)
@@ -603,51 +634,87 @@ mergedname(int a)
 	return rv;
 }
 
+static
+void
+binkeys(int *outfds, const int *keys, int nkeys)
+{
+	int i, key, pivot, binnum;
+
+	pivot = (RANDOM_MAX / numprocs);
+
+	for (i=0; i<nkeys; i++) {
+		key = keys[i];
+
+		binnum = key / pivot;
+		if (key <= 0) {
+			complainx("proc %d: garbage key %d", me, key);
+			key = 0;
+		}
+		assert(binnum >= 0);
+		assert(binnum < numprocs);
+		dowrite("bin", outfds[binnum], &key, sizeof(key));
+	}
+}
+
+/*
+ * Each process maps its share of the key file rather than reading it,
+ * so the keys are used straight out of the file's pages instead of
+ * being copied into the workspace first. The mapping has to start on
+ * a page boundary, so it may begin a little before our first key.
+ *
+ * If the file can't be mapped (emufs can't), read it through the
+ * workspace instead.
+ */
 static
 void
 bin(void)
 {
 	int infd, outfds[numprocs];
 	const char *name;
-	int i, mykeys, keys_done, keys_to_do;
-	int key, pivot, binnum;
+	int i, mykeys, keys_per, keys_done, keys_to_do;
+	off_t myoffset, mapoffset;
+	size_t maplen;
+	const void *map;
 
 	infd = doopen(PATH_KEYS, O_RDONLY, 0);
 
 	mykeys = getmykeys();
-	seekmyplace(PATH_KEYS, infd);
+	keys_per = numkeys / numprocs;
+	myoffset = (off_t)me * keys_per * sizeof(int);
+	mapoffset = myoffset - myoffset % PAGESIZE;
+	maplen = (myoffset - mapoffset) + mykeys * sizeof(int);
+
+	map = NULL;
+	if (mykeys > 0) {
+		map = domap(infd, maplen, mapoffset);
+	}
 
 	for (i=0; i<numprocs; i++) {
 		name = binname(me, i);
 		outfds[i] = doopen(name, O_WRONLY|O_CREAT|O_TRUNC, 0664);
 	}
 
-	pivot = (RANDOM_MAX / numprocs);
-
-	keys_done = 0;
-	while (keys_done < mykeys) {
-		keys_to_do = mykeys - keys_done;
-		if (keys_to_do > WORKNUM) {
-			keys_to_do = WORKNUM;
-		}
-
-		doexactread(PATH_KEYS, infd, workspace,
-			    keys_to_do * sizeof(int));
-
-		for (i=0; i<keys_to_do; i++) {
-			key = workspace[i];
+	if (map != NULL) {
+		binkeys(outfds, (const int *)((const char *)map +
+					      (myoffset - mapoffset)),
+			mykeys);
+		dounmap(PATH_KEYS, map, maplen);
+	}
+	else {
+		seekmyplace(PATH_KEYS, infd);
 
-			binnum = key / pivot;
-			if (key <= 0) {
-				complainx("proc %d: garbage key %d", me, key);
-				key = 0;
+		keys_done = 0;
+		while (keys_done < mykeys) {
+			keys_to_do = mykeys - keys_done;
+			if (keys_to_do > WORKNUM) {
+				keys_to_do = WORKNUM;
 			}
-			assert(binnum >= 0);
-			assert(binnum < numprocs);
-			dowrite("bin", outfds[binnum], &key, sizeof(key));
-		}
 
-		keys_done += keys_to_do;
+			doexactread(PATH_KEYS, infd, workspace,
+				    keys_to_do * sizeof(int));
+			binkeys(outfds, workspace, keys_to_do);
+			keys_done += keys_to_do;
+		}
 	}
 	doclose(PATH_KEYS, infd);
 
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * tlbbench - measure the cost of a TLB refill.
+ *
+ * Faults in NPAGES pages of a bss array, more than the TLB can hold,
+ * and then touches them round and round. The pages stay in memory, so
+ * every touch that misses in the TLB goes through the kernel's fault
+ * path (vm_fault/as_fault) just to reload the mapping, which is the
+ * part this measures. The same number of touches to a single page,
+ * which stays in the TLB, is timed too and subtracted as loop
+ * overhead.
+ *
+ * The result is printed in ns and in cycles at MHZ (System/161's
+ * nominal 25 MHz by default). With fewer pages than the TLB has
+ * entries (64) there should be no misses at all, which makes a handy
+ * sanity check.
+ *
+ * Usage: tlbbench [npages [mhz]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define NPAGES     256
+#define PAGESIZE   4096
+#define NPASSES    32
+#define MHZ        25
+
+static volatile char data[NPAGES * PAGESIZE];
+
+static
+unsigned long long
+now(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return secs * 1000000000ULL + nsecs;
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long long start, nsecs, basensecs;
+	unsigned long ntouches;
+	int npages, mhz, i, j;
+
+	npages = NPAGES;
+	mhz = MHZ;
+	if (argc > 1) {
+		npages = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		mhz = atoi(argv[2]);
+	}
+	if (npages <= 0 || npages > NPAGES || mhz <= 0) {
+		errx(1, "Usage: tlbbench [npages [mhz]] (at most %d pages)",
+		     NPAGES);
+	}
+	ntouches = (unsigned long)npages * NPASSES;
+
+	/* fault everything in first */
+	for (i=0; i<npages; i++) {
+		data[i*PAGESIZE] = 1;
+	}
+
+	start = now();
+	for (j=0; j<NPASSES; j++) {
+		for (i=0; i<npages; i++) {
+			data[0] = 1;
+		}
+	}
+	basensecs = now() - start;
+
+	start = now();
+	for (j=0; j<NPASSES; j++) {
+		for (i=0; i<npages; i++) {
+			data[i*PAGESIZE] = 1;
+		}
+	}
+	nsecs = now() - start;
+	nsecs = nsecs > basensecs ? nsecs - basensecs : 0;
+
+	printf("tlbbench: %lu touches of %d pages in %lu.%09lu s "
+	       "(less loop overhead)\n", ntouches, npages,
+	       (unsigned long)(nsecs / 1000000000ULL),
+	       (unsigned long)(nsecs % 1000000000ULL));
+	printf("tlbbench: %lu ns, %lu cycles at %d MHz per touch\n",
+	       (unsigned long)(nsecs / ntouches),
+	       (unsigned long)(nsecs * mhz / 1000 / ntouches), mhz);
+	return 0;
+}